@@ -2,5 +2,10 @@ require 'mkmf'
 
 $CFLAGS += " -W -Wall"
 
+# The vendored runtime headers in includes/gazelle take precedence over an
+# installed copy of gazelle.
+$INCFLAGS = "-I$(srcdir)/includes #{$INCFLAGS}"
+
 dir_config("gazelle_ruby_bindings")
+have_func("rb_ary_resize")
 create_makefile("gazelle_ruby_bindings")
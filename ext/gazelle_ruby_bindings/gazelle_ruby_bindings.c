@@ -7,28 +7,207 @@
 #include <gazelle/dynarray.h>
 #include "includes/bc_read_stream.c"
 #include "includes/load_grammar.c"
+#include "includes/profile.c"
+#include "includes/optimize.c"
 #include "includes/parse.c"
+#include "includes/threaded.c"
+#include "includes/generated.c"
+#include "includes/prefilter.c"
+#include "includes/incremental.c"
+#include "includes/serialize.c"
+#include "includes/lockstep.c"
+#include "includes/stats.c"
+#ifndef GAZELLE_COMPILED_GRAMMAR
+#include "includes/codegen.c"
+#endif
 #include "gazelle_ruby_bindings.h"
 
-/* ERROR FUNCTIONS */
-static int terminal_error = 0;
+/* Grammars */
+static VALUE Gazelle_Grammar;
 
-static void error_char_callback() {
-  // TODO: do something intelligent here
+static void free_rb_grammar(RbGrammar *rb_grammar) {
+  gzl_free_parse_state_pool(&rb_grammar->pool);
+  free(rb_grammar->names.rtn_ids);
+  free(rb_grammar->names.keys);
+  free(rb_grammar->names.ids);
+  if (rb_grammar->owns_grammar)
+    gzl_free_grammar(rb_grammar->grammar);
+  free(rb_grammar);
 }
 
-static void error_terminal_callback() {
-  terminal_error = 1;
+static VALUE wrap_rb_grammar(struct gzl_grammar *grammar, bool owns_grammar) {
+  RbGrammar *rb_grammar = calloc(1, sizeof(*rb_grammar));
+  rb_grammar->grammar      = grammar;
+  rb_grammar->owns_grammar = owns_grammar;
+  gzl_init_parse_state_pool(&rb_grammar->pool);
+
+  return Data_Wrap_Struct(Gazelle_Grammar, 0, free_rb_grammar, rb_grammar);
+}
+
+/* The grammar's name ids (see struct rb_gzl_names). */
+static size_t name_slot(RbNames *names, char *name) {
+  size_t slot = ((uintptr_t) name >> 4) & names->mask;
+  while (names->keys[slot] && names->keys[slot] != name)
+    slot = (slot + 1) & names->mask;
+  return slot;
+}
+
+static long name_id(RbNames *names, char *name) {
+  size_t slot = name_slot(names, name);
+  return names->keys[slot] ? names->ids[slot] : -1;
+}
+
+static RbNames *grammar_names(RbGrammar *rb_grammar) {
+  struct gzl_grammar *grammar = rb_grammar->grammar;
+  RbNames *names = &rb_grammar->names;
+  size_t size    = 2;
+  long i;
+
+  if (names->rtn_ids)
+    return names;
+
+  while (grammar->strings[names->num_names])
+    names->num_names++;
+  while (size < 2 * (size_t) names->num_names)
+    size *= 2;
+
+  names->mask = size - 1;
+  names->keys = calloc(size, sizeof(char*));
+  names->ids  = calloc(size, sizeof(long));
+  for (i = 0; i < names->num_names; i++) {
+    size_t slot = name_slot(names, grammar->strings[i]);
+    names->keys[slot] = grammar->strings[i];
+    names->ids[slot]  = i;
+  }
+
+  names->rtn_ids = calloc(grammar->num_rtns, sizeof(long));
+  for (i = 0; i < grammar->num_rtns; i++)
+    names->rtn_ids[i] = name_id(names, grammar->rtns[i].name);
+
+  return names;
+}
+
+/* Lays the grammar out by the profile in @profile, if there is one; see
+ * profile.c.  Raises if the profile was taken with some other grammar. */
+static void apply_parser_profile(VALUE self, struct gzl_grammar *grammar) {
+  VALUE profile = rb_iv_get(self, "@profile");
+  if (NIL_P(profile))
+    return;
+
+  FILE *in = fopen(RSTRING_PTR(profile), "r");
+  if (!in)
+    rb_sys_fail(RSTRING_PTR(profile));
+
+  bool applied = gzl_apply_profile(grammar, in);
+  fclose(in);
+  if (!applied)
+    rb_raise(rb_eArgError, "%s is not a profile of this grammar", RSTRING_PTR(profile));
+}
+
+static VALUE intfa_sizes_hash(struct gzl_intfa_sizes *sizes) {
+  VALUE hash = rb_hash_new();
+  rb_hash_aset(hash, ID2SYM(rb_intern("intfas")),      INT2FIX(sizes->intfas));
+  rb_hash_aset(hash, ID2SYM(rb_intern("states")),      INT2FIX(sizes->states));
+  rb_hash_aset(hash, ID2SYM(rb_intern("transitions")), INT2FIX(sizes->transitions));
+  rb_hash_aset(hash, ID2SYM(rb_intern("bytes")),       ULONG2NUM(sizes->bytes));
+  return hash;
+}
+
+/* With @optimize set, minimizes and shares the grammar's IntFAs (see
+ * optimize.c) and keeps what that saved in @optimization_report. */
+static void optimize_parser_grammar(VALUE self, struct gzl_grammar *grammar) {
+  if (!RTEST(rb_iv_get(self, "@optimize")))
+    return;
+
+  struct gzl_optimize_report report;
+  gzl_optimize_grammar(grammar, &report);
+
+  VALUE hash = rb_hash_new();
+  rb_hash_aset(hash, ID2SYM(rb_intern("before")), intfa_sizes_hash(&report.before));
+  rb_hash_aset(hash, ID2SYM(rb_intern("after")),  intfa_sizes_hash(&report.after));
+  rb_iv_set(self, "@optimization_report", hash);
 }
 
-static void reset_terminal_error() {
-  terminal_error = 0;
+/* Loads the parser's grammar the first time it is needed and keeps it (along
+ * with a pool of parse states) in @grammar. Returns NULL if the file can't be
+ * read as a grammar. */
+static RbGrammar *rb_parser_grammar(VALUE self) {
+  VALUE grammar_obj = rb_iv_get(self, "@grammar");
+  RbGrammar *rb_grammar;
+
+  if (NIL_P(grammar_obj)) {
+    char *filename = RSTRING_PTR(rb_iv_get(self, "@filename"));
+
+    struct bc_read_stream *s = bc_rs_open_file(filename);
+    if (!s)
+      return NULL; // should raise an invalid file format error in ruby instead
+
+    struct gzl_grammar *grammar = gzl_load_grammar(s);
+    bc_rs_close_stream(s);
+    grammar_obj = wrap_rb_grammar(grammar, true);
+    apply_parser_profile(self, grammar);
+    optimize_parser_grammar(self, grammar);
+    rb_iv_set(self, "@grammar", grammar_obj);
+  }
+
+  Data_Get_Struct(grammar_obj, RbGrammar, rb_grammar);
+  return rb_grammar;
 }
 
 /* General Gazelle integration */
-static void rb_gzl_parse(char *input, ParseState *state, BoundGrammar *bg) {
-  gzl_init_parse_state(state, bg);
-  gzl_parse(state, input, strlen(input) + 1);
+typedef enum gzl_status (*ParseFunction)(ParseState *state, char *buf, size_t buf_len);
+
+struct rb_gzl_parse_args {
+  RbGrammar       *rb_grammar;
+  ParseState      *state;
+  ParseFunction   parse;
+  char            *input;
+  size_t          input_len;
+  enum gzl_status status;
+};
+
+/* Passed after a Ruby string's bytes, which needn't be followed by a NUL. */
+static char end_of_input = '\0';
+
+/* Parses the input from wherever the state has got to, then the NUL that ends
+ * it. */
+static enum gzl_status parse_input(ParseFunction parse, ParseState *state, char *input, size_t input_len) {
+  size_t from = state->offset.byte;
+
+  if (from < input_len) {
+    enum gzl_status status = parse(state, input + from, input_len - from);
+    if (status != GZL_STATUS_OK)
+      return status;
+  }
+  return parse(state, &end_of_input, 1);
+}
+
+static VALUE rb_gzl_parse(VALUE args) {
+  struct rb_gzl_parse_args *parse_args = (struct rb_gzl_parse_args *) args;
+  parse_args->status = parse_input(parse_args->parse, parse_args->state, parse_args->input, parse_args->input_len);
+  return Qnil;
+}
+
+/* Parser#engine picks the main loop: the threaded one (or the generated code,
+ * for compiled grammars) unless :interpreter is asked for.  Without callbacks
+ * (parse?) we run the engine's recognizer, which skips all the callback and
+ * line/column bookkeeping.  Only the interpreter keeps a profile, so it is
+ * always used while profiling. */
+static ParseFunction parse_function_for(VALUE self, RbGrammar *rb_grammar, bool run_callbacks) {
+  bool interpreter = rb_grammar->grammar->profile ||
+                     rb_iv_get(self, "@engine") == ID2SYM(rb_intern("interpreter"));
+
+  if (run_callbacks)
+    return interpreter ? gzl_parse : gzl_parse_generated;
+  else
+    return interpreter ? gzl_recognize : gzl_recognize_generated;
+}
+
+/* Runs even if a callback raises, so the state always goes back to the pool. */
+static VALUE rb_gzl_release_state(VALUE args) {
+  struct rb_gzl_parse_args *parse_args = (struct rb_gzl_parse_args *) args;
+  gzl_release_parse_state(&parse_args->rb_grammar->pool, parse_args->state);
+  return Qnil;
 }
 
 static VALUE user_data_obj(RbUserData *user_data) {
@@ -39,114 +218,2023 @@ static VALUE user_data_input(RbUserData *user_data) {
   return(user_data->rb_input);
 }
 
-static VALUE rb_str_boundaries(VALUE str, int start, int end) {
-  VALUE range  = rb_funcall(rb_cRange, rb_intern("new"), 2, INT2FIX(start), INT2FIX(end));
-  return rb_funcall(str, rb_intern("[]"), 1, range);
+/* str[start...end], sharing str's bytes rather than copying them. */
+static VALUE rb_str_boundaries(VALUE str, size_t start, size_t end) {
+  return rb_str_substr(str, (long) start, (long) (end - start));
+}
+
+/* A rule's text runs from its first terminal to the end of its last one, not
+ * on into the lookahead that told the parser the rule had ended. */
+static size_t rule_end(RbUserData *user_data, ParseStackFrame *frame) {
+  size_t start = frame->start_byte;
+  size_t end   = user_data->terminal_end;
+
+  return end > start ? end : start;
+}
+
+/* What a rule or terminal's action is given: its text, or in a push parse
+ * (see Parser#feed), where only a still-open terminal's bytes are kept, a
+ * rule's offsets as a Range. */
+static VALUE action_text(RbUserData *user_data, bool terminal, size_t start, size_t end) {
+  if (user_data->push && !terminal)
+    return rb_range_new(ULONG2NUM(start), ULONG2NUM(end), 1);
+  return rb_str_boundaries(user_data_input(user_data), start - user_data->base, end - user_data->base);
+}
+
+/* Parser#stop!, called from a rule, stops the parse once the rule returns. */
+static void cancel_if_stopped(ParseState *parse_state, VALUE self) {
+  if (RTEST(rb_iv_get(self, "@stopped")))
+    gzl_cancel_parse(parse_state);
+}
+
+/* The parser's rule dispatch table (see struct rb_gzl_dispatch), built from
+ * @rules the first time it's needed after Parser#on or #debug= reset it. */
+static void free_rb_dispatch(RbDispatch *dispatch) {
+  long i;
+  if (dispatch->paths) {
+    for (i = 0; i < dispatch->names->num_names; i++) {
+      struct rb_gzl_path *path = dispatch->paths[i];
+      while (path) {
+        struct rb_gzl_path *next = path->next;
+        free(path->ancestors);
+        free(path);
+        path = next;
+      }
+    }
+    free(dispatch->paths);
+  }
+  free(dispatch->rules);
+  free(dispatch);
+}
+
+static long name_id_of(RbGrammar *rb_grammar, const char *name, size_t len) {
+  char **strings = rb_grammar->grammar->strings;
+  long i;
+  for (i = 0; i < rb_grammar->names.num_names; i++)
+    if (strncmp(strings[i], name, len) == 0 && strings[i][len] == '\0')
+      return i;
+  return -1;
+}
+
+/* Compiles a handler's path, as in "column_name/UNQUOTED_ID", onto the end
+ * of the paths for its last name.  A path naming something the grammar
+ * doesn't have can never match, so is left out. */
+static void add_path(RbGrammar *rb_grammar, RbDispatch *dispatch, VALUE action) {
+  const char *name = rb_id2name(SYM2ID(action));
+  int num_names    = 1;
+  const char *c;
+
+  for (c = name; *c; c++)
+    if (*c == '/')
+      num_names++;
+
+  long *ids = malloc(num_names * sizeof(long));
+  int i = 0;
+  for (c = name; ; c++) {
+    if (*c == '/' || *c == '\0') {
+      if ((ids[i++] = name_id_of(rb_grammar, name, c - name)) < 0) {
+        free(ids);
+        return;
+      }
+      if (*c == '\0')
+        break;
+      name = c + 1;
+    }
+  }
+
+  struct rb_gzl_path *path = malloc(sizeof(*path));
+  path->action        = action;
+  path->num_ancestors = num_names - 1;
+  path->ancestors     = malloc(num_names * sizeof(long));
+  path->next          = NULL;
+  for (i = 0; i < path->num_ancestors; i++)
+    path->ancestors[i] = ids[path->num_ancestors - 1 - i];
+
+  struct rb_gzl_path **tail = &dispatch->paths[ids[num_names - 1]];
+  while (*tail)
+    tail = &(*tail)->next;
+  *tail = path;
+  free(ids);
+}
+
+/* A dispatch table for the handlers in rules, or for every name if all. */
+static VALUE build_dispatch(RbGrammar *rb_grammar, VALUE rules, bool all) {
+  RbNames *names = grammar_names(rb_grammar);
+  long i;
+
+  RbDispatch *dispatch = malloc(sizeof(*dispatch));
+  dispatch->names = names;
+  dispatch->rules = calloc(names->num_names, sizeof(VALUE));
+  dispatch->paths = NULL;
+  VALUE dispatch_obj = Data_Wrap_Struct(rb_cObject, 0, free_rb_dispatch, dispatch);
+
+  for (i = 0; i < names->num_names; i++) {
+    VALUE symbol = ID2SYM(rb_intern(rb_grammar->grammar->strings[i]));
+    if (all || RTEST(rb_hash_aref(rules, symbol)))
+      dispatch->rules[i] = symbol;
+  }
+
+  VALUE actions = rb_funcall(rules, rb_intern("keys"), 0);
+  for (i = 0; i < RARRAY_LEN(actions); i++) {
+    VALUE action = rb_ary_entry(actions, i);
+    if (!SYMBOL_P(action) || !strchr(rb_id2name(SYM2ID(action)), '/') ||
+        !RTEST(rb_hash_aref(rules, action)))
+      continue;
+    if (!dispatch->paths)
+      dispatch->paths = calloc(names->num_names, sizeof(struct rb_gzl_path*));
+    add_path(rb_grammar, dispatch, action);
+  }
+
+  return dispatch_obj;
+}
+
+static VALUE parser_dispatch(VALUE self, RbGrammar *rb_grammar) {
+  VALUE dispatch_obj = rb_iv_get(self, "@dispatch");
+  if (NIL_P(dispatch_obj)) {
+    dispatch_obj = build_dispatch(rb_grammar, rb_iv_get(self, "@rules"), RTEST(rb_iv_get(self, "@debug")));
+    rb_iv_set(self, "@dispatch", dispatch_obj);
+  }
+  return dispatch_obj;
+}
+
+static void use_dispatch(RbUserData *user_data) {
+  user_data->dispatch_obj = parser_dispatch(user_data->self, user_data->rb_grammar);
+  Data_Get_Struct(user_data->dispatch_obj, RbDispatch, user_data->dispatch);
+}
+
+/* Parser#run_rule sets @last_result to nil for a rule without a handler, so
+ * parse returns nil if the last rule had none; skipping the call has to do
+ * the same. */
+static void skip_rule(RbUserData *user_data) {
+  if (user_data->has_result) {
+    rb_iv_set(user_data->self, "@last_result", Qnil);
+    user_data->has_result = false;
+  }
+}
+
+static void run_rule(ParseState *parse_state, VALUE rule, VALUE text) {
+  RbUserData *user_data = parse_state->user_data;
+  VALUE self            = user_data_obj(user_data);
+
+  rb_funcall(self, rb_intern("run_rule"), 2, rule, text);
+  user_data->has_result = true;
+  cancel_if_stopped(parse_state, self);
+
+  if (rb_iv_get(self, "@dispatch") != user_data->dispatch_obj)
+    use_dispatch(user_data);
+}
+
+/* Whether the rules enclosing an event, from the frame at depth in the parse
+ * stack down to the bottom, include path's ancestors in order. */
+static bool path_matches(ParseState *parse_state, RbNames *names, struct rb_gzl_path *path, long depth) {
+  int matched = 0;
+  for (; depth >= 0 && matched < path->num_ancestors; depth--) {
+    ParseStackFrame *frame = &parse_state->parse_stack[depth];
+    if (frame->frame_type == GZL_FRAME_TYPE_RTN &&
+        names->rtn_ids[frame->f.rtn_frame.rtn] == path->ancestors[matched])
+      matched++;
+  }
+  return matched == path->num_ancestors;
 }
 
-static VALUE rb_user_data_input(ParseState *parse_state, ParseStackFrame *frame) {
-  VALUE rb_input = user_data_input(parse_state->user_data);
-  size_t start = frame->start_offset.byte;
-  size_t end   = parse_state->offset.byte;
+/* Runs rule, if there is one, then each handler whose path ends in the name
+ * id and matches the rules enclosing the event (see path_matches()), each
+ * given the text from start to end.  Returns whether any ran. */
+static bool run_rules(ParseState *parse_state, VALUE rule, long id, long depth, bool terminal,
+                      size_t start, size_t end) {
+  RbUserData *user_data = parse_state->user_data;
+  RbDispatch *dispatch  = user_data->dispatch;
+
+  /* A rule may replace the dispatch table; this one has to last until the
+   * event's handlers have all run. */
+  volatile VALUE dispatch_obj = user_data->dispatch_obj;
+  struct rb_gzl_path *path;
+  bool ran = false;
+
+  if (rule) {
+    run_rule(parse_state, rule, action_text(user_data, terminal, start, end));
+    ran = true;
+  }
+  if (!dispatch->paths || id < 0)
+    return ran;
+
+  for (path = dispatch->paths[id]; path; path = path->next) {
+    if (ran && RTEST(rb_iv_get(user_data->self, "@stopped")))
+      break;
+    if (!path_matches(parse_state, dispatch->names, path, depth))
+      continue;
+    run_rule(parse_state, path->action, action_text(user_data, terminal, start, end));
+    ran = true;
+  }
 
-  return rb_str_boundaries(rb_input, (int) start, (int) end);
+  (void) dispatch_obj;
+  return ran;
 }
 
 static void end_rule_callback(ParseState *parse_state)
 {
   struct gzl_parse_stack_frame *frame      = DYNARRAY_GET_TOP(parse_state->parse_stack);
   struct gzl_rtn_frame         *rtn_frame  = &frame->f.rtn_frame;
-  
-  VALUE self            = user_data_obj(parse_state->user_data);
-  
-  char *rule_name       = rtn_frame->rtn->name;
-
-  VALUE ruby_rule_name  = rb_str_new2(rule_name);
-  VALUE ruby_input      = rb_user_data_input(parse_state, frame);
+  RbUserData                   *user_data  = parse_state->user_data;
+  RbDispatch                   *dispatch   = user_data->dispatch;
 
-  rb_funcall(self, rb_intern("run_rule"), 2, ruby_rule_name, ruby_input);
+  long id    = dispatch->names->rtn_ids[rtn_frame->rtn];
+  VALUE rule = dispatch->rules[id];
+  if ((!rule && !(dispatch->paths && dispatch->paths[id])) ||
+      !run_rules(parse_state, rule, id, (long) parse_state->parse_stack_len - 2, false,
+                 frame->start_byte, rule_end(user_data, frame)))
+    skip_rule(user_data);
 }
 
 static void terminal_callback(ParseState *parse_state, struct gzl_terminal *terminal) {
+  RbUserData *user_data = parse_state->user_data;
+  RbDispatch *dispatch  = user_data->dispatch;
+  size_t start = terminal->start_byte;
+  size_t end   = start + terminal->len;
 
-  VALUE rb_input = user_data_input(parse_state->user_data);
-  size_t start = terminal->offset.byte;
-  size_t end   = start + terminal->len - 1;
+  user_data->terminal_end = end;
 
-  VALUE ruby_rule_name = rb_str_new2(terminal->name);
-  VALUE ruby_input = rb_str_boundaries(rb_input, (int) start, (int) end);
-  VALUE self       = user_data_obj(parse_state->user_data);
-
-  rb_funcall(self, rb_intern("run_rule"), 2, ruby_rule_name, ruby_input);
+  long id    = name_id(dispatch->names, terminal->name);
+  VALUE rule = id >= 0 ? dispatch->rules[id] : 0;
+  if ((!rule && !(dispatch->paths && id >= 0 && dispatch->paths[id])) ||
+      !run_rules(parse_state, rule, id, (long) parse_state->parse_stack_len - 1, true, start, end))
+    skip_rule(user_data);
 }
 
-static void mk_user_data(ParseState *state, VALUE self, char *input, VALUE rb_input) {
-  RbUserData *data = malloc(sizeof(RbUserData *));
-  
-  data->self     = self;
-  data->input    = input;
-  data->rb_input = rb_input;
-  
-  state->user_data = data;
+static void mk_user_data(RbUserData *data, VALUE self, RbGrammar *rb_grammar, char *input, VALUE rb_input) {
+  data->self         = self;
+  data->rb_grammar   = rb_grammar;
+  data->input        = input;
+  data->rb_input     = rb_input;
+  data->terminal_end = 0;
+  data->base         = 0;
+  data->push         = false;
+  data->dispatch_obj = Qnil;
+  data->dispatch     = NULL;
+  data->has_result   = true;
 }
 
-static int run_grammar(VALUE self, char *filename, VALUE rb_input, char *input, bool run_callbacks) {
-  reset_terminal_error();
-  
-  struct bc_read_stream *s = bc_rs_open_file(filename);
-  if (!s)
-    return 1; // should raise an invalid file format error in ruby instead
+/* Returns the status of the parse, or GZL_STATUS_IO_ERROR if the grammar
+ * couldn't be loaded. */
+static enum gzl_status run_grammar(VALUE self, VALUE rb_input, char *input, bool run_callbacks) {
+  RbGrammar *rb_grammar = rb_parser_grammar(self);
+  if (!rb_grammar)
+    return GZL_STATUS_IO_ERROR;
 
-  struct gzl_grammar *g = gzl_load_grammar(s);
-  bc_rs_close_stream(s);
-  
-  ParseState *state = gzl_alloc_parse_state();
-  mk_user_data(state, self, input, rb_input);
-  
   BoundGrammar bg = {
-    .grammar           = g,
-    .error_char_cb     = error_char_callback,
-    .error_terminal_cb = error_terminal_callback
+    .grammar = rb_grammar->grammar
   };
   
   if (run_callbacks) {
     bg.end_rule_cb = end_rule_callback;
     bg.terminal_cb = terminal_callback;
+    rb_iv_set(self, "@stopped", Qfalse);
   }
-  
-  rb_gzl_parse(input, state, &bg);
 
-  return 0;
+  RbUserData user_data;
+  mk_user_data(&user_data, self, rb_grammar, input, rb_input);
+  if (run_callbacks)
+    use_dispatch(&user_data);
+
+  struct rb_gzl_parse_args args = {
+    .rb_grammar = rb_grammar,
+    .state      = gzl_acquire_parse_state(&rb_grammar->pool, &bg),
+    .parse      = parse_function_for(self, rb_grammar, run_callbacks),
+    .input      = input,
+    .input_len  = RSTRING_LEN(rb_input)
+  };
+  args.state->user_data = &user_data;
+
+  rb_ensure(rb_gzl_parse, (VALUE) &args, rb_gzl_release_state, (VALUE) &args);
+
+  return args.status;
+}
+
+/* Only a parse that got to the end of the input, or to the end of the
+ * grammar, accepted it; running out of stack or lookahead doesn't count. */
+static VALUE parse_succeeded(enum gzl_status status) {
+  return (status == GZL_STATUS_OK || status == GZL_STATUS_HARD_EOF) ? Qtrue : Qfalse;
 }
 
 static VALUE run_gazelle_parse(VALUE self, VALUE input, bool run_callbacks) {
-  VALUE compiled_file_stream = rb_iv_get(self, "@filename");
-  char *filename     = RSTRING_TO_PTR(compiled_file_stream);
-  char *input_string = RSTRING_TO_PTR(input);
-  
-  if (run_grammar(self, filename, input, input_string, run_callbacks))
+  /* Rules may do what they like with the string they were given (and with
+   * the text they're passed), so the parse reads a frozen copy, which shares
+   * the string's bytes rather than copying them. */
+  if (run_callbacks)
+    input = rb_str_new4(input);
+
+  char *input_string = RSTRING_PTR(input);
+  enum gzl_status status = run_grammar(self, input, input_string, run_callbacks);
+
+  return parse_succeeded(status);
+}
+
+/* Parser#parse(input, :budget => {...}) parses only as far as the budget
+ * allows (:bytes of input, :transitions of the grammar, or :seconds on the
+ * clock) and, if that isn't to the end, returns a Gazelle::PendingParse to
+ * carry on with later.  Each PendingParse#resume gets the same budget again.
+ * Resuming goes through the parser's private resume_parse, so that a compiled
+ * parser's state is only ever handled by its own runtime. */
+static VALUE Gazelle_PendingParse;
+
+static void mark_rb_pending_parse(RbPendingParse *pending) {
+  rb_gc_mark(pending->user_data.dispatch_obj);
+}
+
+static void free_rb_pending_parse(RbPendingParse *pending) {
+  if (pending->state)
+    gzl_free_parse_state(pending->state);
+  free(pending);
+}
+
+static size_t budget_option(VALUE budget, const char *name) {
+  VALUE value = rb_hash_aref(budget, ID2SYM(rb_intern(name)));
+  return NIL_P(value) ? 0 : NUM2ULONG(value);
+}
+
+struct rb_gzl_resume_args {
+  VALUE          obj;
+  RbPendingParse *pending;
+};
+
+static VALUE rb_pending_parse_run(VALUE args) {
+  RbPendingParse *pending = ((struct rb_gzl_resume_args *) args)->pending;
+  ParseState *state       = pending->state;
+  char *input             = pending->user_data.input;
+
+  /* Rules may have been added since the last stretch. */
+  use_dispatch(&pending->user_data);
+
+  state->budget = pending->budget;
+  if (pending->seconds > 0)
+    state->budget.deadline_ns = gzl_monotonic_ns() + (uint64_t)(pending->seconds * 1e9);
+
+  pending->status = GZL_STATUS_ERROR;  /* in case a callback raises */
+  pending->status = parse_input(pending->parse, state, input, RSTRING_LEN(pending->user_data.rb_input));
+  return Qnil;
+}
+
+/* Runs even if a callback raises; a parse that won't be resumed is done
+ * with its state. */
+static VALUE rb_pending_parse_finish(VALUE args) {
+  struct rb_gzl_resume_args *resume_args = (struct rb_gzl_resume_args *) args;
+  RbPendingParse *pending = resume_args->pending;
+
+  if (pending->status != GZL_STATUS_YIELD) {
+    gzl_free_parse_state(pending->state);
+    pending->state = NULL;
+    rb_iv_set(resume_args->obj, "@valid", parse_succeeded(pending->status));
+  }
+  return Qnil;
+}
+
+static VALUE rb_gazelle_resume_parse(VALUE self, VALUE obj) {
+  struct rb_gzl_resume_args args = { .obj = obj };
+  Data_Get_Struct(obj, RbPendingParse, args.pending);
+  if (!args.pending->state)
+    rb_raise(rb_eRuntimeError, "the parse has already finished");
+
+  rb_ensure(rb_pending_parse_run, (VALUE) &args, rb_pending_parse_finish, (VALUE) &args);
+
+  if (args.pending->status == GZL_STATUS_YIELD)
+    return obj;
+  return rb_ivar_get(self, rb_intern("@last_result"));
+}
+
+/* A PendingParse of input, at its start, not yet run. */
+static VALUE new_pending_parse(VALUE self, VALUE input, VALUE budget) {
+  RbGrammar *rb_grammar = rb_parser_grammar(self);
+  if (!rb_grammar)
+    rb_raise(rb_eArgError, "could not load the grammar");
+  Check_Type(budget, T_HASH);
+
+  RbPendingParse *pending = calloc(1, sizeof(*pending));
+  VALUE obj = Data_Wrap_Struct(Gazelle_PendingParse, mark_rb_pending_parse, free_rb_pending_parse, pending);
+
+  /* The parse keeps pointing into the input between stretches. */
+  input = rb_str_new4(input);
+  rb_iv_set(obj, "@parser", self);
+  rb_iv_set(obj, "@input",  input);
+
+  pending->bg.grammar     = rb_grammar->grammar;
+  pending->bg.end_rule_cb = end_rule_callback;
+  pending->bg.terminal_cb = terminal_callback;
+  rb_iv_set(self, "@stopped", Qfalse);
+  mk_user_data(&pending->user_data, self, rb_grammar, RSTRING_PTR(input), input);
+
+  pending->parse              = parse_function_for(self, rb_grammar, true);
+  pending->budget.bytes       = budget_option(budget, "bytes");
+  pending->budget.transitions = budget_option(budget, "transitions");
+  VALUE seconds = rb_hash_aref(budget, ID2SYM(rb_intern("seconds")));
+  pending->seconds = NIL_P(seconds) ? 0 : NUM2DBL(seconds);
+
+  pending->state = gzl_alloc_parse_state();
+  gzl_init_parse_state(pending->state, &pending->bg);
+  pending->state->user_data = &pending->user_data;
+
+  return obj;
+}
+
+static VALUE start_pending_parse(VALUE self, VALUE input, VALUE budget) {
+  return rb_gazelle_resume_parse(self, new_pending_parse(self, input, budget));
+}
+
+/* PendingParse#save(path) writes the parse's state to a file, and
+ * PendingParse#restore(path) or Parser#load_parse(path, input) pick it up
+ * again, in this process or another (see serialize.c).  The input isn't
+ * saved; the same input must be given again.  Nor is @last_result, so a
+ * loaded parse's result is that of the rules run since it was loaded. */
+static FILE *open_state_file(VALUE path, const char *mode) {
+  FilePathValue(path);
+  FILE *file = fopen(StringValueCStr(path), mode);
+  if (!file)
+    rb_sys_fail(StringValueCStr(path));
+  return file;
+}
+
+static RbPendingParse *unfinished_parse(VALUE obj) {
+  RbPendingParse *pending;
+  Data_Get_Struct(obj, RbPendingParse, pending);
+  if (!pending->state)
+    rb_raise(rb_eRuntimeError, "the parse has already finished");
+  return pending;
+}
+
+static VALUE rb_gazelle_save_parse(VALUE self, VALUE obj, VALUE path) {
+  RbPendingParse *pending = unfinished_parse(obj);
+  FILE *file = open_state_file(path, "w");
+  bool ok    = gzl_serialize_parse_state(pending->state, file);
+
+  if (fclose(file) != 0 || !ok)
+    rb_sys_fail(StringValueCStr(path));
+  return obj;
+}
+
+/* Returns false, leaving the parse as it was, if the file isn't a saved state
+ * of this parser's grammar. */
+static VALUE rb_gazelle_restore_parse(VALUE self, VALUE obj, VALUE path) {
+  RbPendingParse *pending = unfinished_parse(obj);
+  FILE *file = open_state_file(path, "r");
+  bool ok    = gzl_deserialize_parse_state(pending->state, file);
+  fclose(file);
+
+  return ok ? Qtrue : Qfalse;
+}
+
+static VALUE rb_gazelle_load_parse(int argc, VALUE *argv, VALUE self) {
+  VALUE path, input, options, budget = Qnil;
+  rb_scan_args(argc, argv, "21", &path, &input, &options);
+  StringValue(input);
+
+  if (!NIL_P(options))
+    budget = rb_hash_aref(options, ID2SYM(rb_intern("budget")));
+  VALUE obj = new_pending_parse(self, input, NIL_P(budget) ? rb_hash_new() : budget);
+
+  if (!RTEST(rb_gazelle_restore_parse(self, obj, path)))
+    rb_raise(rb_eArgError, "%s is not a saved parse of this grammar", StringValueCStr(path));
+  return obj;
+}
+
+/* Parser#start, #feed(chunk) and #finish: a parse of input given a chunk at a
+ * time, as it arrives, running rules as parse does.  The parse lives in the
+ * parser's @push_parse between calls.  After each chunk only the bytes of
+ * terminals that are still open (from the state's open_terminal_offset on)
+ * are kept, so a rule's action is given its offsets rather than its text (see
+ * action_text()). */
+static void mark_rb_push_parse(RbPushParse *push) {
+  rb_gc_mark(push->user_data.dispatch_obj);
+  rb_gc_mark(push->user_data.rb_input);
+  rb_gc_mark(push->kept);
+}
+
+static void free_rb_push_parse(RbPushParse *push) {
+  if (push->state)
+    gzl_free_parse_state(push->state);
+  free(push);
+}
+
+/* Raises if the parse is in the middle of a chunk, as when a rule calls
+ * start, feed or finish. */
+static void check_not_running(VALUE obj) {
+  RbPushParse *push;
+  Data_Get_Struct(obj, RbPushParse, push);
+  if (push->running)
+    rb_raise(rb_eRuntimeError, "the parse is already parsing a chunk");
+}
+
+/* The Data object, rather than the RbPushParse, so that the caller holds on
+ * to it: rules may run Ruby, and with it the GC, while it is in use. */
+static VALUE live_push_parse(VALUE self) {
+  VALUE obj = rb_iv_get(self, "@push_parse");
+  if (NIL_P(obj))
+    rb_raise(rb_eRuntimeError, "no parse has been started");
+  check_not_running(obj);
+  return obj;
+}
+
+static VALUE rb_gazelle_start(VALUE self) {
+  VALUE running = rb_iv_get(self, "@push_parse");
+  if (!NIL_P(running))
+    check_not_running(running);
+
+  RbGrammar *rb_grammar = rb_parser_grammar(self);
+  if (!rb_grammar)
+    rb_raise(rb_eArgError, "could not load the grammar");
+
+  RbPushParse *push = calloc(1, sizeof(*push));
+  VALUE obj = Data_Wrap_Struct(rb_cObject, mark_rb_push_parse, free_rb_push_parse, push);
+
+  push->bg.grammar     = rb_grammar->grammar;
+  push->bg.end_rule_cb = end_rule_callback;
+  push->bg.terminal_cb = terminal_callback;
+  mk_user_data(&push->user_data, self, rb_grammar, NULL, Qnil);
+  push->user_data.push = true;
+
+  push->kept   = rb_str_new(0, 0);
+  push->parse  = parse_function_for(self, rb_grammar, true);
+  push->status = GZL_STATUS_OK;
+  push->state  = gzl_alloc_parse_state();
+  gzl_init_parse_state(push->state, &push->bg);
+  push->state->user_data = &push->user_data;
+
+  rb_iv_set(self, "@stopped", Qfalse);
+  rb_iv_set(self, "@push_parse", obj);
+  return self;
+}
+
+/* Runs even if a rule raises: a parse that can't go on is done with its
+ * state. */
+static VALUE rb_push_parse_stop(VALUE args) {
+  RbPushParse *push = (RbPushParse *) args;
+
+  push->running = false;
+  if (push->status != GZL_STATUS_OK && push->state) {
+    gzl_free_parse_state(push->state);
+    push->state = NULL;
+  }
+  return Qnil;
+}
+
+struct rb_gzl_feed_args {
+  RbPushParse *push;
+  char        *buf;
+  size_t      len;
+};
+
+static VALUE rb_push_parse_feed(VALUE args) {
+  struct rb_gzl_feed_args *feed_args = (struct rb_gzl_feed_args *) args;
+  RbPushParse *push = feed_args->push;
+
+  /* Rules may have been added since the last chunk. */
+  use_dispatch(&push->user_data);
+
+  push->status = GZL_STATUS_ERROR;  /* in case a rule raises */
+  push->status = push->parse(push->state, feed_args->buf, feed_args->len);
+  return Qnil;
+}
+
+/* Parser#feed(chunk): parses chunk on from the last one.  Returns whether the
+ * parse can take more input: false once the input is known to be invalid, or
+ * the grammar has come to its end. */
+static VALUE rb_gazelle_feed(VALUE self, VALUE chunk) {
+  VALUE obj = live_push_parse(self);
+  RbPushParse *push;
+  Data_Get_Struct(obj, RbPushParse, push);
+  StringValue(chunk);
+  if (!push->state)
     return Qfalse;
 
-  return(terminal_error ? Qfalse : Qtrue);
+  /* The bytes still kept, then the chunk, frozen so that the text rules are
+   * given can share it. */
+  long kept_len = RSTRING_LEN(push->kept);
+  VALUE input   = rb_str_buf_new(kept_len + RSTRING_LEN(chunk));
+  rb_str_buf_cat(input, RSTRING_PTR(push->kept), kept_len);
+  rb_str_buf_cat(input, RSTRING_PTR(chunk), RSTRING_LEN(chunk));
+  rb_obj_freeze(input);
+
+  push->user_data.rb_input = input;
+  push->user_data.input    = RSTRING_PTR(input);
+  push->user_data.base     = push->base;
+
+  struct rb_gzl_feed_args args = {
+    .push = push,
+    .buf  = RSTRING_PTR(input) + kept_len,
+    .len  = RSTRING_LEN(chunk)
+  };
+  push->running = true;
+  rb_ensure(rb_push_parse_feed, (VALUE) &args, rb_push_parse_stop, (VALUE) push);
+
+  if (push->state) {
+    size_t keep_from = push->state->open_terminal_offset - push->base;
+    push->kept = rb_str_new(RSTRING_PTR(input) + keep_from, RSTRING_LEN(input) - keep_from);
+    push->base = push->state->open_terminal_offset;
+  } else {
+    push->kept = rb_str_new(0, 0);
+  }
+  push->user_data.rb_input = Qnil;
+
+  VALUE more = push->status == GZL_STATUS_OK ? Qtrue : Qfalse;
+  RB_GC_GUARD(obj);
+  return more;
+}
+
+static VALUE rb_push_parse_finish(VALUE args) {
+  RbPushParse *push = (RbPushParse *) args;
+
+  use_dispatch(&push->user_data);
+  push->user_data.rb_input = push->kept;
+  push->user_data.input    = RSTRING_PTR(push->kept);
+  push->user_data.base     = push->base;
+
+  push->status = GZL_STATUS_ERROR;  /* in case a rule raises */
+  push->status = gzl_finish_parse(push->state) ? GZL_STATUS_HARD_EOF : GZL_STATUS_PREMATURE_EOF_ERROR;
+  return Qnil;
+}
+
+struct rb_gzl_finish_args {
+  VALUE       self;
+  RbPushParse *push;
+};
+
+/* Runs even if a rule raises: the parse is over either way. */
+static VALUE rb_push_parse_finished(VALUE args) {
+  struct rb_gzl_finish_args *finish_args = (struct rb_gzl_finish_args *) args;
+
+  rb_push_parse_stop((VALUE) finish_args->push);
+  rb_iv_set(finish_args->self, "@push_parse", Qnil);
+  return Qnil;
+}
+
+/* Parser#finish: tells the parse its input is complete, running any rules
+ * that only end there.  Returns whether the input parsed. */
+static VALUE rb_gazelle_finish(VALUE self) {
+  VALUE obj = live_push_parse(self);
+  RbPushParse *push;
+  Data_Get_Struct(obj, RbPushParse, push);
+
+  struct rb_gzl_finish_args args = {
+    .self = self,
+    .push = push
+  };
+
+  /* A parse that has already stopped has its status.  Reaching the end of
+   * the grammar before the end of the input is fine, as with
+   * gzl_parse_file(); the rest of the input just isn't looked at. */
+  if (push->state) {
+    push->running = true;
+    rb_ensure(rb_push_parse_finish, (VALUE) push, rb_push_parse_finished, (VALUE) &args);
+  } else {
+    rb_push_parse_finished((VALUE) &args);
+  }
+
+  VALUE parsed = parse_succeeded(push->status);
+  RB_GC_GUARD(obj);
+  return parsed;
 }
 
 /* Public Ruby methods */
 static VALUE rb_gazelle_parse_p(VALUE self, VALUE input) {
+  StringValue(input);
+  RbGrammar *rb_grammar = rb_parser_grammar(self);
+  char *input_string    = RSTRING_PTR(input);
+
+  /* Turn away input that can't parse before acquiring a parse state. */
+  if (rb_grammar && gzl_prefilter_rejects(rb_grammar->grammar, input_string, RSTRING_LEN(input)))
+    return Qfalse;
+
   return run_gazelle_parse(self, input, false);
 }
 
-static VALUE rb_gazelle_parse(VALUE self, VALUE input) {
+static VALUE rb_gazelle_parse(int argc, VALUE *argv, VALUE self) {
+  VALUE input, options;
+  rb_scan_args(argc, argv, "11", &input, &options);
+  StringValue(input);
+
+  if (!NIL_P(options)) {
+    VALUE budget = rb_hash_aref(options, ID2SYM(rb_intern("budget")));
+    if (!NIL_P(budget))
+      return start_pending_parse(self, input, budget);
+  }
+
   run_gazelle_parse(self, input, true);
   return rb_ivar_get(self, rb_intern("@last_result"));
 }
 
-/* Hook up the ruby methods.  Similar to lua's luaopen_(mod) functions */
-void Init_gazelle_ruby_bindings() {
-  VALUE Gazelle         = rb_const_get(rb_cObject, rb_intern("Gazelle"));
-  VALUE Gazelle_Parser  = rb_const_get_at(Gazelle, rb_intern("Parser"));
+/* Parser#parse_file?(path) is parse? for the contents of a file, read a piece
+ * at a time: only as much of it is kept in memory as the token being lexed
+ * needs, however big the file is. */
+static VALUE rb_gazelle_parse_file_p(VALUE self, VALUE path) {
+  FilePathValue(path);
+  RbGrammar *rb_grammar = rb_parser_grammar(self);
+  if (!rb_grammar)
+    return Qfalse;
 
-  rb_define_method(Gazelle_Parser, "parse?", rb_gazelle_parse_p, 1);
-  rb_define_method(Gazelle_Parser, "parse",  rb_gazelle_parse, 1);
+  FILE *file = fopen(StringValueCStr(path), "rb");
+  if (!file)
+    rb_sys_fail(StringValueCStr(path));
+
+  BoundGrammar bg = {
+    .grammar = rb_grammar->grammar
+  };
+  ParseState *state      = gzl_acquire_parse_state(&rb_grammar->pool, &bg);
+  enum gzl_status status = gzl_parse_file(state, file, NULL, SIZE_MAX);
+  gzl_release_parse_state(&rb_grammar->pool, state);
+  fclose(file);
+
+  return parse_succeeded(status);
+}
+
+/* Parser#each_event_batch(input, batch_size): parses input as parse does,
+ * but rather than running rules it collects rule starts, rule ends and
+ * terminals as packed records (struct rb_gzl_event), and yields them a batch
+ * at a time, so that Ruby is called once a batch rather than once an event. */
+static void yield_events(RbEventBatch *batch) {
+  VALUE events = rb_str_new((char*) batch->events, batch->len * sizeof(*batch->events));
+  batch->len = 0;
+  rb_yield(events);
+}
+
+static void add_event(ParseState *parse_state, uint32_t kind, long name, size_t start, size_t end) {
+  RbEventBatch *batch = parse_state->user_data;
+  if (batch->len == batch->events_size) {
+    batch->events_size = batch->events_size ? batch->events_size * 2 : 256;
+    batch->events = realloc(batch->events, batch->events_size * sizeof(*batch->events));
+  }
+
+  struct rb_gzl_event *event = &batch->events[batch->len++];
+
+  event->kind  = kind;
+  event->name  = (uint32_t) name;
+  event->start = start;
+  event->end   = end;
+
+  if (batch->len == batch->batch_size) {
+    yield_events(batch);
+    cancel_if_stopped(parse_state, batch->self);
+  }
+}
+
+static void event_start_rule_callback(ParseState *parse_state) {
+  RbEventBatch *batch = parse_state->user_data;
+  struct gzl_parse_stack_frame *frame = DYNARRAY_GET_TOP(parse_state->parse_stack);
+
+  add_event(parse_state, RB_GZL_EVENT_RULE_START, batch->names->rtn_ids[frame->f.rtn_frame.rtn],
+            frame->start_byte, frame->start_byte);
+}
+
+static void event_end_rule_callback(ParseState *parse_state) {
+  RbEventBatch *batch = parse_state->user_data;
+  struct gzl_parse_stack_frame *frame = DYNARRAY_GET_TOP(parse_state->parse_stack);
+  size_t end = batch->terminal_end > frame->start_byte ? batch->terminal_end : frame->start_byte;
+
+  add_event(parse_state, RB_GZL_EVENT_RULE_END, batch->names->rtn_ids[frame->f.rtn_frame.rtn],
+            frame->start_byte, end);
+}
+
+static void event_terminal_callback(ParseState *parse_state, struct gzl_terminal *terminal) {
+  RbEventBatch *batch = parse_state->user_data;
+
+  batch->terminal_end = terminal->start_byte + terminal->len;
+  add_event(parse_state, RB_GZL_EVENT_TERMINAL, name_id(batch->names, terminal->name),
+            terminal->start_byte, batch->terminal_end);
+}
+
+struct rb_gzl_event_args {
+  struct rb_gzl_parse_args parse_args;
+  RbEventBatch             batch;
+};
+
+static VALUE rb_gzl_parse_events(VALUE args) {
+  struct rb_gzl_event_args *event_args = (struct rb_gzl_event_args *) args;
+
+  rb_gzl_parse((VALUE) &event_args->parse_args);
+  if (event_args->batch.len > 0 && event_args->parse_args.status != GZL_STATUS_CANCELLED)
+    yield_events(&event_args->batch);
+  return Qnil;
+}
+
+static VALUE rb_gzl_release_events(VALUE args) {
+  struct rb_gzl_event_args *event_args = (struct rb_gzl_event_args *) args;
+
+  free(event_args->batch.events);
+  return rb_gzl_release_state((VALUE) &event_args->parse_args);
+}
+
+static VALUE rb_gazelle_each_event_batch(VALUE self, VALUE input, VALUE batch_size) {
+  StringValue(input);
+  RbGrammar *rb_grammar = rb_parser_grammar(self);
+  if (!rb_grammar)
+    return Qfalse;
+
+  struct rb_gzl_event_args args;
+  args.batch.self         = self;
+  args.batch.names        = grammar_names(rb_grammar);
+  args.batch.batch_size   = NUM2ULONG(batch_size);
+  args.batch.len          = 0;
+  args.batch.terminal_end = 0;
+  if (args.batch.batch_size == 0)
+    rb_raise(rb_eArgError, "the batch size must be at least 1");
+
+  BoundGrammar bg = {
+    .grammar       = rb_grammar->grammar,
+    .start_rule_cb = event_start_rule_callback,
+    .end_rule_cb   = event_end_rule_callback,
+    .terminal_cb   = event_terminal_callback
+  };
+  rb_iv_set(self, "@stopped", Qfalse);
+
+  /* The parse reads a frozen copy, as with rules (see run_gazelle_parse). */
+  input = rb_str_new4(input);
+  args.batch.events          = malloc(args.batch.batch_size * sizeof(struct rb_gzl_event));
+  args.batch.events_size     = args.batch.batch_size;
+  args.parse_args.rb_grammar = rb_grammar;
+  args.parse_args.state      = gzl_acquire_parse_state(&rb_grammar->pool, &bg);
+  args.parse_args.parse      = parse_function_for(self, rb_grammar, true);
+  args.parse_args.input      = RSTRING_PTR(input);
+  args.parse_args.input_len  = RSTRING_LEN(input);
+  args.parse_args.state->user_data = &args.batch;
+
+  rb_ensure(rb_gzl_parse_events, (VALUE) &args, rb_gzl_release_events, (VALUE) &args);
+
+  return parse_succeeded(args.parse_args.status);
+}
+
+/* Parser#parse_value(input): parses input, building a value for each rule
+ * and terminal bottom-up on a value stack.  A terminal's value is what its
+ * on_value handler returns given its offsets, or nil.  A rule's is what its
+ * handler returns given its children's values and its offsets, or without a
+ * handler the array of its children's values.  No text is sliced out of the
+ * input unless a handler asks for it. */
+static VALUE no_values;
+
+static VALUE value_dispatch(VALUE self, RbGrammar *rb_grammar) {
+  VALUE dispatch_obj = rb_iv_get(self, "@value_dispatch");
+  if (NIL_P(dispatch_obj)) {
+    dispatch_obj = build_dispatch(rb_grammar, rb_iv_get(self, "@value_rules"), false);
+    rb_iv_set(self, "@value_dispatch", dispatch_obj);
+  }
+  return dispatch_obj;
+}
+
+static void use_value_dispatch(RbValueParse *value_parse) {
+  value_parse->dispatch_obj = value_dispatch(value_parse->self, value_parse->rb_grammar);
+  Data_Get_Struct(value_parse->dispatch_obj, RbDispatch, value_parse->dispatch);
 }
 
+static VALUE run_value_rule(ParseState *parse_state, VALUE rule, VALUE children, size_t start, size_t end) {
+  RbValueParse *value_parse = parse_state->user_data;
+  VALUE self    = value_parse->self;
+  VALUE handler = rb_hash_aref(rb_iv_get(self, "@value_rules"), rule);
+  VALUE value   = rb_funcall(handler, rb_intern("call"), 3, children, ULONG2NUM(start), ULONG2NUM(end));
+
+  cancel_if_stopped(parse_state, self);
+  if (rb_iv_get(self, "@value_dispatch") != value_parse->dispatch_obj)
+    use_value_dispatch(value_parse);
+  return value;
+}
+
+static void value_start_rule_callback(ParseState *parse_state) {
+  RbValueParse *value_parse = parse_state->user_data;
+
+  if (value_parse->num_bases == value_parse->bases_size) {
+    value_parse->bases_size = value_parse->bases_size ? value_parse->bases_size * 2 : 16;
+    value_parse->bases = realloc(value_parse->bases, value_parse->bases_size * sizeof(long));
+  }
+  value_parse->bases[value_parse->num_bases++] = RARRAY_LEN(value_parse->values);
+}
+
+static void value_end_rule_callback(ParseState *parse_state) {
+  RbValueParse *value_parse = parse_state->user_data;
+  RbDispatch   *dispatch    = value_parse->dispatch;
+  struct gzl_parse_stack_frame *frame = DYNARRAY_GET_TOP(parse_state->parse_stack);
+  size_t start = frame->start_byte;
+  size_t end   = value_parse->terminal_end > start ? value_parse->terminal_end : start;
+
+  VALUE values   = value_parse->values;
+  long base      = value_parse->bases[--value_parse->num_bases];
+  VALUE children = rb_ary_subseq(values, base, RARRAY_LEN(values) - base);
+  rb_ary_resize(values, base);
+
+  VALUE rule  = dispatch->rules[dispatch->names->rtn_ids[frame->f.rtn_frame.rtn]];
+  VALUE value = rule ? run_value_rule(parse_state, rule, children, start, end) : children;
+  rb_ary_push(values, value);
+}
+
+static void value_terminal_callback(ParseState *parse_state, struct gzl_terminal *terminal) {
+  RbValueParse *value_parse = parse_state->user_data;
+  RbDispatch   *dispatch    = value_parse->dispatch;
+  size_t start = terminal->start_byte;
+  size_t end   = start + terminal->len;
+
+  value_parse->terminal_end = end;
+
+  long id     = name_id(dispatch->names, terminal->name);
+  VALUE rule  = id >= 0 ? dispatch->rules[id] : 0;
+  VALUE value = rule ? run_value_rule(parse_state, rule, no_values, start, end) : Qnil;
+  rb_ary_push(value_parse->values, value);
+}
+
+struct rb_gzl_value_args {
+  struct rb_gzl_parse_args parse_args;
+  RbValueParse             value_parse;
+};
+
+static VALUE rb_gzl_release_values(VALUE args) {
+  struct rb_gzl_value_args *value_args = (struct rb_gzl_value_args *) args;
+
+  free(value_args->value_parse.bases);
+  return rb_gzl_release_state((VALUE) &value_args->parse_args);
+}
+
+static VALUE rb_gazelle_parse_value(VALUE self, VALUE input) {
+  StringValue(input);
+  RbGrammar *rb_grammar = rb_parser_grammar(self);
+  if (!rb_grammar)
+    return Qnil;
+
+  if (!no_values) {
+    no_values = rb_obj_freeze(rb_ary_new());
+    rb_global_variable(&no_values);
+  }
+
+  struct rb_gzl_value_args args;
+  RbValueParse *value_parse = &args.value_parse;
+  value_parse->self         = self;
+  value_parse->rb_grammar   = rb_grammar;
+  value_parse->values       = rb_ary_new();
+  value_parse->bases        = NULL;
+  value_parse->num_bases    = 0;
+  value_parse->bases_size   = 0;
+  value_parse->terminal_end = 0;
+  use_value_dispatch(value_parse);
+
+  BoundGrammar bg = {
+    .grammar       = rb_grammar->grammar,
+    .start_rule_cb = value_start_rule_callback,
+    .end_rule_cb   = value_end_rule_callback,
+    .terminal_cb   = value_terminal_callback
+  };
+  rb_iv_set(self, "@stopped", Qfalse);
+
+  /* The parse reads a frozen copy, as with rules (see run_gazelle_parse). */
+  input = rb_str_new4(input);
+  args.parse_args.rb_grammar = rb_grammar;
+  args.parse_args.state      = gzl_acquire_parse_state(&rb_grammar->pool, &bg);
+  args.parse_args.parse      = parse_function_for(self, rb_grammar, true);
+  args.parse_args.input      = RSTRING_PTR(input);
+  args.parse_args.input_len  = RSTRING_LEN(input);
+  args.parse_args.state->user_data = value_parse;
+
+  rb_ensure(rb_gzl_parse, (VALUE) &args.parse_args, rb_gzl_release_values, (VALUE) &args);
+
+  if (!RTEST(parse_succeeded(args.parse_args.status)))
+    return Qnil;
+  return rb_ary_entry(value_parse->values, -1);
+}
+
+/* Parser#parse_tree(input): parses input into a Gazelle::Tree, whose nodes
+ * only become Ruby objects when they are visited (through the parser's
+ * private tree_node, so that a tree is only read by the runtime that built
+ * it).  Returns nil if the input doesn't parse. */
+static VALUE Gazelle_Tree;
+
+static void free_rb_tree(RbTree *tree) {
+  free(tree->nodes);
+  free(tree->open);
+  free(tree);
+}
+
+static uint32_t add_tree_node(RbTree *tree, uint32_t kind, long name, size_t start, size_t end) {
+  if (tree->num_nodes == tree->nodes_size) {
+    if (tree->nodes_size >= RB_GZL_NO_NODE / 2)
+      rb_raise(rb_eNoMemError, "too many nodes for a parse tree");
+    tree->nodes_size = tree->nodes_size ? tree->nodes_size * 2 : 64;
+    tree->nodes = realloc(tree->nodes, tree->nodes_size * sizeof(*tree->nodes));
+  }
+
+  uint32_t n = tree->num_nodes++;
+  struct rb_gzl_tree_node *node = &tree->nodes[n];
+  node->kind         = kind;
+  node->name         = (uint32_t) name;
+  node->first_child  = RB_GZL_NO_NODE;
+  node->next_sibling = RB_GZL_NO_NODE;
+  node->start        = start;
+  node->end          = end;
+
+  if (tree->num_open > 0) {
+    struct rb_gzl_open_node *parent = &tree->open[tree->num_open - 1];
+    if (parent->last_child == RB_GZL_NO_NODE)
+      tree->nodes[parent->node].first_child = n;
+    else
+      tree->nodes[parent->last_child].next_sibling = n;
+    parent->last_child = n;
+  }
+  return n;
+}
+
+static void tree_start_rule_callback(ParseState *parse_state) {
+  RbTree *tree = parse_state->user_data;
+  struct gzl_parse_stack_frame *frame = DYNARRAY_GET_TOP(parse_state->parse_stack);
+  uint32_t n = add_tree_node(tree, RB_GZL_EVENT_RULE_END, tree->names->rtn_ids[frame->f.rtn_frame.rtn],
+                             frame->start_byte, frame->start_byte);
+
+  if (tree->num_open == tree->open_size) {
+    tree->open_size = tree->open_size ? tree->open_size * 2 : 16;
+    tree->open = realloc(tree->open, tree->open_size * sizeof(*tree->open));
+  }
+  tree->open[tree->num_open].node       = n;
+  tree->open[tree->num_open].last_child = RB_GZL_NO_NODE;
+  tree->num_open++;
+}
+
+static void tree_end_rule_callback(ParseState *parse_state) {
+  RbTree *tree = parse_state->user_data;
+  struct rb_gzl_tree_node *node = &tree->nodes[tree->open[--tree->num_open].node];
+
+  node->end = tree->terminal_end > node->start ? tree->terminal_end : node->start;
+}
+
+static void tree_terminal_callback(ParseState *parse_state, struct gzl_terminal *terminal) {
+  RbTree *tree = parse_state->user_data;
+
+  tree->terminal_end = terminal->start_byte + terminal->len;
+  add_tree_node(tree, RB_GZL_EVENT_TERMINAL, name_id(tree->names, terminal->name),
+                terminal->start_byte, tree->terminal_end);
+}
+
+static VALUE rb_gazelle_parse_tree(VALUE self, VALUE input) {
+  StringValue(input);
+  RbGrammar *rb_grammar = rb_parser_grammar(self);
+  if (!rb_grammar)
+    return Qnil;
+
+  RbTree *tree = calloc(1, sizeof(*tree));
+  VALUE obj    = Data_Wrap_Struct(Gazelle_Tree, 0, free_rb_tree, tree);
+  tree->names  = grammar_names(rb_grammar);
+
+  /* Nodes' text is read from a frozen copy, as with rules (see
+   * run_gazelle_parse). */
+  input = rb_str_new4(input);
+  rb_iv_set(obj, "@parser", self);
+  rb_iv_set(obj, "@input",  input);
+
+  BoundGrammar bg = {
+    .grammar       = rb_grammar->grammar,
+    .start_rule_cb = tree_start_rule_callback,
+    .end_rule_cb   = tree_end_rule_callback,
+    .terminal_cb   = tree_terminal_callback
+  };
+  struct rb_gzl_parse_args args = {
+    .rb_grammar = rb_grammar,
+    .state      = gzl_acquire_parse_state(&rb_grammar->pool, &bg),
+    .parse      = parse_function_for(self, rb_grammar, true),
+    .input      = RSTRING_PTR(input),
+    .input_len  = RSTRING_LEN(input)
+  };
+  args.state->user_data = tree;
+
+  rb_ensure(rb_gzl_parse, (VALUE) &args, rb_gzl_release_state, (VALUE) &args);
+
+  free(tree->open);
+  tree->open = NULL;
+  if (!RTEST(parse_succeeded(args.status)) || tree->num_nodes == 0)
+    return Qnil;
+
+  tree->nodes = realloc(tree->nodes, tree->num_nodes * sizeof(*tree->nodes));
+  tree->nodes_size = tree->num_nodes;
+  return obj;
+}
+
+static VALUE node_index(uint32_t index) {
+  return index == RB_GZL_NO_NODE ? Qnil : ULONG2NUM(index);
+}
+
+/* Parser#tree_node(tree, index): [kind, name id, start, end, first child,
+ * next sibling] of one of tree's nodes, the indexes nil if there are none. */
+static VALUE rb_gazelle_tree_node(VALUE self, VALUE obj, VALUE index) {
+  RbTree *tree;
+  if (!rb_obj_is_kind_of(obj, Gazelle_Tree))
+    rb_raise(rb_eTypeError, "not a Gazelle::Tree");
+  Data_Get_Struct(obj, RbTree, tree);
+
+  unsigned long i = NUM2ULONG(index);
+  if (i >= tree->num_nodes)
+    rb_raise(rb_eIndexError, "no node %lu", i);
+
+  struct rb_gzl_tree_node *node = &tree->nodes[i];
+  VALUE values[6];
+  values[0] = INT2FIX(node->kind);
+  values[1] = ULONG2NUM(node->name);
+  values[2] = ULONG2NUM(node->start);
+  values[3] = ULONG2NUM(node->end);
+  values[4] = node_index(node->first_child);
+  values[5] = node_index(node->next_sibling);
+  return rb_ary_new4(6, values);
+}
+
+/* Parser#parse_records(input): parses input, keeping each open rule's slots
+ * (see load_rtn() in load_grammar.c; ".digits=" in "hello -> .digits=/[0-9]+/"
+ * names one) in a fixed block of offsets: a slot holds the text of the
+ * terminal or rule last taken through it.  When a rule with an on_record
+ * handler ends, the handler is given its slots as an instance of
+ * record_class(rule); no other rule's slots ever leave C.  Returns whether
+ * the input parsed. */
+static void mark_rb_records(RbRecords *records) {
+  int i;
+  for (i = 0; i < records->num_rtns; i++)
+    rb_gc_mark(records->classes[i]);
+}
+
+static void free_rb_records(RbRecords *records) {
+  int i;
+  for (i = 0; i < records->num_rtns; i++)
+    free(records->members[i]);
+  free(records->members);
+  free(records->classes);
+  free(records);
+}
+
+static bool member_name_p(const char *name) {
+  const char *c;
+  for (c = name; *c; c++) {
+    if (!((*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || *c == '_' ||
+          (c > name && *c >= '0' && *c <= '9')))
+      return false;
+  }
+  return c > name;
+}
+
+/* A rule's Struct class, with a member for each of its slots named as the
+ * slot is, in slot order.  A name used by several slots gets a suffix after
+ * the first ("WS", "WS_2", ...). */
+static VALUE record_class(struct gzl_rtn *rtn, int *members) {
+  char **slot_names = calloc(rtn->num_slots, sizeof(char*));
+  VALUE *symbols    = malloc(rtn->num_slots * sizeof(VALUE));
+  int num_members   = 0;
+  int i, j;
+
+  for (i = 0; i < rtn->num_transitions; i++) {
+    struct gzl_rtn_transition *t = &rtn->transitions[i];
+    if (t->slotnum >= 0 && t->slotnum < rtn->num_slots)
+      slot_names[t->slotnum] = t->slotname;
+  }
+
+  for (i = 0; i < rtn->num_slots; i++) {
+    char *name = slot_names[i];
+    int uses   = 1;
+
+    members[i] = -1;
+    if (!name || !member_name_p(name))
+      continue;
+
+    for (j = 0; j < i; j++)
+      if (members[j] >= 0 && strcmp(slot_names[j], name) == 0)
+        uses++;
+
+    if (uses == 1) {
+      symbols[num_members] = ID2SYM(rb_intern(name));
+    } else {
+      char *suffixed = malloc(strlen(name) + 12);
+      sprintf(suffixed, "%s_%d", name, uses);
+      symbols[num_members] = ID2SYM(rb_intern(suffixed));
+      free(suffixed);
+    }
+    members[i] = num_members++;
+  }
+
+  VALUE klass = Qnil;
+  if (num_members > 0)
+    klass = rb_funcall2(rb_cStruct, rb_intern("new"), num_members, symbols);
+
+  free(slot_names);
+  free(symbols);
+  return klass;
+}
+
+/* The grammar's record classes, made the first time they're needed and kept
+ * in the grammar's @records. */
+static RbRecords *grammar_records(VALUE self, RbGrammar *rb_grammar) {
+  VALUE grammar_obj = rb_iv_get(self, "@grammar");
+  VALUE records_obj = rb_iv_get(grammar_obj, "@records");
+  struct gzl_grammar *grammar = rb_grammar->grammar;
+  RbRecords *records;
+  int i;
+
+  if (NIL_P(records_obj)) {
+    records = calloc(1, sizeof(*records));
+    records_obj = Data_Wrap_Struct(rb_cObject, mark_rb_records, free_rb_records, records);
+
+    records->classes  = calloc(grammar->num_rtns, sizeof(VALUE));
+    records->members  = calloc(grammar->num_rtns, sizeof(int*));
+    records->num_rtns = grammar->num_rtns;
+    for (i = 0; i < grammar->num_rtns; i++) {
+      records->classes[i] = Qnil;
+      records->members[i] = malloc((grammar->rtns[i].num_slots + 1) * sizeof(int));
+    }
+    for (i = 0; i < grammar->num_rtns; i++)
+      records->classes[i] = record_class(&grammar->rtns[i], records->members[i]);
+
+    rb_iv_set(grammar_obj, "@records", records_obj);
+  }
+
+  Data_Get_Struct(records_obj, RbRecords, records);
+  return records;
+}
+
+/* Parser#record_class(rule): the Struct parse_records fills in for rule, or
+ * nil if rule has no slots that can be members (or no such rule). */
+static VALUE rb_gazelle_record_class(VALUE self, VALUE rule) {
+  VALUE name = rb_obj_as_string(rule);
+  RbGrammar *rb_grammar = rb_parser_grammar(self);
+  if (!rb_grammar)
+    return Qnil;
+
+  RbRecords *records = grammar_records(self, rb_grammar);
+  int i;
+  for (i = 0; i < records->num_rtns; i++)
+    if (strcmp(rb_grammar->grammar->rtns[i].name, StringValueCStr(name)) == 0)
+      return records->classes[i];
+  return Qnil;
+}
+
+static VALUE record_dispatch(VALUE self, RbGrammar *rb_grammar) {
+  VALUE dispatch_obj = rb_iv_get(self, "@record_dispatch");
+  if (NIL_P(dispatch_obj)) {
+    dispatch_obj = build_dispatch(rb_grammar, rb_iv_get(self, "@record_rules"), false);
+    rb_iv_set(self, "@record_dispatch", dispatch_obj);
+  }
+  return dispatch_obj;
+}
+
+static void use_record_dispatch(RbRecordParse *record_parse) {
+  record_parse->dispatch_obj = record_dispatch(record_parse->self, record_parse->rb_grammar);
+  Data_Get_Struct(record_parse->dispatch_obj, RbDispatch, record_parse->dispatch);
+}
+
+static VALUE build_record(RbRecordParse *record_parse, uint32_t rtn, struct rb_gzl_slot *slots) {
+  VALUE klass  = record_parse->records->classes[rtn];
+  int *members = record_parse->records->members[rtn];
+  int i;
+
+  if (NIL_P(klass))
+    return Qnil;
+
+  VALUE record = rb_class_new_instance(0, NULL, klass);
+  for (i = 0; i < record_parse->rb_grammar->grammar->rtns[rtn].num_slots; i++) {
+    if (members[i] >= 0 && slots[i].start != RB_GZL_EMPTY_SLOT)
+      rb_struct_aset(record, INT2FIX(members[i]),
+                     rb_str_boundaries(record_parse->input, slots[i].start, slots[i].end));
+  }
+  return record;
+}
+
+static void run_record_rule(ParseState *parse_state, VALUE rule, VALUE record) {
+  RbRecordParse *record_parse = parse_state->user_data;
+  VALUE self    = record_parse->self;
+  VALUE handler = rb_hash_aref(rb_iv_get(self, "@record_rules"), rule);
+
+  rb_funcall(handler, rb_intern("call"), 1, record);
+  cancel_if_stopped(parse_state, self);
+  if (rb_iv_get(self, "@record_dispatch") != record_parse->dispatch_obj)
+    use_record_dispatch(record_parse);
+}
+
+/* Fills the slot, in the rule of the RTN frame, that the frame's current
+ * transition takes. */
+static void fill_slot(ParseState *parse_state, ParseStackFrame *frame, size_t start, size_t end) {
+  RbRecordParse *record_parse  = parse_state->user_data;
+  struct gzl_rtn *rtn          = gzl_frame_rtn(parse_state, &frame->f.rtn_frame);
+  struct gzl_rtn_transition *t = gzl_frame_rtn_transition(parse_state, &frame->f.rtn_frame);
+
+  if (!t || t->slotnum < 0 || t->slotnum >= rtn->num_slots)
+    return;
+
+  struct rb_gzl_slot *slot = &record_parse->slots[record_parse->num_slots - rtn->num_slots + t->slotnum];
+  slot->start = start;
+  slot->end   = end;
+}
+
+static void record_start_rule_callback(ParseState *parse_state) {
+  RbRecordParse *record_parse = parse_state->user_data;
+  struct gzl_parse_stack_frame *frame = DYNARRAY_GET_TOP(parse_state->parse_stack);
+  int num_slots = gzl_frame_rtn(parse_state, &frame->f.rtn_frame)->num_slots;
+
+  while (record_parse->num_slots + num_slots > record_parse->slots_size) {
+    record_parse->slots_size = record_parse->slots_size ? record_parse->slots_size * 2 : 64;
+    record_parse->slots = realloc(record_parse->slots, record_parse->slots_size * sizeof(*record_parse->slots));
+  }
+  while (num_slots-- > 0)
+    record_parse->slots[record_parse->num_slots++].start = RB_GZL_EMPTY_SLOT;
+}
+
+static void record_end_rule_callback(ParseState *parse_state) {
+  RbRecordParse *record_parse = parse_state->user_data;
+  RbDispatch    *dispatch     = record_parse->dispatch;
+  struct gzl_parse_stack_frame *frame = DYNARRAY_GET_TOP(parse_state->parse_stack);
+  uint32_t rtn  = frame->f.rtn_frame.rtn;
+  int num_slots = gzl_frame_rtn(parse_state, &frame->f.rtn_frame)->num_slots;
+  size_t start  = frame->start_byte;
+  size_t end    = record_parse->terminal_end > start ? record_parse->terminal_end : start;
+
+  VALUE rule = dispatch->rules[dispatch->names->rtn_ids[rtn]];
+  if (rule)
+    run_record_rule(parse_state, rule,
+                    build_record(record_parse, rtn, &record_parse->slots[record_parse->num_slots - num_slots]));
+
+  record_parse->num_slots -= num_slots;
+  if (parse_state->parse_stack_len > 1)
+    fill_slot(parse_state, frame - 1, start, end);
+}
+
+static void record_terminal_callback(ParseState *parse_state, struct gzl_terminal *terminal) {
+  RbRecordParse *record_parse = parse_state->user_data;
+
+  record_parse->terminal_end = terminal->start_byte + terminal->len;
+  fill_slot(parse_state, DYNARRAY_GET_TOP(parse_state->parse_stack),
+            terminal->start_byte, record_parse->terminal_end);
+}
+
+struct rb_gzl_record_args {
+  struct rb_gzl_parse_args parse_args;
+  RbRecordParse            record_parse;
+};
+
+static VALUE rb_gzl_release_records(VALUE args) {
+  struct rb_gzl_record_args *record_args = (struct rb_gzl_record_args *) args;
+
+  free(record_args->record_parse.slots);
+  return rb_gzl_release_state((VALUE) &record_args->parse_args);
+}
+
+static VALUE rb_gazelle_parse_records(VALUE self, VALUE input) {
+  StringValue(input);
+  RbGrammar *rb_grammar = rb_parser_grammar(self);
+  if (!rb_grammar)
+    return Qnil;
+
+  /* Slots are read from a frozen copy, as with rules (see
+   * run_gazelle_parse). */
+  input = rb_str_new4(input);
+
+  struct rb_gzl_record_args args;
+  RbRecordParse *record_parse = &args.record_parse;
+  record_parse->self         = self;
+  record_parse->input        = input;
+  record_parse->rb_grammar   = rb_grammar;
+  record_parse->records      = grammar_records(self, rb_grammar);
+  record_parse->slots        = NULL;
+  record_parse->num_slots    = 0;
+  record_parse->slots_size   = 0;
+  record_parse->terminal_end = 0;
+  use_record_dispatch(record_parse);
+
+  BoundGrammar bg = {
+    .grammar       = rb_grammar->grammar,
+    .start_rule_cb = record_start_rule_callback,
+    .end_rule_cb   = record_end_rule_callback,
+    .terminal_cb   = record_terminal_callback
+  };
+  rb_iv_set(self, "@stopped", Qfalse);
+
+  args.parse_args.rb_grammar = rb_grammar;
+  args.parse_args.state      = gzl_acquire_parse_state(&rb_grammar->pool, &bg);
+  args.parse_args.parse      = parse_function_for(self, rb_grammar, true);
+  args.parse_args.input      = RSTRING_PTR(input);
+  args.parse_args.input_len  = RSTRING_LEN(input);
+  args.parse_args.state->user_data = record_parse;
+
+  rb_ensure(rb_gzl_parse, (VALUE) &args.parse_args, rb_gzl_release_records, (VALUE) &args);
+
+  return parse_succeeded(args.parse_args.status);
+}
+
+/* Parser#stats_for(input, :rules => names): parses input, counting each rule
+ * and terminal and the bytes they cover in C (see stats.c), so that Ruby is
+ * never called along the way. */
+struct rb_gzl_stats_args {
+  struct rb_gzl_parse_args parse_args;
+  struct gzl_parse_stats   stats;
+  VALUE                    rules;
+};
+
+static VALUE stat_hash(struct gzl_stat *stat) {
+  VALUE hash = rb_hash_new();
+  rb_hash_aset(hash, ID2SYM(rb_intern("count")), ULL2NUM(stat ? stat->count : 0));
+  rb_hash_aset(hash, ID2SYM(rb_intern("bytes")), ULL2NUM(stat ? stat->bytes : 0));
+  return hash;
+}
+
+static long rtn_named(struct gzl_grammar *grammar, const char *name) {
+  long i;
+  for (i = 0; i < grammar->num_rtns; i++)
+    if (strcmp(grammar->rtns[i].name, name) == 0)
+      return i;
+  return -1;
+}
+
+static char *string_named(struct gzl_grammar *grammar, const char *name) {
+  long i;
+  for (i = 0; grammar->strings[i]; i++)
+    if (strcmp(grammar->strings[i], name) == 0)
+      return grammar->strings[i];
+  return NULL;
+}
+
+/* The counts for the rule called name, or failing that the terminal. */
+static struct gzl_stat *stat_named(struct gzl_parse_stats *stats, const char *name) {
+  long rtn = rtn_named(stats->grammar, name);
+  return rtn >= 0 ? &stats->rtns[rtn] : gzl_terminal_stat(stats, string_named(stats->grammar, name));
+}
+
+static VALUE rb_gzl_parse_stats(VALUE args) {
+  struct rb_gzl_stats_args *stats_args = (struct rb_gzl_stats_args *) args;
+  struct gzl_parse_stats *stats = &stats_args->stats;
+  struct gzl_grammar *grammar   = stats->grammar;
+  VALUE result = rb_hash_new();
+  long i;
+
+  rb_gzl_parse((VALUE) &stats_args->parse_args);
+  if (!RTEST(parse_succeeded(stats_args->parse_args.status)))
+    return Qnil;
+
+  if (!NIL_P(stats_args->rules)) {
+    for (i = 0; i < RARRAY_LEN(stats_args->rules); i++) {
+      VALUE name = rb_ary_entry(stats_args->rules, i);
+      rb_hash_aset(result, ID2SYM(rb_intern(RSTRING_PTR(name))), stat_hash(stat_named(stats, RSTRING_PTR(name))));
+    }
+    return result;
+  }
+
+  for (i = 0; i < grammar->num_rtns; i++)
+    if (stats->rtns[i].count > 0)
+      rb_hash_aset(result, ID2SYM(rb_intern(grammar->rtns[i].name)), stat_hash(&stats->rtns[i]));
+  for (i = 0; grammar->strings[i]; i++) {
+    struct gzl_stat *stat = gzl_terminal_stat(stats, grammar->strings[i]);
+    if (stat)
+      rb_hash_aset(result, ID2SYM(rb_intern(grammar->strings[i])), stat_hash(stat));
+  }
+  return result;
+}
+
+static VALUE rb_gzl_release_stats(VALUE args) {
+  struct rb_gzl_stats_args *stats_args = (struct rb_gzl_stats_args *) args;
+
+  gzl_free_parse_stats(&stats_args->stats);
+  return rb_gzl_release_state((VALUE) &stats_args->parse_args);
+}
+
+/* Parser#parse_stats(input, rules): a hash of each name in rules (or if
+ * rules is nil, of every rule and terminal seen) to its :count and :bytes, or
+ * nil if the input doesn't parse.  A rule's bytes run up to the end of its
+ * last terminal.  Raises ArgumentError for a name the grammar doesn't have. */
+static VALUE rb_gazelle_parse_stats(VALUE self, VALUE input, VALUE rules) {
+  StringValue(input);
+  RbGrammar *rb_grammar = rb_parser_grammar(self);
+  if (!rb_grammar)
+    return Qnil;
+
+  struct gzl_grammar *grammar = rb_grammar->grammar;
+  long i;
+
+  if (!NIL_P(rules)) {
+    rules = rb_ary_dup(rb_Array(rules));
+    for (i = 0; i < RARRAY_LEN(rules); i++) {
+      VALUE name = rb_obj_as_string(rb_ary_entry(rules, i));
+      rb_ary_store(rules, i, name);
+      if (rtn_named(grammar, StringValueCStr(name)) < 0 && !string_named(grammar, RSTRING_PTR(name)))
+        rb_raise(rb_eArgError, "no rule or terminal called %s", RSTRING_PTR(name));
+    }
+  }
+
+  struct rb_gzl_stats_args args;
+  BoundGrammar bg = {
+    .grammar     = grammar,
+    .end_rule_cb = gzl_stats_end_rule_cb,
+    .terminal_cb = gzl_stats_terminal_cb
+  };
+  args.rules = rules;
+  gzl_init_parse_stats(&args.stats, grammar);
+  args.parse_args.rb_grammar = rb_grammar;
+  args.parse_args.state      = gzl_acquire_parse_state(&rb_grammar->pool, &bg);
+  args.parse_args.parse      = parse_function_for(self, rb_grammar, true);
+  args.parse_args.input      = RSTRING_PTR(input);
+  args.parse_args.input_len  = RSTRING_LEN(input);
+  args.parse_args.state->user_data = &args.stats;
+
+  return rb_ensure(rb_gzl_parse_stats, (VALUE) &args, rb_gzl_release_stats, (VALUE) &args);
+}
+
+/* Parser#event_names: the names event records refer to, by name id. */
+static VALUE rb_gazelle_event_names(VALUE self) {
+  RbGrammar *rb_grammar = rb_parser_grammar(self);
+  if (!rb_grammar)
+    return Qnil;
+
+  RbNames *names    = grammar_names(rb_grammar);
+  VALUE event_names = rb_ary_new2(names->num_names);
+  long i;
+  for (i = 0; i < names->num_names; i++)
+    rb_ary_push(event_names, rb_obj_freeze(rb_str_new2(rb_grammar->grammar->strings[i])));
+  return event_names;
+}
+
+/* Parser#each_event(input) without a block: a Gazelle::EventStream, which
+ * parses its @input (a String, or an IO read RB_GZL_STREAM_CHUNK_SIZE bytes
+ * at a time) only as far as it must to hand out the next event.  Between
+ * chunks the parse is simply left where it is, so the events held at any one
+ * time are only those of the chunk being handed out.  As with PendingParse,
+ * the stream is read through the parser's private next_event. */
+static VALUE Gazelle_EventStream;
+
+static void free_rb_event_stream(RbEventStream *stream) {
+  if (stream->state)
+    gzl_free_parse_state(stream->state);
+  free(stream->batch.events);
+  free(stream);
+}
+
+static VALUE rb_gazelle_event_stream(VALUE self, VALUE input) {
+  RbGrammar *rb_grammar = rb_parser_grammar(self);
+  if (!rb_grammar)
+    rb_raise(rb_eArgError, "could not load the grammar");
+
+  RbEventStream *stream = calloc(1, sizeof(*stream));
+  VALUE obj = Data_Wrap_Struct(Gazelle_EventStream, 0, free_rb_event_stream, stream);
+
+  /* A String is parsed in place, a chunk at a time, so it mustn't change. */
+  if (!rb_respond_to(input, rb_intern("read")))
+    input = rb_str_new4(rb_str_to_str(input));
+  rb_iv_set(obj, "@parser", self);
+  rb_iv_set(obj, "@input",  input);
+  rb_iv_set(obj, "@names",  rb_gazelle_event_names(self));
+
+  stream->bg.grammar       = rb_grammar->grammar;
+  stream->bg.start_rule_cb = event_start_rule_callback;
+  stream->bg.end_rule_cb   = event_end_rule_callback;
+  stream->bg.terminal_cb   = event_terminal_callback;
+  stream->batch.self       = self;
+  stream->batch.names      = grammar_names(rb_grammar);
+
+  stream->parse = parse_function_for(self, rb_grammar, true);
+  stream->state = gzl_alloc_parse_state();
+  gzl_init_parse_state(stream->state, &stream->bg);
+  stream->state->user_data = &stream->batch;
+  return obj;
+}
+
+/* Parses the next chunk of the stream's input, or once there is no more, the
+ * NUL that ends it (as parse_input() does).  The stream is finished when the
+ * parse stops. */
+static void parse_next_chunk(VALUE obj, RbEventStream *stream) {
+  VALUE input = rb_iv_get(obj, "@input");
+  char *buf = NULL;
+  size_t len = 0;
+
+  if (TYPE(input) == T_STRING) {
+    len = RSTRING_LEN(input) - stream->fed;
+    if (len > RB_GZL_STREAM_CHUNK_SIZE)
+      len = RB_GZL_STREAM_CHUNK_SIZE;
+    buf = RSTRING_PTR(input) + stream->fed;
+  } else {
+    VALUE chunk = rb_funcall(input, rb_intern("read"), 1, INT2FIX(RB_GZL_STREAM_CHUNK_SIZE));
+    if (!NIL_P(chunk)) {
+      StringValue(chunk);
+      len = RSTRING_LEN(chunk);
+      buf = RSTRING_PTR(chunk);
+    }
+  }
+
+  if (len > 0) {
+    stream->fed  += len;
+    stream->status = stream->parse(stream->state, buf, len);
+    if (stream->status == GZL_STATUS_OK)
+      return;
+  } else {
+    stream->status = stream->parse(stream->state, &end_of_input, 1);
+  }
+
+  gzl_free_parse_state(stream->state);
+  stream->state = NULL;
+  rb_iv_set(obj, "@valid", parse_succeeded(stream->status));
+}
+
+static RbEventStream *rb_event_stream(VALUE obj) {
+  RbEventStream *stream;
+  if (!rb_obj_is_kind_of(obj, Gazelle_EventStream))
+    rb_raise(rb_eTypeError, "not a Gazelle::EventStream");
+  Data_Get_Struct(obj, RbEventStream, stream);
+  return stream;
+}
+
+/* [kind, name, start, end] for the stream's next event, parsing on as far as
+ * that takes, or Qundef if there are no more. */
+static VALUE next_stream_event(VALUE obj, RbEventStream *stream) {
+  while (stream->next == stream->batch.len) {
+    if (!stream->state)
+      return Qundef;
+    stream->next = stream->batch.len = 0;
+    parse_next_chunk(obj, stream);
+  }
+
+  struct rb_gzl_event *event = &stream->batch.events[stream->next++];
+  VALUE values[4];
+  values[0] = INT2FIX(event->kind);
+  values[1] = rb_ary_entry(rb_iv_get(obj, "@names"), event->name);
+  values[2] = ULL2NUM(event->start);
+  values[3] = ULL2NUM(event->end);
+  return rb_ary_new4(4, values);
+}
+
+/* Parser#next_event(stream): raises StopIteration once there are no more. */
+static VALUE rb_gazelle_next_event(VALUE self, VALUE obj) {
+  VALUE event = next_stream_event(obj, rb_event_stream(obj));
+  if (event == Qundef)
+    rb_raise(rb_eStopIteration, "the parse has finished");
+  return event;
+}
+
+/* Parser#each_stream_event(stream): yields the rest of the stream's events. */
+static VALUE rb_gazelle_each_stream_event(VALUE self, VALUE obj) {
+  RbEventStream *stream = rb_event_stream(obj);
+  VALUE event;
+  while ((event = next_stream_event(obj, stream)) != Qundef)
+    rb_yield(event);
+  return obj;
+}
+
+#ifdef GAZELLE_COMPILED_GRAMMAR
+
+/* Compiled grammars.  An extension generated by Gazelle::CodeGenerator
+ * #includes this file with GAZELLE_COMPILED_GRAMMAR defined, and its Init
+ * function calls rb_gzl_define_compiled_parser().  The parser class it defines
+ * gets its own copies of parse? and parse, so the grammar is only ever handled
+ * by the runtime compiled alongside it. */
+static VALUE compiled_grammar = Qnil;
+
+static VALUE rb_compiled_parser_initialize(VALUE self) {
+  return rb_call_super(1, &compiled_grammar);
+}
+
+static void rb_gzl_define_compiled_parser(const char *class_name, struct gzl_grammar *grammar) {
+  VALUE Gazelle          = rb_const_get(rb_cObject, rb_intern("Gazelle"));
+  VALUE Gazelle_Parser   = rb_const_get_at(Gazelle, rb_intern("Parser"));
+  VALUE Gazelle_Compiled = rb_define_module_under(Gazelle, "Compiled");
+  VALUE klass            = rb_define_class_under(Gazelle_Compiled, class_name, Gazelle_Parser);
+
+  Gazelle_Grammar      = rb_const_get_at(Gazelle, rb_intern("Grammar"));
+  Gazelle_PendingParse = rb_const_get_at(Gazelle, rb_intern("PendingParse"));
+  Gazelle_Tree         = rb_const_get_at(Gazelle, rb_intern("Tree"));
+  Gazelle_EventStream  = rb_const_get_at(Gazelle, rb_intern("EventStream"));
+  compiled_grammar = wrap_rb_grammar(grammar, false);
+  rb_global_variable(&compiled_grammar);
+
+  rb_define_method(klass, "initialize", rb_compiled_parser_initialize, 0);
+  rb_define_method(klass, "parse?",     rb_gazelle_parse_p, 1);
+  rb_define_method(klass, "parse",      rb_gazelle_parse, -1);
+  rb_define_method(klass, "parse_file?", rb_gazelle_parse_file_p, 1);
+  rb_define_method(klass, "load_parse", rb_gazelle_load_parse, -1);
+  rb_define_method(klass, "event_names", rb_gazelle_event_names, 0);
+  rb_define_method(klass, "parse_value", rb_gazelle_parse_value, 1);
+  rb_define_method(klass, "parse_tree", rb_gazelle_parse_tree, 1);
+  rb_define_method(klass, "start", rb_gazelle_start, 0);
+  rb_define_method(klass, "feed", rb_gazelle_feed, 1);
+  rb_define_method(klass, "finish", rb_gazelle_finish, 0);
+  rb_define_method(klass, "parse_records", rb_gazelle_parse_records, 1);
+  rb_define_method(klass, "record_class", rb_gazelle_record_class, 1);
+  rb_define_private_method(klass, "tree_node", rb_gazelle_tree_node, 2);
+  rb_define_private_method(klass, "parse_stats", rb_gazelle_parse_stats, 2);
+  rb_define_private_method(klass, "each_event_batch_of", rb_gazelle_each_event_batch, 2);
+  rb_define_private_method(klass, "event_stream", rb_gazelle_event_stream, 1);
+  rb_define_private_method(klass, "next_event", rb_gazelle_next_event, 1);
+  rb_define_private_method(klass, "each_stream_event", rb_gazelle_each_stream_event, 1);
+  rb_define_private_method(klass, "resume_parse", rb_gazelle_resume_parse, 1);
+  rb_define_private_method(klass, "save_parse", rb_gazelle_save_parse, 2);
+  rb_define_private_method(klass, "restore_parse", rb_gazelle_restore_parse, 2);
+}
+
+#else /* !GAZELLE_COMPILED_GRAMMAR */
+
+/* Parser#write_c_extension(path, name, class_name): compiles the grammar to C
+ * as the source of an extension called "<name>_gazelle", which defines
+ * Gazelle::Compiled::<class_name>.  See Gazelle::CodeGenerator. */
+static VALUE rb_gazelle_write_c_extension(VALUE self, VALUE path, VALUE name, VALUE class_name) {
+  RbGrammar *rb_grammar = rb_parser_grammar(self);
+  if (!rb_grammar)
+    rb_raise(rb_eArgError, "could not load the grammar");
+
+  char *c_name = RSTRING_PTR(name);
+  FILE *out    = fopen(RSTRING_PTR(path), "w");
+  if (!out)
+    rb_sys_fail(RSTRING_PTR(path));
+
+  fprintf(out, "/*\n * %s_gazelle.c: generated by Gazelle::CodeGenerator.  Do not edit.\n */\n\n", c_name);
+  fprintf(out, "#define GAZELLE_COMPILED_GRAMMAR\n#include \"gazelle_ruby_bindings.c\"\n\n");
+  gzl_generate_c(rb_grammar->grammar, c_name, out);
+  fprintf(out, "\nvoid Init_%s_gazelle() {\n", c_name);
+  fprintf(out, "  rb_gzl_define_compiled_parser(\"%s\", &gzl_%s_grammar);\n}\n",
+          RSTRING_PTR(class_name), c_name);
+
+  fclose(out);
+  return path;
+}
+
+/* Parser#profiling = true starts counting how often each of the grammar's
+ * transitions is taken, and Parser#write_profile(path) saves the counts for
+ * Parser.new(file, :profile => path) to lay the grammar out by.  Counts are
+ * kept against the grammar as it was loaded, so a grammar that was itself laid
+ * out by a profile, or optimized, can't be profiled. */
+static struct gzl_grammar *profiled_grammar(VALUE self) {
+  RbGrammar *rb_grammar = rb_parser_grammar(self);
+  if (!rb_grammar)
+    rb_raise(rb_eArgError, "could not load the grammar");
+  return rb_grammar->grammar;
+}
+
+static VALUE rb_gazelle_set_profiling(VALUE self, VALUE profiling) {
+  struct gzl_grammar *grammar = profiled_grammar(self);
+
+  if (RTEST(profiling) && !grammar->profile) {
+    if (!NIL_P(rb_iv_get(self, "@profile")) || RTEST(rb_iv_get(self, "@optimize")))
+      rb_raise(rb_eArgError, "can't profile a grammar that was laid out by a profile or optimized");
+    grammar->profile = gzl_alloc_profile(grammar);
+  } else if (!RTEST(profiling) && grammar->profile) {
+    gzl_free_profile(grammar, grammar->profile);
+    grammar->profile = NULL;
+  }
+  return profiling;
+}
+
+static VALUE rb_gazelle_profiling_p(VALUE self) {
+  return profiled_grammar(self)->profile ? Qtrue : Qfalse;
+}
+
+static VALUE rb_gazelle_write_profile(VALUE self, VALUE path) {
+  struct gzl_grammar *grammar = profiled_grammar(self);
+  if (!grammar->profile)
+    rb_raise(rb_eArgError, "the parser is not profiling");
+
+  FILE *out = fopen(RSTRING_PTR(path), "w");
+  if (!out)
+    rb_sys_fail(RSTRING_PTR(path));
+  gzl_write_profile(grammar, grammar->profile, out);
+  fclose(out);
+  return path;
+}
+
+/* Parser#optimization_report: for a parser created with :optimize => true,
+ * the sizes of the grammar's IntFA tables before and after optimizing. */
+static VALUE rb_gazelle_optimization_report(VALUE self) {
+  if (!rb_parser_grammar(self))
+    rb_raise(rb_eArgError, "could not load the grammar");
+  return rb_iv_get(self, "@optimization_report");
+}
+
+/* Parser#incremental(input) parses input, keeping checkpoints of the parse in
+ * a Gazelle::IncrementalParse, which IncrementalParse#edit then brings up to
+ * date by reparsing only what an edit affects; see incremental.c.  Like
+ * parse?, it runs the engine's recognizer. */
+static VALUE Gazelle_IncrementalParse;
+
+static void free_rb_incremental_parse(RbIncrementalParse *rb_parse) {
+  gzl_free_incremental_parse(&rb_parse->parse);
+  free(rb_parse);
+}
+
+static VALUE rb_gazelle_incremental_parse(VALUE self, VALUE input, VALUE interval) {
+  RbGrammar *rb_grammar = rb_parser_grammar(self);
+  if (!rb_grammar)
+    rb_raise(rb_eArgError, "could not load the grammar");
+
+  RbIncrementalParse *rb_parse = calloc(1, sizeof(*rb_parse));
+  rb_parse->bg.grammar = rb_grammar->grammar;
+  gzl_init_incremental_parse(&rb_parse->parse, &rb_parse->bg,
+                             parse_function_for(self, rb_grammar, false), NUM2ULONG(interval));
+
+  VALUE obj = Data_Wrap_Struct(Gazelle_IncrementalParse, 0, free_rb_incremental_parse, rb_parse);
+  rb_iv_set(obj, "@parser", self);
+  rb_iv_set(obj, "@input",  input);
+
+  /* The checkpoints cover the NUL that ends the input too.  @input is our
+   * own copy; rb_str_modify() makes sure it has its own buffer, and so the
+   * NUL. */
+  rb_str_modify(input);
+  char *input_string     = RSTRING_PTR(input);
+  enum gzl_status status = gzl_incremental_parse(&rb_parse->parse, input_string, RSTRING_LEN(input) + 1);
+  rb_iv_set(obj, "@valid", parse_succeeded(status));
+  return obj;
+}
+
+/* IncrementalParse#reparse(offset, removed, inserted): @input has had removed
+ * bytes at offset replaced with inserted bytes. */
+static VALUE rb_incremental_reparse(VALUE self, VALUE offset, VALUE removed, VALUE inserted) {
+  RbIncrementalParse *rb_parse;
+  Data_Get_Struct(self, RbIncrementalParse, rb_parse);
+
+  VALUE input            = rb_iv_get(self, "@input");
+  enum gzl_status status = gzl_incremental_reparse(&rb_parse->parse, RSTRING_PTR(input), RSTRING_LEN(input) + 1,
+                                                   NUM2ULONG(offset), NUM2ULONG(removed), NUM2ULONG(inserted));
+  return parse_succeeded(status);
+}
+
+/* IncrementalParse#bytes_reparsed: how much of the input the last parse or
+ * edit actually ran the parser over. */
+static VALUE rb_incremental_bytes_reparsed(VALUE self) {
+  RbIncrementalParse *rb_parse;
+  Data_Get_Struct(self, RbIncrementalParse, rb_parse);
+  return ULONG2NUM(rb_parse->parse.bytes_parsed);
+}
+
+/* Whether grammar_obj was made by this copy of the runtime, rather than by a
+ * compiled grammar's extension. */
+static bool own_grammar(VALUE grammar_obj) {
+  return RDATA(grammar_obj)->dfree == (RUBY_DATA_FUNC) free_rb_grammar;
+}
+
+/* The arrays are sized by the number of parsers, so they go on the heap, and
+ * rb_gzl_release_lockstep_states() frees them along with any parse states
+ * acquired, however the parse ends.  Zero until allocated. */
+struct rb_gzl_lockstep_args {
+  VALUE parsers;
+  VALUE input;
+  VALUE accepts;
+
+  RbGrammar **rb_grammars;  /* by parser: NULL if it isn't run in lockstep */
+  BoundGrammar *bgs;
+  struct gzl_lockstep_parse *parses;
+  RbGrammar **parse_grammars;
+  long *parse_parsers;
+  long num_parses;
+};
+
+static VALUE rb_gzl_parse_lockstep(VALUE args) {
+  struct rb_gzl_lockstep_args *lockstep_args = (struct rb_gzl_lockstep_args*) args;
+  VALUE parsers = lockstep_args->parsers;
+  VALUE input   = lockstep_args->input;
+  VALUE accepts = lockstep_args->accepts;
+  long num_parsers = RARRAY_LEN(parsers);
+  long i;
+
+  lockstep_args->rb_grammars    = ALLOC_N(RbGrammar*, num_parsers);
+  MEMZERO(lockstep_args->rb_grammars, RbGrammar*, num_parsers);
+  lockstep_args->bgs            = ALLOC_N(BoundGrammar, num_parsers);
+  lockstep_args->parses         = ALLOC_N(struct gzl_lockstep_parse, num_parsers);
+  lockstep_args->parse_grammars = ALLOC_N(RbGrammar*, num_parsers);
+  lockstep_args->parse_parsers  = ALLOC_N(long, num_parsers);
+
+  /* Everything that can call back into Ruby (loading grammars, parse? on
+   * other runtimes' parsers) happens before any parse state is acquired. */
+  for (i = 0; i < num_parsers; i++) {
+    VALUE parser      = rb_ary_entry(parsers, i);
+    VALUE grammar_obj = rb_iv_get(parser, "@grammar");
+
+    if (!NIL_P(grammar_obj) && !own_grammar(grammar_obj)) {
+      rb_ary_store(accepts, i, rb_funcall(parser, rb_intern("parse?"), 1, input));
+      continue;
+    }
+
+    RbGrammar *rb_grammar = rb_parser_grammar(parser);
+    if (rb_grammar && !gzl_prefilter_rejects(rb_grammar->grammar, RSTRING_PTR(input), RSTRING_LEN(input)))
+      lockstep_args->rb_grammars[i] = rb_grammar;
+    else
+      rb_ary_store(accepts, i, Qfalse);
+  }
+
+  for (i = 0; i < num_parsers; i++) {
+    RbGrammar *rb_grammar = lockstep_args->rb_grammars[i];
+    long n = lockstep_args->num_parses;
+    if (!rb_grammar)
+      continue;
+    BoundGrammar bg = {
+      .grammar = rb_grammar->grammar
+    };
+    lockstep_args->bgs[n]            = bg;
+    lockstep_args->parses[n].state   = gzl_acquire_parse_state(&rb_grammar->pool, &lockstep_args->bgs[n]);
+    lockstep_args->parses[n].parse   = parse_function_for(rb_ary_entry(parsers, i), rb_grammar, false);
+    lockstep_args->parses[n].status  = GZL_STATUS_OK;
+    lockstep_args->parse_grammars[n] = rb_grammar;
+    lockstep_args->parse_parsers[n]  = i;
+    lockstep_args->num_parses++;
+  }
+
+  struct gzl_lockstep_parse *parses = lockstep_args->parses;
+  long num_parses = lockstep_args->num_parses;
+  if (gzl_parse_lockstep(parses, num_parses, RSTRING_PTR(input), RSTRING_LEN(input)) > 0)
+    gzl_parse_lockstep(parses, num_parses, &end_of_input, 1);
+
+  for (i = 0; i < num_parses; i++)
+    rb_ary_store(accepts, lockstep_args->parse_parsers[i], parse_succeeded(parses[i].status));
+  return Qnil;
+}
+
+static VALUE rb_gzl_release_lockstep_states(VALUE args) {
+  struct rb_gzl_lockstep_args *lockstep_args = (struct rb_gzl_lockstep_args*) args;
+  long i;
+
+  for (i = 0; i < lockstep_args->num_parses; i++)
+    gzl_release_parse_state(&lockstep_args->parse_grammars[i]->pool, lockstep_args->parses[i].state);
+  xfree(lockstep_args->rb_grammars);
+  xfree(lockstep_args->bgs);
+  xfree(lockstep_args->parses);
+  xfree(lockstep_args->parse_grammars);
+  xfree(lockstep_args->parse_parsers);
+  return Qnil;
+}
+
+/* Parser.accepting(parsers, input): the parsers that would say parse?(input),
+ * found by running all of them over input together (see lockstep.c), so that
+ * a long input is read through only once.  A parser whose grammar belongs to
+ * another copy of the runtime (a compiled parser's does) is asked with parse?
+ * instead, so the grammar is still only handled by its own runtime. */
+static VALUE rb_gazelle_accepting(VALUE klass, VALUE parsers, VALUE input) {
+  VALUE Gazelle_Parser = rb_path2class("Gazelle::Parser");
+  long i;
+
+  Check_Type(parsers, T_ARRAY);
+  StringValue(input);
+
+  /* A copy, since parse? may run Ruby that changes the array. */
+  parsers = rb_ary_dup(parsers);
+  long num_parsers = RARRAY_LEN(parsers);
+  for (i = 0; i < num_parsers; i++) {
+    VALUE parser = rb_ary_entry(parsers, i);
+    if (!RTEST(rb_obj_is_kind_of(parser, Gazelle_Parser)))
+      rb_raise(rb_eTypeError, "wrong argument type %s (expected Gazelle::Parser)",
+               rb_obj_classname(parser));
+  }
+
+  struct rb_gzl_lockstep_args args = {
+    .parsers        = parsers,
+    .input          = input,
+    .accepts        = rb_ary_new2(num_parsers)
+  };
+  rb_ensure(rb_gzl_parse_lockstep, (VALUE) &args, rb_gzl_release_lockstep_states, (VALUE) &args);
+
+  VALUE accepting = rb_ary_new();
+  for (i = 0; i < num_parsers; i++)
+    if (RTEST(rb_ary_entry(args.accepts, i)))
+      rb_ary_push(accepting, rb_ary_entry(parsers, i));
+  return accepting;
+}
+
+/* Hook up the ruby methods.  Similar to lua's luaopen_(mod) functions */
+void Init_gazelle_ruby_bindings() {
+  VALUE Gazelle         = rb_const_get(rb_cObject, rb_intern("Gazelle"));
+  VALUE Gazelle_Parser  = rb_const_get_at(Gazelle, rb_intern("Parser"));
+
+  Gazelle_Grammar = rb_define_class_under(Gazelle, "Grammar", rb_cObject);
+  rb_undef_alloc_func(Gazelle_Grammar);
+
+  rb_define_method(Gazelle_Parser, "parse?", rb_gazelle_parse_p, 1);
+  rb_define_method(Gazelle_Parser, "parse",  rb_gazelle_parse, -1);
+  rb_define_method(Gazelle_Parser, "parse_file?", rb_gazelle_parse_file_p, 1);
+  rb_define_method(Gazelle_Parser, "load_parse", rb_gazelle_load_parse, -1);
+  rb_define_method(Gazelle_Parser, "event_names", rb_gazelle_event_names, 0);
+  rb_define_method(Gazelle_Parser, "parse_value", rb_gazelle_parse_value, 1);
+  rb_define_method(Gazelle_Parser, "parse_tree", rb_gazelle_parse_tree, 1);
+  rb_define_method(Gazelle_Parser, "start", rb_gazelle_start, 0);
+  rb_define_method(Gazelle_Parser, "feed", rb_gazelle_feed, 1);
+  rb_define_method(Gazelle_Parser, "finish", rb_gazelle_finish, 0);
+  rb_define_method(Gazelle_Parser, "parse_records", rb_gazelle_parse_records, 1);
+  rb_define_method(Gazelle_Parser, "record_class", rb_gazelle_record_class, 1);
+  rb_define_private_method(Gazelle_Parser, "tree_node", rb_gazelle_tree_node, 2);
+  rb_define_private_method(Gazelle_Parser, "parse_stats", rb_gazelle_parse_stats, 2);
+  rb_define_private_method(Gazelle_Parser, "each_event_batch_of", rb_gazelle_each_event_batch, 2);
+  rb_define_private_method(Gazelle_Parser, "event_stream", rb_gazelle_event_stream, 1);
+  rb_define_private_method(Gazelle_Parser, "next_event", rb_gazelle_next_event, 1);
+  rb_define_private_method(Gazelle_Parser, "each_stream_event", rb_gazelle_each_stream_event, 1);
+  rb_define_method(Gazelle_Parser, "write_c_extension", rb_gazelle_write_c_extension, 3);
+  rb_define_method(Gazelle_Parser, "profiling=", rb_gazelle_set_profiling, 1);
+  rb_define_method(Gazelle_Parser, "profiling?", rb_gazelle_profiling_p, 0);
+  rb_define_method(Gazelle_Parser, "write_profile", rb_gazelle_write_profile, 1);
+  rb_define_method(Gazelle_Parser, "optimization_report", rb_gazelle_optimization_report, 0);
+  rb_define_private_method(Gazelle_Parser, "incremental_parse", rb_gazelle_incremental_parse, 2);
+  rb_define_private_method(Gazelle_Parser, "resume_parse", rb_gazelle_resume_parse, 1);
+  rb_define_private_method(Gazelle_Parser, "save_parse", rb_gazelle_save_parse, 2);
+  rb_define_private_method(Gazelle_Parser, "restore_parse", rb_gazelle_restore_parse, 2);
+  rb_define_singleton_method(Gazelle_Parser, "accepting", rb_gazelle_accepting, 2);
+
+  Gazelle_PendingParse = rb_const_get_at(Gazelle, rb_intern("PendingParse"));
+  rb_undef_alloc_func(Gazelle_PendingParse);
+
+  Gazelle_Tree = rb_const_get_at(Gazelle, rb_intern("Tree"));
+  rb_undef_alloc_func(Gazelle_Tree);
+
+  Gazelle_EventStream = rb_const_get_at(Gazelle, rb_intern("EventStream"));
+  rb_undef_alloc_func(Gazelle_EventStream);
+
+  Gazelle_IncrementalParse = rb_const_get_at(Gazelle, rb_intern("IncrementalParse"));
+  rb_undef_alloc_func(Gazelle_IncrementalParse);
+  rb_define_private_method(Gazelle_IncrementalParse, "reparse", rb_incremental_reparse, 3);
+  rb_define_method(Gazelle_IncrementalParse, "bytes_reparsed", rb_incremental_bytes_reparsed, 0);
+
+  rb_define_const(Gazelle_Parser, "STACK_FRAME_SIZE", INT2FIX(sizeof(ParseStackFrame)));
+  rb_define_const(Gazelle_Parser, "TERMINAL_SIZE",    INT2FIX(sizeof(struct gzl_terminal)));
+  rb_define_const(Gazelle_Parser, "EVENT_SIZE",       INT2FIX(sizeof(struct rb_gzl_event)));
+  rb_define_const(Gazelle_Parser, "RULE_START",       INT2FIX(RB_GZL_EVENT_RULE_START));
+  rb_define_const(Gazelle_Parser, "RULE_END",         INT2FIX(RB_GZL_EVENT_RULE_END));
+  rb_define_const(Gazelle_Parser, "TERMINAL",         INT2FIX(RB_GZL_EVENT_TERMINAL));
+}
+
+#endif /* GAZELLE_COMPILED_GRAMMAR */
+
 #endif /* GAZELLE_RUBY_BINDINGS_C */
@@ -1,7 +1,59 @@
 #ifndef GAZELLE_RUBY_BINDINGS_H
 #define GAZELLE_RUBY_BINDINGS_H
 
-#define RSTRING_TO_PTR(x) RSTRING(x)->ptr
+/* Ruby 1.8.5 and earlier have no accessor macros. */
+#ifndef RSTRING_PTR
+#define RSTRING_PTR(x) (RSTRING(x)->ptr)
+#define RSTRING_LEN(x) (RSTRING(x)->len)
+#endif
+#ifndef RARRAY_LEN
+#define RARRAY_LEN(x)  (RARRAY(x)->len)
+#endif
+#ifndef RB_GC_GUARD
+#define RB_GC_GUARD(v) (*(volatile VALUE *)&(v))
+#endif
+
+/* Nor before 1.9.3 is there rb_ary_resize(); this only shrinks. */
+#ifndef HAVE_RB_ARY_RESIZE
+#define rb_ary_resize(ary, len) \
+  rb_funcall((ary), rb_intern("slice!"), 2, LONG2NUM(len), LONG2NUM(RARRAY_LEN(ary) - (len)))
+#endif
+
+/* Ids for a grammar's rule and terminal names: their indexes in
+ * grammar->strings, which the names point into.  Rules are looked up by RTN
+ * index; terminals, which have no index of their own, by the address of
+ * their name, hashed. */
+struct rb_gzl_names {
+  long   num_names;
+  long   *rtn_ids;
+
+  size_t mask;
+  char   **keys;
+  long   *ids;
+};
+
+/* A handler registered for a path, as in on("column_name/UNQUOTED_ID"): the
+ * last name in the path is the rule or terminal it handles, and each name
+ * before that a rule the next must be inside, at any depth. */
+struct rb_gzl_path {
+  VALUE action;     /* the path, as a Symbol */
+  long  *ancestors; /* name ids, innermost first */
+  int   num_ancestors;
+
+  /* The next path ending in the same name, in the order they were added. */
+  struct rb_gzl_path *next;
+};
+
+/* Which of a grammar's rules and terminals have a handler in a parser's
+ * @rules, so that a parse only calls into Ruby for those: by name id, the
+ * name as a Symbol, or 0 if there is no handler.  A debugging parser has
+ * every name, since run_rule shows them all.  Handlers for paths are kept
+ * by the id of the name they end in, and paths is NULL if there are none. */
+struct rb_gzl_dispatch {
+  struct rb_gzl_names *names;
+  VALUE *rules;
+  struct rb_gzl_path **paths;
+};
 
 struct rb_gzl_user_data {
   /* The pointer to the current ruby parser object. */
@@ -10,8 +62,232 @@ struct rb_gzl_user_data {
   /* The input given to the parse function */
   char *input;
 
-  /* The real ruby string object given to the parser */
+  /* A frozen string with the input's bytes, which rules are given shared
+   * substrings of. */
   VALUE rb_input;
+
+  /* For a push parse (Parser#feed), where rb_input only holds the bytes
+   * still kept: the offset in the whole input of rb_input's first byte. */
+  size_t base;
+  bool   push;
+
+  /* Where the last terminal passed to terminal_callback ended, which is
+   * where a rule that ends before the next one ends too. */
+  size_t terminal_end;
+
+  struct rb_gzl_grammar *rb_grammar;
+
+  /* The parser's @dispatch when the parse started, or when the last rule to
+   * run returned, since rules may add rules. */
+  VALUE dispatch_obj;
+  struct rb_gzl_dispatch *dispatch;
+
+  /* Whether @last_result holds the result of the last rule, rather than
+   * having been cleared for a rule without a handler after it. */
+  bool has_result;
+};
+
+/* A loaded grammar, owned by the Gazelle::Grammar object in a parser's
+ * @grammar. */
+struct rb_gzl_grammar {
+  struct gzl_grammar *grammar;
+
+  /* False for grammars compiled into the extension as static data. */
+  bool owns_grammar;
+
+  /* Idle parse states, reused from one parse to the next. */
+  struct gzl_parse_state_pool pool;
+
+  /* Built the first time it's needed. */
+  struct rb_gzl_names names;
+};
+
+/* One record of Parser#each_event_batch's packed strings (see EVENT_FORMAT
+ * in parser.rb). */
+struct rb_gzl_event {
+  uint32_t kind;
+  uint32_t name;  /* a name id (see struct rb_gzl_names) */
+  uint64_t start;
+  uint64_t end;
+};
+
+enum {
+  RB_GZL_EVENT_RULE_START,
+  RB_GZL_EVENT_RULE_END,
+  RB_GZL_EVENT_TERMINAL
+};
+
+/* The user_data of a parse run by Parser#each_event_batch: events are
+ * collected here and yielded batch_size at a time. */
+struct rb_gzl_event_batch {
+  VALUE self;
+  struct rb_gzl_names *names;
+
+  struct rb_gzl_event *events;
+  size_t len;
+  size_t events_size;
+
+  /* Yielded when there are this many; with 0, they are kept until taken. */
+  size_t batch_size;
+
+  /* As for struct rb_gzl_user_data. */
+  size_t terminal_end;
+};
+
+/* A Gazelle::IncrementalParse: the checkpoints of a parse of its @input. */
+struct rb_gzl_incremental_parse {
+  struct gzl_bound_grammar bg;
+  struct gzl_incremental_parse parse;
+};
+
+/* A Gazelle::PendingParse: a parse that ran out of its budget part of the
+ * way through its @input, and can be resumed. */
+struct rb_gzl_pending_parse {
+  struct gzl_bound_grammar bg;
+  struct rb_gzl_user_data  user_data;
+
+  /* NULL once the parse has finished. */
+  struct gzl_parse_state   *state;
+  gzl_parse_function_t     parse;
+  enum gzl_status          status;
+
+  /* Given afresh for each stretch of the parse; the deadline is seconds from
+   * when the stretch starts. */
+  struct gzl_budget        budget;
+  double                   seconds;
+};
+
+/* A Gazelle::EventStream: a parse of its @input, run only as far as the
+ * events asked for so far. */
+#define RB_GZL_STREAM_CHUNK_SIZE 4096
+
+struct rb_gzl_event_stream {
+  struct gzl_bound_grammar bg;
+
+  /* NULL once the parse has finished. */
+  struct gzl_parse_state *state;
+  gzl_parse_function_t   parse;
+  enum gzl_status        status;
+
+  /* The events of the last chunk parsed, and the next of them to hand out. */
+  struct rb_gzl_event_batch batch;
+  size_t next;
+
+  /* How many bytes of the input have been parsed. */
+  size_t fed;
+};
+
+/* The parse run by Parser#start, #feed and #finish. */
+struct rb_gzl_push_parse {
+  struct gzl_bound_grammar bg;
+  struct rb_gzl_user_data  user_data;
+
+  /* NULL once the parse can take no more input. */
+  struct gzl_parse_state   *state;
+  gzl_parse_function_t     parse;
+  enum gzl_status          status;
+
+  /* While a chunk (or the end of the input) is being parsed, when rules must
+   * not start, feed or finish the parse. */
+  bool                     running;
+
+  /* The bytes of the terminals still open after the last chunk, from the
+   * offset base in the whole input on. */
+  VALUE  kept;
+  size_t base;
+};
+
+/* The user_data of a parse run by Parser#parse_value. */
+struct rb_gzl_value_parse {
+  VALUE self;
+  struct rb_gzl_grammar *rb_grammar;
+
+  /* The parser's @value_dispatch, as for struct rb_gzl_user_data. */
+  VALUE dispatch_obj;
+  struct rb_gzl_dispatch *dispatch;
+
+  /* The values of the terminals and rules not yet taken as children, and
+   * for each open rule, where on it its children start. */
+  VALUE  values;
+  long   *bases;
+  size_t num_bases;
+  size_t bases_size;
+
+  /* As for struct rb_gzl_user_data. */
+  size_t terminal_end;
+};
+
+/* A Gazelle::Tree: the parse tree of its @input, built in one block of
+ * nodes as the input is parsed.  Nodes refer to each other by index. */
+#define RB_GZL_NO_NODE UINT32_MAX
+
+struct rb_gzl_tree_node {
+  uint32_t kind;  /* RB_GZL_EVENT_RULE_END for a rule, or RB_GZL_EVENT_TERMINAL */
+  uint32_t name;  /* a name id */
+  uint32_t first_child;
+  uint32_t next_sibling;
+  uint64_t start;
+  uint64_t end;
+};
+
+struct rb_gzl_tree {
+  struct rb_gzl_tree_node *nodes;
+  uint32_t num_nodes;
+  uint32_t nodes_size;
+
+  /* While the tree is being built: the rules that have started but not yet
+   * ended, each with the last child added to it so far. */
+  struct rb_gzl_open_node {
+    uint32_t node;
+    uint32_t last_child;
+  } *open;
+  size_t num_open;
+  size_t open_size;
+
+  struct rb_gzl_names *names;
+
+  /* As for struct rb_gzl_user_data. */
+  size_t terminal_end;
+};
+
+/* The Struct classes Parser#parse_records fills in, one per rule, and which
+ * of a rule's members each of its slots fills (see load_rtn() in
+ * load_grammar.c): a slot's member, or -1 if its name, like "(", can't name
+ * one.  Kept with the grammar, so the classes are only made once. */
+struct rb_gzl_records {
+  int   num_rtns;
+  VALUE *classes;  /* Qnil for a rule with no members */
+  int   **members;
+};
+
+/* Where the text of the terminal or rule last taken in a slot starts and
+ * ends, or RB_GZL_EMPTY_SLOT if none has been yet. */
+#define RB_GZL_EMPTY_SLOT SIZE_MAX
+
+struct rb_gzl_slot {
+  size_t start;
+  size_t end;
+};
+
+/* The user_data of a parse run by Parser#parse_records. */
+struct rb_gzl_record_parse {
+  VALUE self;
+  VALUE input;
+  struct rb_gzl_grammar *rb_grammar;
+  struct rb_gzl_records *records;
+
+  /* The parser's @record_dispatch, as for struct rb_gzl_user_data. */
+  VALUE dispatch_obj;
+  struct rb_gzl_dispatch *dispatch;
+
+  /* The slots of every rule that has started but not yet ended, the
+   * innermost last. */
+  struct rb_gzl_slot *slots;
+  size_t num_slots;
+  size_t slots_size;
+
+  /* As for struct rb_gzl_user_data. */
+  size_t terminal_end;
 };
 
 typedef struct gzl_parse_state       ParseState;
@@ -19,7 +295,21 @@ typedef struct gzl_bound_grammar     BoundGrammar;
 typedef struct rb_gzl_user_data      RbUserData;
 typedef struct gzl_parse_stack_frame ParseStackFrame;
 typedef struct rb_gzl_user_data      RbGazelleUserData;
+typedef struct rb_gzl_grammar        RbGrammar;
+typedef struct rb_gzl_incremental_parse RbIncrementalParse;
+typedef struct rb_gzl_pending_parse  RbPendingParse;
+typedef struct rb_gzl_dispatch       RbDispatch;
+typedef struct rb_gzl_names          RbNames;
+typedef struct rb_gzl_event_batch    RbEventBatch;
+typedef struct rb_gzl_event_stream   RbEventStream;
+typedef struct rb_gzl_push_parse     RbPushParse;
+typedef struct rb_gzl_value_parse    RbValueParse;
+typedef struct rb_gzl_tree           RbTree;
+typedef struct rb_gzl_records        RbRecords;
+typedef struct rb_gzl_record_parse   RbRecordParse;
 
+#ifndef GAZELLE_COMPILED_GRAMMAR
 void Init_gazelle_ruby_bindings();
+#endif
 
 #endif /* GAZELLE_RUBY_BINDINGS_H */
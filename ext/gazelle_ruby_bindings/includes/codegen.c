@@ -0,0 +1,503 @@
+/*********************************************************************
+
+  Gazelle: a system for building fast, reusable parsers
+
+  codegen.c
+
+  Compiles a loaded grammar ahead of time into C source.  The output
+  contains the grammar itself as static data (so nothing is read from
+  a .gzc at runtime), one function per IntFA in which every state is a
+  label and every transition a goto, and two functions that replace
+  the interpreter's linear searches for RTN and GLA transitions with
+  straight-line code.  Those functions are hung off the grammar's
+  gzl_grammar_code, which parse.c and generated.c consult.
+
+  Every symbol in the output is prefixed with "gzl_<name>_", so that
+  several compiled grammars can be linked together.
+
+  This file is #included after parse.c and uses its internals.
+
+*********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "gazelle/grammar.h"
+
+/*
+ * string_index(): returns the index in g->strings of an interned string
+ * (terminal names, rule names and slot names all point into g->strings).
+ */
+static
+int string_index(struct gzl_grammar *g, char *str)
+{
+    int i;
+    for(i = 0; g->strings[i]; i++)
+        if(g->strings[i] == str)
+            return i;
+
+    /* Strings we emit always come from the string table. */
+    assert(false);
+    return -1;
+}
+
+static
+void emit_string_ref(FILE *out, const char *prefix, struct gzl_grammar *g,
+                     char *str)
+{
+    if(str)
+        fprintf(out, "gzl_%s_str_%d", prefix, string_index(g, str));
+    else
+        fprintf(out, "NULL");
+}
+
+static
+void emit_c_string(FILE *out, const char *str)
+{
+    const unsigned char *p;
+    fputc('"', out);
+    for(p = (const unsigned char*)str; *p; p++) {
+        if(*p == '"' || *p == '\\')
+            fprintf(out, "\\%c", *p);
+        else if(*p >= 0x20 && *p < 0x7F)
+            fputc(*p, out);
+        else
+            fprintf(out, "\\%03o", *p);
+    }
+    fputc('"', out);
+}
+
+/* ISO C has no zero-length arrays, so empty tables get one unused slot. */
+static
+int array_size(int n)
+{
+    return n > 0 ? n : 1;
+}
+
+/*
+ * Data: the string table, then every IntFA, GLA and RTN.  The states and
+ * transitions of one machine point at each other, so every array is
+ * declared (as a tentative definition) before any of them is defined.
+ */
+
+static
+void emit_declarations(FILE *out, const char *prefix, struct gzl_grammar *g)
+{
+    int i;
+
+    fprintf(out, "static struct gzl_intfa gzl_%s_intfas[%d];\n",
+            prefix, array_size(g->num_intfas));
+    fprintf(out, "static struct gzl_gla gzl_%s_glas[%d];\n",
+            prefix, array_size(g->num_glas));
+    fprintf(out, "static struct gzl_rtn gzl_%s_rtns[%d];\n",
+            prefix, array_size(g->num_rtns));
+
+    for(i = 0; i < g->num_intfas; i++) {
+        struct gzl_intfa *intfa = &g->intfas[i];
+        fprintf(out, "static struct gzl_intfa_state gzl_%s_intfa_%d_states[%d];\n",
+                prefix, i, array_size(intfa->num_states));
+        fprintf(out, "static struct gzl_intfa_transition gzl_%s_intfa_%d_transitions[%d];\n",
+                prefix, i, array_size(intfa->num_transitions));
+    }
+
+    for(i = 0; i < g->num_glas; i++) {
+        struct gzl_gla *gla = &g->glas[i];
+        fprintf(out, "static struct gzl_gla_state gzl_%s_gla_%d_states[%d];\n",
+                prefix, i, array_size(gla->num_states));
+        fprintf(out, "static struct gzl_gla_transition gzl_%s_gla_%d_transitions[%d];\n",
+                prefix, i, array_size(gla->num_transitions));
+    }
+
+    for(i = 0; i < g->num_rtns; i++) {
+        struct gzl_rtn *rtn = &g->rtns[i];
+        fprintf(out, "static struct gzl_rtn_state gzl_%s_rtn_%d_states[%d];\n",
+                prefix, i, array_size(rtn->num_states));
+        fprintf(out, "static struct gzl_rtn_transition gzl_%s_rtn_%d_transitions[%d];\n",
+                prefix, i, array_size(rtn->num_transitions));
+    }
+
+    fprintf(out, "\n");
+}
+
+static
+void emit_strings(FILE *out, const char *prefix, struct gzl_grammar *g)
+{
+    int i;
+
+    for(i = 0; g->strings[i]; i++) {
+        fprintf(out, "static char gzl_%s_str_%d[] = ", prefix, i);
+        emit_c_string(out, g->strings[i]);
+        fprintf(out, ";\n");
+    }
+
+    fprintf(out, "\nstatic char *gzl_%s_strings[] = {\n", prefix);
+    for(i = 0; g->strings[i]; i++)
+        fprintf(out, "    gzl_%s_str_%d,\n", prefix, i);
+    fprintf(out, "    NULL\n};\n\n");
+}
+
+static
+void emit_intfa(FILE *out, const char *prefix, struct gzl_grammar *g, int i)
+{
+    struct gzl_intfa *intfa = &g->intfas[i];
+    int j;
+
+    fprintf(out, "static struct gzl_intfa_transition gzl_%s_intfa_%d_transitions[%d] = {\n",
+            prefix, i, array_size(intfa->num_transitions));
+    for(j = 0; j < intfa->num_transitions; j++) {
+        struct gzl_intfa_transition *t = &intfa->transitions[j];
+        fprintf(out, "    { %d, %d, &gzl_%s_intfa_%d_states[%d] },\n",
+                t->ch_low, t->ch_high, prefix, i,
+                (int)(t->dest_state - intfa->states));
+    }
+    if(intfa->num_transitions == 0)
+        fprintf(out, "    { 0, 0, NULL }\n");
+    fprintf(out, "};\n\n");
+
+    fprintf(out, "static struct gzl_intfa_state gzl_%s_intfa_%d_states[%d] = {\n",
+            prefix, i, array_size(intfa->num_states));
+    for(j = 0; j < intfa->num_states; j++) {
+        struct gzl_intfa_state *state = &intfa->states[j];
+        fprintf(out, "    { ");
+        emit_string_ref(out, prefix, g, state->final);
+        fprintf(out, ", %d, &gzl_%s_intfa_%d_transitions[%d] },\n",
+                state->num_transitions, prefix, i,
+                (int)(state->transitions - intfa->transitions));
+    }
+    fprintf(out, "};\n\n");
+}
+
+static
+void emit_gla(FILE *out, const char *prefix, struct gzl_grammar *g, int i)
+{
+    struct gzl_gla *gla = &g->glas[i];
+    int j;
+
+    fprintf(out, "static struct gzl_gla_transition gzl_%s_gla_%d_transitions[%d] = {\n",
+            prefix, i, array_size(gla->num_transitions));
+    for(j = 0; j < gla->num_transitions; j++) {
+        struct gzl_gla_transition *t = &gla->transitions[j];
+        fprintf(out, "    { ");
+        emit_string_ref(out, prefix, g, t->term);
+        fprintf(out, ", &gzl_%s_gla_%d_states[%d] },\n",
+                prefix, i, (int)(t->dest_state - gla->states));
+    }
+    if(gla->num_transitions == 0)
+        fprintf(out, "    { NULL, NULL }\n");
+    fprintf(out, "};\n\n");
+
+    fprintf(out, "static struct gzl_gla_state gzl_%s_gla_%d_states[%d] = {\n",
+            prefix, i, array_size(gla->num_states));
+    for(j = 0; j < gla->num_states; j++) {
+        struct gzl_gla_state *state = &gla->states[j];
+        if(state->is_final)
+            fprintf(out, "    { .is_final = true, .d.final = { %d } },\n",
+                    state->d.final.transition_offset);
+        else
+            fprintf(out, "    { .is_final = false, .d.nonfinal = { "
+                    "&gzl_%s_intfas[%d], %d, &gzl_%s_gla_%d_transitions[%d] } },\n",
+                    prefix, (int)(state->d.nonfinal.intfa - g->intfas),
+                    state->d.nonfinal.num_transitions, prefix, i,
+                    (int)(state->d.nonfinal.transitions - gla->transitions));
+    }
+    fprintf(out, "};\n\n");
+}
+
+static
+void emit_rtn(FILE *out, const char *prefix, struct gzl_grammar *g, int i)
+{
+    struct gzl_rtn *rtn = &g->rtns[i];
+    int j;
+
+    fprintf(out, "static struct gzl_rtn_transition gzl_%s_rtn_%d_transitions[%d] = {\n",
+            prefix, i, array_size(rtn->num_transitions));
+    for(j = 0; j < rtn->num_transitions; j++) {
+        struct gzl_rtn_transition *t = &rtn->transitions[j];
+        if(t->transition_type == GZL_TERMINAL_TRANSITION) {
+            fprintf(out, "    { GZL_TERMINAL_TRANSITION, .edge.terminal_name = ");
+            emit_string_ref(out, prefix, g, t->edge.terminal_name);
+        } else {
+            fprintf(out, "    { GZL_NONTERM_TRANSITION, .edge.nonterminal = &gzl_%s_rtns[%d]",
+                    prefix, (int)(t->edge.nonterminal - g->rtns));
+        }
+        fprintf(out, ", .dest_state = &gzl_%s_rtn_%d_states[%d], .slotname = ",
+                prefix, i, (int)(t->dest_state - rtn->states));
+        emit_string_ref(out, prefix, g, t->slotname);
+        fprintf(out, ", .slotnum = %d },\n", t->slotnum);
+    }
+    if(rtn->num_transitions == 0)
+        fprintf(out, "    { GZL_TERMINAL_TRANSITION }\n");
+    fprintf(out, "};\n\n");
+
+    fprintf(out, "static struct gzl_rtn_state gzl_%s_rtn_%d_states[%d] = {\n",
+            prefix, i, array_size(rtn->num_states));
+    for(j = 0; j < rtn->num_states; j++) {
+        struct gzl_rtn_state *state = &rtn->states[j];
+        fprintf(out, "    { .is_final = %s, ", state->is_final ? "true" : "false");
+        switch(state->lookahead_type) {
+            case GZL_STATE_HAS_INTFA:
+                fprintf(out, ".lookahead_type = GZL_STATE_HAS_INTFA, "
+                        ".d.state_intfa = &gzl_%s_intfas[%d], ",
+                        prefix, (int)(state->d.state_intfa - g->intfas));
+                break;
+            case GZL_STATE_HAS_GLA:
+                fprintf(out, ".lookahead_type = GZL_STATE_HAS_GLA, "
+                        ".d.state_gla = &gzl_%s_glas[%d], ",
+                        prefix, (int)(state->d.state_gla - g->glas));
+                break;
+            case GZL_STATE_HAS_NEITHER:
+                fprintf(out, ".lookahead_type = GZL_STATE_HAS_NEITHER, ");
+                break;
+        }
+        fprintf(out, ".num_transitions = %d, "
+                ".transitions = &gzl_%s_rtn_%d_transitions[%d] },\n",
+                state->num_transitions, prefix, i,
+                (int)(state->transitions - rtn->transitions));
+    }
+    fprintf(out, "};\n\n");
+}
+
+static
+void emit_array_end(FILE *out, int n)
+{
+    if(n == 0)
+        fprintf(out, "    { 0 }\n");
+    fprintf(out, "};\n\n");
+}
+
+static
+void emit_machines(FILE *out, const char *prefix, struct gzl_grammar *g)
+{
+    int i;
+
+    for(i = 0; i < g->num_intfas; i++)
+        emit_intfa(out, prefix, g, i);
+    for(i = 0; i < g->num_glas; i++)
+        emit_gla(out, prefix, g, i);
+    for(i = 0; i < g->num_rtns; i++)
+        emit_rtn(out, prefix, g, i);
+
+    fprintf(out, "static struct gzl_intfa gzl_%s_intfas[%d] = {\n",
+            prefix, array_size(g->num_intfas));
+    for(i = 0; i < g->num_intfas; i++)
+        fprintf(out, "    { %d, gzl_%s_intfa_%d_states, %d, gzl_%s_intfa_%d_transitions },\n",
+                g->intfas[i].num_states, prefix, i,
+                g->intfas[i].num_transitions, prefix, i);
+    emit_array_end(out, g->num_intfas);
+
+    fprintf(out, "static struct gzl_gla gzl_%s_glas[%d] = {\n",
+            prefix, array_size(g->num_glas));
+    for(i = 0; i < g->num_glas; i++)
+        fprintf(out, "    { %d, gzl_%s_gla_%d_states, %d, gzl_%s_gla_%d_transitions },\n",
+                g->glas[i].num_states, prefix, i,
+                g->glas[i].num_transitions, prefix, i);
+    emit_array_end(out, g->num_glas);
+
+    fprintf(out, "static struct gzl_rtn gzl_%s_rtns[%d] = {\n",
+            prefix, array_size(g->num_rtns));
+    for(i = 0; i < g->num_rtns; i++) {
+        struct gzl_rtn *rtn = &g->rtns[i];
+        fprintf(out, "    { ");
+        emit_string_ref(out, prefix, g, rtn->name);
+        fprintf(out, ", %d, %d, gzl_%s_rtn_%d_states, %d, gzl_%s_rtn_%d_transitions },\n",
+                rtn->num_slots, rtn->num_states, prefix, i,
+                rtn->num_transitions, prefix, i);
+    }
+    emit_array_end(out, g->num_rtns);
+}
+
+/*
+ * Code: the lexers, then the RTN and GLA transition lookups.
+ */
+
+/*
+ * emit_lexer(): one function per IntFA.  Each state is a label; on entry we
+ * jump to the caller's state, then follow transitions with goto until we run
+ * out of input, hit a byte with no transition, or complete a token.  The
+ * transitions are worked out with find_intfa_transition() itself, so the
+ * generated code agrees with the interpreter byte for byte.
+ */
+static
+void emit_lexer(FILE *out, const char *prefix, struct gzl_grammar *g, int i)
+{
+    struct gzl_intfa *intfa = &g->intfas[i];
+    int dests[256];
+    int j, b;
+
+    fprintf(out, "static unsigned char *gzl_%s_lex_%d(uint32_t *state, "
+            "unsigned char *p, unsigned char *end)\n{\n", prefix, i);
+    fprintf(out, "    switch(*state) {\n");
+    for(j = 0; j < intfa->num_states; j++)
+        fprintf(out, "        case %d: goto s%d;\n", j, j);
+    fprintf(out, "    }\n    return p;\n\n");
+
+    for(j = 0; j < intfa->num_states; j++) {
+        struct gzl_intfa_state *state = &intfa->states[j];
+
+        fprintf(out, "%ss%d:\n", j ? "\n" : "", j);
+        if(state->final && state->num_transitions == 0) {
+            fprintf(out, "    *state = %d;\n    return p;\n", j);
+            continue;
+        }
+
+        for(b = 0; b < 256; b++) {
+            struct gzl_intfa_transition *t =
+                find_intfa_transition(state, (char)b);
+            dests[b] = t ? t->dest_state - intfa->states : -1;
+        }
+
+        fprintf(out, "    if(p == end) {\n        *state = %d;\n        return p;\n    }\n", j);
+        fprintf(out, "    switch(*p) {\n");
+        for(b = 0; b < 256; b++) {
+            int dest = dests[b];
+            int c, count = 0;
+            if(dest < 0)
+                continue;
+
+            /* All the bytes that lead to this destination share one arm. */
+            for(c = b; c < 256; c++) {
+                if(dests[c] != dest)
+                    continue;
+                if(count % 8 == 0)
+                    fprintf(out, "%s       ", count ? "\n" : "");
+                fprintf(out, " case %d:", c);
+                dests[c] = -1;
+                count++;
+            }
+            fprintf(out, "\n            p++;\n            goto s%d;\n", dest);
+        }
+        fprintf(out, "        default:\n            *state = %d;\n            return p;\n", j);
+        fprintf(out, "    }\n");
+    }
+
+    fprintf(out, "}\n\n");
+}
+
+static
+void emit_lex_dispatch(FILE *out, const char *prefix, struct gzl_grammar *g)
+{
+    int i;
+
+    fprintf(out, "static unsigned char *gzl_%s_lex(uint32_t intfa, uint32_t *state,\n"
+            "        unsigned char *p, unsigned char *end)\n{\n", prefix);
+    fprintf(out, "    switch(intfa) {\n");
+    for(i = 0; i < g->num_intfas; i++)
+        fprintf(out, "        case %d: return gzl_%s_lex_%d(state, p, end);\n",
+                i, prefix, i);
+    fprintf(out, "    }\n    return p;\n}\n\n");
+}
+
+/*
+ * emit_rtn_terminal_transitions(): a switch on (RTN, state), then the
+ * state's terminal transitions as a chain of pointer comparisons, in the
+ * order find_rtn_terminal_transition() tries them.
+ */
+static
+void emit_rtn_terminal_transitions(FILE *out, const char *prefix,
+                                   struct gzl_grammar *g)
+{
+    int i, j, k;
+
+    fprintf(out, "static struct gzl_rtn_transition *gzl_%s_rtn_terminal_transition(\n"
+            "        uint32_t rtn, uint32_t state, char *term)\n{\n", prefix);
+    fprintf(out, "    switch(rtn) {\n");
+    for(i = 0; i < g->num_rtns; i++) {
+        struct gzl_rtn *rtn = &g->rtns[i];
+        fprintf(out, "    case %d:\n        switch(state) {\n", i);
+        for(j = 0; j < rtn->num_states; j++) {
+            struct gzl_rtn_state *state = &rtn->states[j];
+            bool any = false;
+            for(k = 0; k < state->num_transitions; k++) {
+                struct gzl_rtn_transition *t = &state->transitions[k];
+                if(t->transition_type != GZL_TERMINAL_TRANSITION)
+                    continue;
+                if(!any)
+                    fprintf(out, "        case %d:\n", j);
+                any = true;
+                fprintf(out, "            if(term == ");
+                emit_string_ref(out, prefix, g, t->edge.terminal_name);
+                fprintf(out, ") return &gzl_%s_rtn_%d_transitions[%d];\n",
+                        prefix, i, (int)(t - rtn->transitions));
+            }
+            if(any)
+                fprintf(out, "            return NULL;\n");
+        }
+        fprintf(out, "        }\n        return NULL;\n");
+    }
+    fprintf(out, "    }\n    return NULL;\n}\n\n");
+}
+
+static
+void emit_gla_transitions(FILE *out, const char *prefix, struct gzl_grammar *g)
+{
+    int i, j, k;
+
+    fprintf(out, "static struct gzl_gla_transition *gzl_%s_gla_transition(\n"
+            "        uint32_t gla, uint32_t state, char *term)\n{\n", prefix);
+    fprintf(out, "    switch(gla) {\n");
+    for(i = 0; i < g->num_glas; i++) {
+        struct gzl_gla *gla = &g->glas[i];
+        fprintf(out, "    case %d:\n        switch(state) {\n", i);
+        for(j = 0; j < gla->num_states; j++) {
+            struct gzl_gla_state *state = &gla->states[j];
+            if(state->is_final || state->d.nonfinal.num_transitions == 0)
+                continue;
+            fprintf(out, "        case %d:\n", j);
+            for(k = 0; k < state->d.nonfinal.num_transitions; k++) {
+                struct gzl_gla_transition *t = &state->d.nonfinal.transitions[k];
+                fprintf(out, "            if(term == ");
+                emit_string_ref(out, prefix, g, t->term);
+                fprintf(out, ") return &gzl_%s_gla_%d_transitions[%d];\n",
+                        prefix, i, (int)(t - gla->transitions));
+            }
+            fprintf(out, "            return NULL;\n");
+        }
+        fprintf(out, "        }\n        return NULL;\n");
+    }
+    fprintf(out, "    }\n    return NULL;\n}\n\n");
+}
+
+/*
+ * gzl_generate_c(): writes the C source for grammar g to out.  The grammar
+ * is available to the rest of the file as "gzl_<prefix>_grammar"; the
+ * caller is responsible for anything that comes before (includes) or after
+ * (code that uses the grammar).
+ */
+void gzl_generate_c(struct gzl_grammar *g, const char *prefix, FILE *out)
+{
+    int i;
+
+    emit_declarations(out, prefix, g);
+    emit_strings(out, prefix, g);
+    emit_machines(out, prefix, g);
+
+    for(i = 0; i < g->num_intfas; i++)
+        emit_lexer(out, prefix, g, i);
+    emit_lex_dispatch(out, prefix, g);
+    emit_rtn_terminal_transitions(out, prefix, g);
+    emit_gla_transitions(out, prefix, g);
+
+    fprintf(out, "static const struct gzl_grammar_code gzl_%s_code = {\n"
+            "    gzl_%s_lex,\n"
+            "    gzl_%s_rtn_terminal_transition,\n"
+            "    gzl_%s_gla_transition\n"
+            "};\n\n", prefix, prefix, prefix, prefix);
+
+    fprintf(out, "static struct gzl_grammar gzl_%s_grammar = {\n", prefix);
+    fprintf(out, "    .strings = gzl_%s_strings,\n", prefix);
+    fprintf(out, "    .rtns = gzl_%s_rtns,\n    .num_rtns = %d,\n", prefix, g->num_rtns);
+    fprintf(out, "    .glas = gzl_%s_glas,\n    .num_glas = %d,\n", prefix, g->num_glas);
+    fprintf(out, "    .intfas = gzl_%s_intfas,\n    .num_intfas = %d,\n", prefix, g->num_intfas);
+    fprintf(out, "    .max_gla_lookahead = %d,\n", g->max_gla_lookahead);
+    fprintf(out, "    .stack_depth_hint = %lu,\n", (unsigned long)g->stack_depth_hint);
+    fprintf(out, "    .code = &gzl_%s_code\n};\n", prefix);
+}
+
+/*
+ * Local Variables:
+ * c-file-style: "bsd"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ * vim:et:sts=4:sw=4
+ */
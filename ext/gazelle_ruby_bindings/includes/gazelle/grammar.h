@@ -0,0 +1,278 @@
+/*********************************************************************
+
+  Gazelle: a system for building fast, reusable parsers
+
+  grammar.h
+
+  This file defines the in-memory representation of a compiled
+  grammar, as loaded from bitcode by load_grammar.c.  It is vendored
+  alongside includes/load_grammar.c.
+
+  Copyright (c) 2007-2008 Joshua Haberman.  See LICENSE for details.
+
+*********************************************************************/
+
+#ifndef GAZELLE_GRAMMAR
+#define GAZELLE_GRAMMAR
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+struct bc_read_stream;
+struct gzl_parse_stack_frame;
+struct gzl_bytecode;
+
+/*
+ * RTN
+ */
+
+struct gzl_rtn {
+    char *name;
+    int num_slots;
+
+    int num_states;
+    struct gzl_rtn_state *states;  /* start state is first */
+
+    int num_transitions;
+    struct gzl_rtn_transition *transitions;
+};
+
+struct gzl_rtn_transition {
+    enum {
+      GZL_TERMINAL_TRANSITION,
+      GZL_NONTERM_TRANSITION
+    } transition_type;
+
+    union {
+      char            *terminal_name;
+      struct gzl_rtn  *nonterminal;
+    } edge;
+
+    struct gzl_rtn_state *dest_state;
+    char *slotname;
+    int slotnum;
+};
+
+struct gzl_rtn_state {
+    bool is_final;
+
+    enum {
+      GZL_STATE_HAS_INTFA,
+      GZL_STATE_HAS_GLA,
+      GZL_STATE_HAS_NEITHER
+    } lookahead_type;
+
+    union {
+      struct gzl_intfa *state_intfa;
+      struct gzl_gla *state_gla;
+    } d;
+
+    int num_transitions;
+    struct gzl_rtn_transition *transitions;
+};
+
+/*
+ * GLA
+ */
+
+struct gzl_gla {
+    int num_states;
+    struct gzl_gla_state *states;  /* start state is first */
+
+    int num_transitions;
+    struct gzl_gla_transition *transitions;
+};
+
+struct gzl_gla_transition {
+    char *term;  /* if NULL, then the term is EOF */
+    struct gzl_gla_state *dest_state;
+};
+
+struct gzl_gla_state {
+    bool is_final;
+
+    union {
+        struct {
+            struct gzl_intfa *intfa;
+            int num_transitions;
+            struct gzl_gla_transition *transitions;
+        } nonfinal;
+
+        struct {
+            int transition_offset; /* 1-based -- 0 is "return" */
+        } final;
+    } d;
+};
+
+/*
+ * IntFA
+ */
+
+struct gzl_intfa {
+    int num_states;
+    struct gzl_intfa_state *states;  /* start state is first */
+
+    int num_transitions;
+    struct gzl_intfa_transition *transitions;
+};
+
+struct gzl_intfa_transition {
+    int ch_low;
+    int ch_high;
+    struct gzl_intfa_state *dest_state;
+};
+
+struct gzl_intfa_state {
+    char *final;  /* NULL if not a final state */
+    int num_transitions;
+    struct gzl_intfa_transition *transitions;
+};
+
+/*
+ * gzl_grammar_code: for grammars that were compiled to C ahead of time (see
+ * codegen.c), the generated functions that stand in for the interpreter's
+ * table lookups.
+ */
+
+struct gzl_grammar_code {
+    /* Lexes with the given IntFA from *state, stopping at the end of the
+     * buffer, at a byte with no transition, or just after entering a final
+     * state with no transitions.  Updates *state and returns how far it
+     * got. */
+    unsigned char *(*lex)(uint32_t intfa, uint32_t *state,
+                          unsigned char *p, unsigned char *end);
+
+    struct gzl_rtn_transition *(*rtn_terminal_transition)(
+        uint32_t rtn, uint32_t state, char *term);
+
+    struct gzl_gla_transition *(*gla_transition)(
+        uint32_t gla, uint32_t state, char *term);
+};
+
+/*
+ * gzl_profile: how many times each transition has been taken, for
+ * profile-guided layout (see profile.c).  Indexed [machine][transition], with
+ * transitions in the order the grammar was loaded in.
+ */
+
+struct gzl_profile {
+    uint64_t **intfa_hits;
+    uint64_t **gla_hits;
+    uint64_t **rtn_hits;
+};
+
+/*
+ * gzl_prefilter: cheap checks that let a recognizer turn away input that
+ * cannot parse without running the parser (see prefilter.c).  Byte sets are
+ * bitmaps, bit (b & 7) of [b >> 3].
+ */
+
+struct gzl_prefilter {
+    uint8_t first_bytes[32];  /* bytes a valid input can begin with */
+    uint8_t alphabet[32];     /* bytes some IntFA has a transition on */
+
+    /* No input shorter than this completes the start rule, so a byte outside
+     * the alphabet before this point means the parse will fail.  (After it,
+     * the parse may already have ended.) */
+    size_t min_input_len;
+
+    /* The alphabet split by high nibble, for scanning with byte shuffles:
+     * byte b is in the alphabet iff for some k,
+     * alphabet_lo[k][b & 15] & alphabet_hi[k][b >> 4] is non-zero. */
+    uint8_t alphabet_lo[2][16];
+    uint8_t alphabet_hi[2][16];
+};
+
+/*
+ * gzl_grammar
+ */
+
+struct gzl_grammar {
+    char **strings;
+
+    struct gzl_rtn *rtns;
+    int num_rtns;
+
+    struct gzl_gla *glas;
+    int num_glas;
+
+    struct gzl_intfa *intfas;
+    int num_intfas;
+
+    /* Sizing hints for parse states bound to this grammar.
+     *
+     * max_gla_lookahead is the longest path through any GLA, which bounds
+     * how many terminals can be buffered at once; it is computed at load
+     * time and is -1 if some GLA is cyclic.  stack_depth_hint is the deepest
+     * parse stack any parse has needed so far, so that later parses can
+     * start out with a stack that never has to grow. */
+    int max_gla_lookahead;
+    size_t stack_depth_hint;
+
+    /* The parse stack as it stands before any input has been seen: the start
+     * rule descended as far as its first IntFA.  parse.c builds it the first
+     * time the grammar is used and copies it into every new parse.  NULL
+     * until it has been built; initial_stack_len is 0 if the grammar cannot
+     * start that way (its start rule can end without consuming input). */
+    struct gzl_parse_stack_frame *initial_stack;
+    size_t initial_stack_len;
+
+    /* The IntFAs compiled for gzl_parse_threaded(), built the first time it
+     * is used with this grammar.  A single allocation. */
+    struct gzl_bytecode *bytecode;
+
+    /* Built by gzl_prefilter_rejects() the first time it is used. */
+    struct gzl_prefilter *prefilter;
+
+    /* NULL unless the grammar was compiled to C. */
+    const struct gzl_grammar_code *code;
+
+    /* While non-NULL, the interpreter counts every transition it takes here.
+     * Owned by the grammar. */
+    struct gzl_profile *profile;
+};
+
+struct gzl_grammar *gzl_load_grammar(struct bc_read_stream *s);
+void gzl_free_grammar(struct gzl_grammar *g);
+
+/* Profile-guided layout; see profile.c.  gzl_apply_profile() returns false,
+ * leaving g untouched, if the profile was not taken with this grammar. */
+struct gzl_profile *gzl_alloc_profile(struct gzl_grammar *g);
+void gzl_free_profile(struct gzl_grammar *g, struct gzl_profile *p);
+void gzl_write_profile(struct gzl_grammar *g, struct gzl_profile *p, FILE *out);
+bool gzl_apply_profile(struct gzl_grammar *g, FILE *in);
+
+/* An optional pass after loading that minimizes the grammar's IntFAs and
+ * shares identical ones; see optimize.c.  If report is non-NULL it is filled
+ * in with the sizes of the IntFA tables before and after.  The grammar must
+ * not be in use or being profiled. */
+struct gzl_intfa_sizes {
+    int intfas;
+    int states;
+    int transitions;
+    size_t bytes;
+};
+
+struct gzl_optimize_report {
+    struct gzl_intfa_sizes before;
+    struct gzl_intfa_sizes after;
+};
+
+void gzl_optimize_grammar(struct gzl_grammar *g, struct gzl_optimize_report *report);
+
+/* Writes g out as C source, with every symbol prefixed by "gzl_<prefix>_";
+ * see codegen.c. */
+void gzl_generate_c(struct gzl_grammar *g, const char *prefix, FILE *out);
+
+#endif  /* GAZELLE_GRAMMAR */
+
+/*
+ * Local Variables:
+ * c-file-style: "bsd"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ * vim:et:sts=4:sw=4
+ */
@@ -0,0 +1,500 @@
+/*********************************************************************
+
+  Gazelle: a system for building fast, reusable parsers
+
+  parse.h
+
+  This file presents the public API for parsing text using compiled
+  Gazelle grammars.  It is vendored alongside includes/parse.c so that
+  the layout of the runtime stack can be tuned for these bindings.
+
+  Copyright (c) 2007-2009 Joshua Haberman.  See LICENSE for details.
+
+*********************************************************************/
+
+#ifndef GAZELLE_PARSE
+#define GAZELLE_PARSE
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "gazelle/grammar.h"
+#include "gazelle/dynarray.h"
+
+struct gzl_parse_state;
+struct gzl_terminal;
+
+typedef void (*gzl_rule_callback_t)(struct gzl_parse_state *state);
+typedef void (*gzl_terminal_callback_t)(struct gzl_parse_state *state,
+                                        struct gzl_terminal *terminal);
+typedef void (*gzl_error_char_callback_t)(struct gzl_parse_state *state,
+                                          int ch);
+typedef void (*gzl_error_terminal_callback_t)(struct gzl_parse_state *state,
+                                              struct gzl_terminal *terminal);
+
+/*
+ * gzl_bound_grammar: a grammar together with the callbacks that should be
+ * invoked as it is used to parse.  Any callback may be NULL.
+ */
+struct gzl_bound_grammar {
+    struct gzl_grammar *grammar;
+    gzl_terminal_callback_t terminal_cb;
+    gzl_rule_callback_t start_rule_cb;
+    gzl_rule_callback_t end_rule_cb;
+    gzl_error_char_callback_t error_char_cb;
+    gzl_error_terminal_callback_t error_terminal_cb;
+};
+
+/*
+ * gzl_offset: a position in the input.  Only the parse state's current
+ * position carries line and column; everything stored per-frame or
+ * per-token is a plain byte offset.
+ */
+struct gzl_offset {
+    size_t byte;    /* 0-based. */
+    size_t line;    /* 1-based. */
+    size_t column;  /* 1-based. */
+};
+
+struct gzl_terminal {
+    char *name;
+    size_t start_byte;
+    size_t len;
+};
+
+/*
+ * Stack frames refer to the grammar by 32-bit index rather than by pointer:
+ * an RTN frame stores an index into grammar->rtns and indexes into that
+ * RTN's states and transitions, and likewise for GLA and IntFA frames.  This
+ * keeps a frame at 24 bytes on a 64-bit machine (it was 56 when it carried
+ * three pointers and a full gzl_offset), so more of the stack fits in cache.
+ */
+#define GZL_NO_TRANSITION UINT32_MAX
+
+struct gzl_rtn_frame {
+    uint32_t rtn;
+    uint32_t rtn_state;
+
+    /* The transition we are currently in the middle of, or
+     * GZL_NO_TRANSITION if there is none. */
+    uint32_t rtn_transition;
+};
+
+struct gzl_gla_frame {
+    uint32_t gla;
+    uint32_t gla_state;
+};
+
+struct gzl_intfa_frame {
+    uint32_t intfa;
+    uint32_t intfa_state;
+};
+
+enum gzl_frame_type {
+    GZL_FRAME_TYPE_RTN,
+    GZL_FRAME_TYPE_GLA,
+    GZL_FRAME_TYPE_INTFA
+};
+
+struct gzl_parse_stack_frame {
+    size_t start_byte;
+
+    union {
+        struct gzl_rtn_frame   rtn_frame;
+        struct gzl_gla_frame   gla_frame;
+        struct gzl_intfa_frame intfa_frame;
+    } f;
+
+    uint8_t frame_type;  /* enum gzl_frame_type */
+};
+
+/*
+ * gzl_budget: how much work a single call to gzl_parse() (or any of the other
+ * main loops) may do before it stops and returns GZL_STATUS_YIELD.  Zero
+ * means no limit.  The count of transitions and the deadline are looked at
+ * between tokens, so a single very long token is only cut short by a limit on
+ * bytes.
+ */
+struct gzl_budget {
+    size_t bytes;
+    size_t transitions;    /* RTN and GLA transitions */
+    uint64_t deadline_ns;  /* compared with gzl_monotonic_ns() */
+};
+
+/*
+ * gzl_parse_state: the complete state of a parse, which can be suspended
+ * and resumed at any byte boundary.
+ */
+struct gzl_parse_state {
+    /* The current offset of the parse. */
+    struct gzl_offset offset;
+
+    /* The byte offset of the first byte that belongs to a terminal we have
+     * not yet returned.  Any buffered input before this point can be
+     * discarded. */
+    size_t open_terminal_offset;
+
+    bool last_char_was_newline;
+
+    struct gzl_bound_grammar *bound_grammar;
+    void *user_data;
+
+    /* parse_stack is sized from the grammar's stack_depth_hint when the
+     * state is initialized, so it only grows on the deepest input seen so
+     * far. */
+    DEFINE_DYNARRAY(parse_stack, struct gzl_parse_stack_frame);
+
+    /* Terminals that have been lexed but not yet consumed by an RTN
+     * transition.  This is a ring buffer: the oldest terminal is at
+     * token_buffer_head and there are token_buffer_len of them, so consuming
+     * terminals never moves the rest.  token_buffer_size is a power of two. */
+    struct gzl_terminal *token_buffer;
+    size_t token_buffer_head;
+    size_t token_buffer_len;
+    size_t token_buffer_size;
+
+    size_t max_stack_depth;
+    size_t max_lookahead;
+
+    /* The budget for each call to gzl_parse(); none, after
+     * gzl_init_parse_state(). */
+    struct gzl_budget budget;
+
+    /* RTN and GLA transitions taken so far, the count at which this call runs
+     * out of budget, and the count at which the main loop next checks. */
+    size_t transitions;
+    size_t transition_limit;
+    size_t budget_check_at;
+
+    /* Set by gzl_cancel_parse(). */
+    bool cancelled;
+};
+
+/* Returns the i'th buffered terminal, counting from the oldest. */
+static inline
+struct gzl_terminal *gzl_token(struct gzl_parse_state *s, size_t i)
+{
+    return &s->token_buffer[(s->token_buffer_head + i) &
+                            (s->token_buffer_size - 1)];
+}
+
+/*
+ * Accessors that turn the indices stored in a frame back into pointers into
+ * the grammar the parse state is bound to.
+ */
+static inline
+struct gzl_grammar *gzl_state_grammar(struct gzl_parse_state *s)
+{
+    return s->bound_grammar->grammar;
+}
+
+static inline
+struct gzl_rtn *gzl_frame_rtn(struct gzl_parse_state *s,
+                              struct gzl_rtn_frame *frame)
+{
+    return &gzl_state_grammar(s)->rtns[frame->rtn];
+}
+
+static inline
+struct gzl_rtn_state *gzl_frame_rtn_state(struct gzl_parse_state *s,
+                                          struct gzl_rtn_frame *frame)
+{
+    return &gzl_frame_rtn(s, frame)->states[frame->rtn_state];
+}
+
+static inline
+struct gzl_rtn_transition *gzl_frame_rtn_transition(struct gzl_parse_state *s,
+                                                    struct gzl_rtn_frame *frame)
+{
+    if(frame->rtn_transition == GZL_NO_TRANSITION) return NULL;
+    return &gzl_frame_rtn(s, frame)->transitions[frame->rtn_transition];
+}
+
+static inline
+struct gzl_gla *gzl_frame_gla(struct gzl_parse_state *s,
+                              struct gzl_gla_frame *frame)
+{
+    return &gzl_state_grammar(s)->glas[frame->gla];
+}
+
+static inline
+struct gzl_gla_state *gzl_frame_gla_state(struct gzl_parse_state *s,
+                                          struct gzl_gla_frame *frame)
+{
+    return &gzl_frame_gla(s, frame)->states[frame->gla_state];
+}
+
+static inline
+struct gzl_intfa *gzl_frame_intfa(struct gzl_parse_state *s,
+                                  struct gzl_intfa_frame *frame)
+{
+    return &gzl_state_grammar(s)->intfas[frame->intfa];
+}
+
+static inline
+struct gzl_intfa_state *gzl_frame_intfa_state(struct gzl_parse_state *s,
+                                              struct gzl_intfa_frame *frame)
+{
+    return &gzl_frame_intfa(s, frame)->states[frame->intfa_state];
+}
+
+enum gzl_status {
+    /* Parsing was successful (so far) and the input was consumed. */
+    GZL_STATUS_OK,
+
+    /* There was a parse error; the appropriate error callback was called. */
+    GZL_STATUS_ERROR,
+
+    /* The grammar's top-level rule has ended; no more input can be
+     * accepted. */
+    GZL_STATUS_HARD_EOF,
+
+    /* The parse exceeded max_stack_depth or max_lookahead. */
+    GZL_STATUS_RESOURCE_LIMIT_EXCEEDED,
+
+    /* There was an error reading the input (gzl_parse_file() only). */
+    GZL_STATUS_IO_ERROR,
+
+    /* The input ended somewhere that is not a valid EOF. */
+    GZL_STATUS_PREMATURE_EOF_ERROR,
+
+    /* The call ran out of budget (see gzl_budget) before it got to the end of
+     * the buffer.  state->offset.byte has advanced by the number of bytes it
+     * did consume; to carry on, call again with the rest of the buffer. */
+    GZL_STATUS_YIELD,
+
+    /* A callback called gzl_cancel_parse().  The parse stopped right after
+     * the callback returned, and can't be carried on. */
+    GZL_STATUS_CANCELLED
+};
+
+/* Parses the given buffer, which continues where the previous call left
+ * off. */
+enum gzl_status gzl_parse(struct gzl_parse_state *state, char *buf,
+                          size_t buf_len);
+
+/* The same as gzl_parse(), but runs the input through a compiled form of the
+ * grammar's IntFAs with threaded dispatch.  Callbacks and results are
+ * identical; only the speed differs. */
+enum gzl_status gzl_parse_threaded(struct gzl_parse_state *state, char *buf,
+                                   size_t buf_len);
+
+/* The same again, for grammars compiled to C by gzl_generate_c(): the
+ * grammar's generated lexers do the work inside each token.  Falls back to
+ * gzl_parse_threaded() for grammars loaded from bitcode. */
+enum gzl_status gzl_parse_generated(struct gzl_parse_state *state, char *buf,
+                                    size_t buf_len);
+
+/* Recognizers: the same as gzl_parse(), gzl_parse_threaded() and
+ * gzl_parse_generated(), except that no callbacks are ever called and the
+ * line and column of state->offset are not kept up to date.  Use these when
+ * all you want is the status -- whether the input parses. */
+enum gzl_status gzl_recognize(struct gzl_parse_state *state, char *buf,
+                              size_t buf_len);
+enum gzl_status gzl_recognize_threaded(struct gzl_parse_state *state,
+                                       char *buf, size_t buf_len);
+enum gzl_status gzl_recognize_generated(struct gzl_parse_state *state,
+                                        char *buf, size_t buf_len);
+
+/* Returns true if parsing buf with g from the start is certain to end in
+ * GZL_STATUS_ERROR, judging only by which bytes can begin an input and which
+ * bytes the grammar's lexers know at all; see prefilter.c.  Meant for
+ * recognizers, to turn away garbage before acquiring a parse state.  A false
+ * result proves nothing. */
+bool gzl_prefilter_rejects(struct gzl_grammar *g, const char *buf,
+                           size_t buf_len);
+
+/*
+ * gzl_incremental_parse: parses a buffer that is then edited in place, and
+ * reparses only as much of it after each edit as the edit affects; see
+ * incremental.c.  Copies of the parse state are kept every interval bytes.
+ */
+typedef enum gzl_status (*gzl_parse_function_t)(struct gzl_parse_state *state,
+                                                char *buf, size_t buf_len);
+
+struct gzl_checkpoint {
+    size_t offset;
+    struct gzl_parse_state *state;
+};
+
+struct gzl_incremental_parse {
+    struct gzl_bound_grammar *bound_grammar;
+    gzl_parse_function_t parse;  /* gzl_recognize(), say */
+    size_t interval;
+    DEFINE_DYNARRAY(checkpoints, struct gzl_checkpoint);
+
+    /* The result of the parse, and how far into the buffer the parser may
+     * have looked. */
+    enum gzl_status status;
+    size_t end_offset;
+
+    /* How many bytes the last gzl_incremental_parse() or
+     * gzl_incremental_reparse() actually ran the parser over. */
+    size_t bytes_parsed;
+};
+
+void gzl_init_incremental_parse(struct gzl_incremental_parse *p,
+                                struct gzl_bound_grammar *bound_grammar,
+                                gzl_parse_function_t parse, size_t interval);
+void gzl_free_incremental_parse(struct gzl_incremental_parse *p);
+
+/* Parses buf from the start. */
+enum gzl_status gzl_incremental_parse(struct gzl_incremental_parse *p,
+                                      char *buf, size_t len);
+
+/* Reparses buf after removed bytes at edit_offset of the buffer last parsed
+ * were replaced with inserted bytes, giving what gzl_incremental_parse() of
+ * the whole of buf would. */
+enum gzl_status gzl_incremental_reparse(struct gzl_incremental_parse *p,
+                                        char *buf, size_t len,
+                                        size_t edit_offset, size_t removed,
+                                        size_t inserted);
+
+/* One of several parses run over the same input by gzl_parse_lockstep(). */
+struct gzl_lockstep_parse
+{
+    struct gzl_parse_state *state;
+    gzl_parse_function_t parse;
+
+    /* Start it at GZL_STATUS_OK; anything else means the parse is not run
+     * (any further), and it holds what the parse returned. */
+    enum gzl_status status;
+};
+
+/* Runs each of parses whose status is GZL_STATUS_OK over buf, all of them
+ * over each part of buf before any moves on to the next, so that buf is read
+ * from memory only once however many parses there are.  Returns how many
+ * parses are still at GZL_STATUS_OK, stopping early if none are.  As with
+ * gzl_parse(), buf can be given a piece at a time. */
+size_t gzl_parse_lockstep(struct gzl_lockstep_parse *parses, size_t num_parses,
+                          char *buf, size_t len);
+
+/* How many times a rule ended or a terminal was matched in a parse, and the
+ * bytes of input those covered (a rule's up to the end of its last
+ * terminal). */
+struct gzl_stat
+{
+    uint64_t count;
+    uint64_t bytes;
+};
+
+struct gzl_terminal_stat
+{
+    char *name;  /* NULL until the terminal is first matched */
+    struct gzl_stat stat;
+};
+
+/* The counts kept by gzl_stats_end_rule_cb() and gzl_stats_terminal_cb(),
+ * which a caller sets as a bound grammar's end_rule_cb and terminal_cb, with
+ * the gzl_parse_stats as the parse state's user_data. */
+struct gzl_parse_stats
+{
+    struct gzl_grammar *grammar;
+
+    /* By RTN index. */
+    struct gzl_stat *rtns;
+
+    /* By the address of the terminal's name; see gzl_terminal_stat(). */
+    struct gzl_terminal_stat *terminals;
+    size_t terminals_mask;
+
+    /* Where the last terminal ended. */
+    size_t terminal_end;
+};
+
+void gzl_init_parse_stats(struct gzl_parse_stats *stats, struct gzl_grammar *g);
+void gzl_free_parse_stats(struct gzl_parse_stats *stats);
+
+/* The counts for the terminal whose name (which must point into the grammar's
+ * string table) is name, or NULL if it has not been matched. */
+struct gzl_stat *gzl_terminal_stat(struct gzl_parse_stats *stats, char *name);
+
+void gzl_stats_end_rule_cb(struct gzl_parse_state *s);
+void gzl_stats_terminal_cb(struct gzl_parse_state *s,
+                           struct gzl_terminal *terminal);
+
+/* A clock for gzl_budget's deadline, in nanoseconds.  It only ever goes
+ * forward, but has no fixed starting point. */
+uint64_t gzl_monotonic_ns(void);
+
+/* Called from a callback, stops the parse as soon as the callback returns:
+ * no more callbacks are called, and gzl_parse() (and any later call with this
+ * state) returns GZL_STATUS_CANCELLED. */
+void gzl_cancel_parse(struct gzl_parse_state *state);
+
+/* Tells the parse state that the input is complete.  Returns true if this
+ * is a valid place for the input to end. */
+bool gzl_finish_parse(struct gzl_parse_state *state);
+
+struct gzl_parse_state *gzl_alloc_parse_state();
+struct gzl_parse_state *gzl_dup_parse_state(struct gzl_parse_state *state);
+void gzl_free_parse_state(struct gzl_parse_state *state);
+void gzl_init_parse_state(struct gzl_parse_state *state,
+                          struct gzl_bound_grammar *bound_grammar);
+
+/* Returns a state to where gzl_init_parse_state() left it, keeping its bound
+ * grammar and its allocations. */
+void gzl_reset_parse_state(struct gzl_parse_state *state);
+
+/* Writes state out in a form that gzl_deserialize_parse_state() can read
+ * back in another process, to carry on the parse without reparsing what came
+ * before; see serialize.c.  Returns false on a write error. */
+bool gzl_serialize_parse_state(struct gzl_parse_state *state, FILE *out);
+
+/* Reads a state written by gzl_serialize_parse_state() into state, which must
+ * be initialized and bound to the same grammar (laid out the same way) that
+ * the state was saved from.  Its bound grammar, user data and limits are
+ * kept.  Returns false, leaving state untouched, if the input is not a saved
+ * state of that grammar. */
+bool gzl_deserialize_parse_state(struct gzl_parse_state *state, FILE *in);
+
+/*
+ * gzl_parse_state_pool: a free list of parse states for one grammar, for
+ * callers that run many short parses.  Acquiring a state from the pool
+ * initializes it with the given bound grammar; releasing it keeps its stack
+ * and token buffer around for the next parse.
+ */
+struct gzl_parse_state_pool {
+    DEFINE_DYNARRAY(states, struct gzl_parse_state *);
+};
+
+void gzl_init_parse_state_pool(struct gzl_parse_state_pool *pool);
+void gzl_free_parse_state_pool(struct gzl_parse_state_pool *pool);
+struct gzl_parse_state *gzl_acquire_parse_state(
+    struct gzl_parse_state_pool *pool, struct gzl_bound_grammar *bound_grammar);
+void gzl_release_parse_state(struct gzl_parse_state_pool *pool,
+                             struct gzl_parse_state *state);
+
+/*
+ * gzl_parse_file(): a convenience routine that reads and parses a whole
+ * FILE*, buffering only as much of it as open terminals require, so memory
+ * use doesn't grow with the size of the file.  It always runs to the end,
+ * whatever state->budget says.  Returns GZL_STATUS_OK if the file ended where
+ * the grammar can end, GZL_STATUS_HARD_EOF if the grammar ended first, and
+ * GZL_STATUS_RESOURCE_LIMIT_EXCEEDED if an open terminal outgrew
+ * max_buffer_size.  Callbacks find user_data in the gzl_buffer that is the
+ * state's user_data while the file is parsed.
+ */
+struct gzl_buffer {
+    DEFINE_DYNARRAY(buf, char);
+
+    /* The byte offset of buf[0] in the input. */
+    size_t buf_offset;
+    size_t bytes_parsed;
+    void *user_data;
+};
+
+enum gzl_status gzl_parse_file(struct gzl_parse_state *state,
+                               FILE *file, void *user_data,
+                               size_t max_buffer_size);
+
+#endif  /* GAZELLE_PARSE */
+
+/*
+ * Local Variables:
+ * c-file-style: "bsd"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ * vim:et:sts=4:sw=4
+ */
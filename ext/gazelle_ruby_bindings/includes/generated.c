@@ -0,0 +1,35 @@
+/*********************************************************************
+
+  Gazelle: a system for building fast, reusable parsers
+
+  generated.c
+
+  The main loop for grammars that were compiled to C by codegen.c.
+  Whole runs of bytes inside a token are handed to the grammar's
+  generated lexer; token boundaries and completed tokens go back
+  through parse.c (do_intfa_transition() and process_terminal()), so
+  the results are identical to gzl_parse().
+
+  This file is #included after parse.c and threaded.c and uses their
+  internals.
+
+*********************************************************************/
+
+#include "gazelle/parse.h"
+
+/*
+ * The main loop, once with callbacks (gzl_parse_generated()) and once as a
+ * recognizer (gzl_recognize_generated()).
+ */
+#include "generated_kernel.c"
+#define GZL_RECOGNIZER 1
+#include "generated_kernel.c"
+
+/*
+ * Local Variables:
+ * c-file-style: "bsd"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ * vim:et:sts=4:sw=4
+ */
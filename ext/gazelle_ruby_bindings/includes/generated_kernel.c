@@ -0,0 +1,103 @@
+/*********************************************************************
+
+  Gazelle: a system for building fast, reusable parsers
+
+  generated_kernel.c
+
+  The main loop for grammars compiled to C.  generated.c #includes
+  this file twice: as-is for gzl_parse_generated(), and with
+  GZL_RECOGNIZER set for gzl_recognize_generated(); see kernel.h.
+
+*********************************************************************/
+
+#include "kernel.h"
+
+/*
+ * advance_offset(): accounts for the bytes a generated lexer consumed, with
+ * the same newline handling as do_intfa_transition().  Recognizers only
+ * count bytes.
+ */
+static
+void advance_offset(struct gzl_parse_state *s, unsigned char *p,
+                    unsigned char *end)
+{
+    s->offset.byte += end - p;
+#ifndef GZL_RECOGNIZER
+    for(; p < end; p++) {
+        if(*p == 0x0A || *p == 0x0D) {
+            if(!s->last_char_was_newline) {
+                s->offset.line++;
+                s->offset.column = 1;
+            }
+            s->last_char_was_newline = true;
+        } else {
+            s->offset.column++;
+            s->last_char_was_newline = false;
+        }
+    }
+#endif
+}
+
+enum gzl_status gzl_parse_generated(struct gzl_parse_state *s, char *buf,
+                                    size_t buf_len)
+{
+    struct gzl_grammar *g = gzl_state_grammar(s);
+    const struct gzl_grammar_code *code = g->code;
+    if(!code)
+        return gzl_parse_threaded(s, buf, buf_len);
+
+    enum gzl_status status = start_parse(s);
+    if(status != GZL_STATUS_OK)
+        return status;
+
+    size_t len = begin_budget(s, buf_len);
+    unsigned char *p = (unsigned char*)buf;
+    unsigned char *end = p + len;
+
+    while(p < end) {
+        struct gzl_parse_stack_frame *frame = DYNARRAY_GET_TOP(s->parse_stack);
+        struct gzl_intfa_frame *intfa_frame = &frame->f.intfa_frame;
+        uint32_t state = intfa_frame->intfa_state;
+        unsigned char *start = p;
+
+        p = code->lex(intfa_frame->intfa, &state, p, end);
+        intfa_frame->intfa_state = state;
+        advance_offset(s, start, p);
+
+        struct gzl_intfa_state *intfa_state =
+            gzl_frame_intfa_state(s, intfa_frame);
+        if(p > start && intfa_state->final &&
+           intfa_state->num_transitions == 0) {
+            /* The lexer stopped just after completing a token. */
+            status = process_terminal(s, intfa_state->final, frame->start_byte,
+                                      s->offset.byte - frame->start_byte);
+            if(status != GZL_STATUS_OK)
+                return status;
+            push_intfa_frame_for_gla_or_rtn(s);
+        } else if(p < end) {
+            /* The lexer stopped at a byte with no transition: let the
+             * interpreter end the token or report the error. */
+            status = do_intfa_transition(s, (char)*p);
+            if(status != GZL_STATUS_OK)
+                return status;
+            p++;
+        }
+
+        if(p < end && out_of_budget(s))
+            return GZL_STATUS_YIELD;
+    }
+
+    return end_budget(GZL_STATUS_OK, len, buf_len);
+}
+
+#undef GZL_RECOGNIZER
+#include "kernel.h"
+
+/*
+ * Local Variables:
+ * c-file-style: "bsd"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ * vim:et:sts=4:sw=4
+ */
@@ -0,0 +1,338 @@
+/*********************************************************************
+
+  Gazelle: a system for building fast, reusable parsers
+
+  incremental.c
+
+  Incremental reparsing of a buffer that is edited in place.  While
+  the buffer is parsed we keep a copy of the parse state (a
+  checkpoint) every so many bytes.  After an edit, parsing resumes
+  from the last checkpoint before the edit, and stops as soon as it
+  reaches the position of an old checkpoint after the edit with the
+  same state as before, shifted by the edit: from there on the parse
+  would go exactly as it did last time.  So the work done for an edit
+  depends on the size of the edit and on how far its effects reach,
+  not on the size of the buffer.
+
+  Callbacks only run for the part of the buffer that is actually
+  reparsed, so this is best used with a recognizer.
+
+  This file is #included after parse.c and uses its internals.
+
+*********************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "gazelle/parse.h"
+
+/*
+ * An edit, in the old buffer's offsets: [start, old_end) was replaced with
+ * something delta bytes longer (or shorter).
+ */
+struct gzl_edit {
+    size_t start;
+    size_t old_end;
+    ptrdiff_t delta;
+};
+
+/*
+ * same_offset(): is new_offset where old_offset has moved to after the edit?
+ * Offsets inside the replaced text have nowhere to go.
+ */
+static
+bool same_offset(struct gzl_edit *edit, size_t new_offset, size_t old_offset)
+{
+    if(old_offset < edit->start)
+        return new_offset == old_offset;
+    else if(old_offset >= edit->old_end)
+        return new_offset == old_offset + edit->delta;
+    else
+        return false;
+}
+
+static
+size_t moved_offset(struct gzl_edit *edit, size_t old_offset)
+{
+    return old_offset < edit->start ? old_offset : old_offset + edit->delta;
+}
+
+/*
+ * The same for the end of a token, which can start before the edit and end
+ * after it.
+ */
+static
+bool same_end(struct gzl_edit *edit, size_t new_end, size_t old_end)
+{
+    if(old_end <= edit->start)
+        return new_end == old_end;
+    else if(old_end >= edit->old_end)
+        return new_end == old_end + edit->delta;
+    else
+        return false;
+}
+
+static
+size_t moved_end(struct gzl_edit *edit, size_t old_end)
+{
+    return old_end <= edit->start ? old_end : old_end + edit->delta;
+}
+
+/*
+ * same_parse_state(): would the parse go on the same way from new as it did
+ * from old?  That is so if they have the same stack and lookahead, up to the
+ * edit.  Lines and columns don't affect the parse and aren't compared.  (An
+ * open terminal may have started before the edit; its length is implied by
+ * the offset, so that needs no special care.)
+ */
+static
+bool same_parse_state(struct gzl_parse_state *new, struct gzl_parse_state *old,
+                      struct gzl_edit *edit)
+{
+    size_t i;
+    if(new->parse_stack_len != old->parse_stack_len ||
+       new->token_buffer_len != old->token_buffer_len ||
+       new->last_char_was_newline != old->last_char_was_newline ||
+       !same_offset(edit, new->open_terminal_offset, old->open_terminal_offset))
+        return false;
+
+    for(i = 0; i < new->parse_stack_len; i++) {
+        struct gzl_parse_stack_frame *a = &new->parse_stack[i];
+        struct gzl_parse_stack_frame *b = &old->parse_stack[i];
+        if(a->frame_type != b->frame_type ||
+           !same_offset(edit, a->start_byte, b->start_byte))
+            return false;
+
+        switch(a->frame_type) {
+          case GZL_FRAME_TYPE_RTN:
+            if(a->f.rtn_frame.rtn != b->f.rtn_frame.rtn ||
+               a->f.rtn_frame.rtn_state != b->f.rtn_frame.rtn_state ||
+               a->f.rtn_frame.rtn_transition != b->f.rtn_frame.rtn_transition)
+                return false;
+            break;
+          case GZL_FRAME_TYPE_GLA:
+            if(a->f.gla_frame.gla != b->f.gla_frame.gla ||
+               a->f.gla_frame.gla_state != b->f.gla_frame.gla_state)
+                return false;
+            break;
+          case GZL_FRAME_TYPE_INTFA:
+            if(a->f.intfa_frame.intfa != b->f.intfa_frame.intfa ||
+               a->f.intfa_frame.intfa_state != b->f.intfa_frame.intfa_state)
+                return false;
+            break;
+        }
+    }
+
+    for(i = 0; i < new->token_buffer_len; i++) {
+        struct gzl_terminal *a = gzl_token(new, i);
+        struct gzl_terminal *b = gzl_token(old, i);
+        if(a->name != b->name ||
+           !same_offset(edit, a->start_byte, b->start_byte) ||
+           !same_end(edit, a->start_byte + a->len, b->start_byte + b->len))
+            return false;
+    }
+
+    return true;
+}
+
+/*
+ * move_parse_state(): updates an old checkpoint that lies after the edit to
+ * the offsets it has in the new buffer.  lines is how many lines the edit
+ * added; if the checkpoint is still on the line where the edit ended
+ * (edit_line, in the old buffer), its column moves by columns too.
+ */
+static
+void move_parse_state(struct gzl_parse_state *s, struct gzl_edit *edit,
+                      ptrdiff_t lines, size_t edit_line, ptrdiff_t columns)
+{
+    size_t i;
+    if(s->offset.line == edit_line)
+        s->offset.column += columns;
+    s->offset.line += lines;
+    s->offset.byte = moved_offset(edit, s->offset.byte);
+    s->open_terminal_offset = moved_offset(edit, s->open_terminal_offset);
+    for(i = 0; i < s->parse_stack_len; i++)
+        s->parse_stack[i].start_byte =
+            moved_offset(edit, s->parse_stack[i].start_byte);
+    for(i = 0; i < s->token_buffer_len; i++) {
+        struct gzl_terminal *term = gzl_token(s, i);
+        size_t end = moved_end(edit, term->start_byte + term->len);
+        term->start_byte = moved_offset(edit, term->start_byte);
+        term->len = end - term->start_byte;
+    }
+}
+
+static
+void add_checkpoint(struct gzl_incremental_parse *p, size_t offset,
+                    struct gzl_parse_state *state)
+{
+    RESIZE_DYNARRAY(p->checkpoints, p->checkpoints_len + 1);
+    DYNARRAY_GET_TOP(p->checkpoints)->offset = offset;
+    DYNARRAY_GET_TOP(p->checkpoints)->state = state;
+}
+
+/*
+ * parse_from(): runs s over buf from pos, taking checkpoints as it goes.
+ * tail holds the old checkpoints after the edit, if this is a reparse; each
+ * one we reach is either found to match (and we stop, keeping it and the
+ * rest) or replaced.
+ */
+static
+enum gzl_status parse_from(struct gzl_incremental_parse *p,
+                           struct gzl_parse_state *s, char *buf, size_t len,
+                           size_t pos, struct gzl_checkpoint *tail,
+                           size_t tail_len, struct gzl_edit *edit)
+{
+    enum gzl_status status = GZL_STATUS_OK;
+    size_t t = 0;
+
+    while(pos < len) {
+        size_t stop = (pos / p->interval + 1) * p->interval;
+        bool at_tail = false;
+        if(t < tail_len && tail[t].offset + edit->delta <= stop) {
+            stop = tail[t].offset + edit->delta;
+            at_tail = true;
+        }
+        if(stop > len)
+            stop = len;
+
+        status = p->parse(s, buf + pos, stop - pos);
+        p->bytes_parsed += stop - pos;
+        pos = stop;
+        if(status != GZL_STATUS_OK)
+            break;
+
+        if(at_tail && pos == tail[t].offset + edit->delta) {
+            struct gzl_parse_state *old = tail[t].state;
+            if(same_parse_state(s, old, edit)) {
+                /* From here on the parse goes as it did before; keep the rest
+                 * of the old checkpoints and the old result. */
+                ptrdiff_t lines = s->offset.line - old->offset.line;
+                ptrdiff_t columns = s->offset.column - old->offset.column;
+                size_t edit_line = old->offset.line;
+                for(; t < tail_len; t++) {
+                    move_parse_state(tail[t].state, edit, lines, edit_line,
+                                     columns);
+                    add_checkpoint(p, tail[t].offset + edit->delta,
+                                   tail[t].state);
+                }
+                p->end_offset = moved_offset(edit, p->end_offset);
+                gzl_free_parse_state(s);
+                return p->status;
+            }
+            gzl_free_parse_state(old);
+            t++;
+        }
+
+        /* Stops made only to look for a match don't get checkpoints, so that
+         * edits don't leave the checkpoints any closer together. */
+        if(pos % p->interval == 0)
+            add_checkpoint(p, pos, gzl_dup_parse_state(s));
+    }
+
+    for(; t < tail_len; t++)
+        gzl_free_parse_state(tail[t].state);
+
+    /* The parser may have stopped anywhere in the last stretch we gave it,
+     * and may have looked at all of it. */
+    p->status = status;
+    p->end_offset = pos;
+    gzl_free_parse_state(s);
+    return status;
+}
+
+/*
+ * The rest of this file is the publicly-exposed API, documented in the
+ * header file.
+ */
+
+void gzl_init_incremental_parse(struct gzl_incremental_parse *p,
+                                struct gzl_bound_grammar *bound_grammar,
+                                gzl_parse_function_t parse, size_t interval)
+{
+    p->bound_grammar = bound_grammar;
+    p->parse = parse;
+    p->interval = interval > 0 ? interval : 1;
+    INIT_DYNARRAY(p->checkpoints, 0, 16);
+    p->status = GZL_STATUS_OK;
+    p->end_offset = 0;
+    p->bytes_parsed = 0;
+}
+
+static
+void free_checkpoints(struct gzl_incremental_parse *p)
+{
+    size_t i;
+    for(i = 0; i < p->checkpoints_len; i++)
+        gzl_free_parse_state(p->checkpoints[i].state);
+    p->checkpoints_len = 0;
+}
+
+void gzl_free_incremental_parse(struct gzl_incremental_parse *p)
+{
+    free_checkpoints(p);
+    FREE_DYNARRAY(p->checkpoints);
+}
+
+enum gzl_status gzl_incremental_parse(struct gzl_incremental_parse *p,
+                                      char *buf, size_t len)
+{
+    struct gzl_edit no_edit = {0, 0, 0};
+    struct gzl_parse_state *s = gzl_alloc_parse_state();
+    gzl_init_parse_state(s, p->bound_grammar);
+
+    free_checkpoints(p);
+    p->bytes_parsed = 0;
+    add_checkpoint(p, 0, gzl_dup_parse_state(s));
+    return parse_from(p, s, buf, len, 0, NULL, 0, &no_edit);
+}
+
+enum gzl_status gzl_incremental_reparse(struct gzl_incremental_parse *p,
+                                        char *buf, size_t len,
+                                        size_t edit_offset, size_t removed,
+                                        size_t inserted)
+{
+    struct gzl_edit edit = {
+        edit_offset, edit_offset + removed, (ptrdiff_t)inserted - (ptrdiff_t)removed
+    };
+    size_t i, restart = 0;
+
+    p->bytes_parsed = 0;
+
+    /* The last parse never looked at anything after end_offset. */
+    if(p->status != GZL_STATUS_OK && edit_offset >= p->end_offset)
+        return p->status;
+
+    /* Split the old checkpoints into the ones before the edit, which are
+     * still good, and the ones after it, which we may meet again. */
+    struct gzl_checkpoint *old = p->checkpoints;
+    size_t old_len = p->checkpoints_len;
+    for(i = 0; i < old_len && old[i].offset <= edit_offset; i++)
+        restart = i;
+
+    /* Only a checkpoint that lies after the edit, and after where we restart,
+     * can be met again. */
+    size_t tail = restart + 1;
+    while(tail < old_len && (old[tail].offset < edit.old_end ||
+                             old[tail].offset + edit.delta <= old[restart].offset))
+        gzl_free_parse_state(old[tail++].state);
+
+    INIT_DYNARRAY(p->checkpoints, 0, old_len + 16);
+    for(i = 0; i <= restart; i++)
+        add_checkpoint(p, old[i].offset, old[i].state);
+
+    enum gzl_status status = parse_from(
+        p, gzl_dup_parse_state(old[restart].state), buf, len,
+        old[restart].offset, &old[tail], old_len - tail, &edit);
+    free(old);
+    return status;
+}
+
+/*
+ * Local Variables:
+ * c-file-style: "bsd"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ * vim:et:sts=4:sw=4
+ */
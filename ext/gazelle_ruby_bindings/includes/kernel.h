@@ -0,0 +1,79 @@
+/*********************************************************************
+
+  Gazelle: a system for building fast, reusable parsers
+
+  kernel.h
+
+  Shared by the files that are compiled twice, once for parsing and
+  once for recognizing (parse_kernel.c, threaded_kernel.c and
+  generated_kernel.c).  Each of them includes this file at the top,
+  with GZL_RECOGNIZER set to 1 for the recognizer copy, and again at
+  the bottom with GZL_RECOGNIZER unset to restore the normal names.
+
+  In the recognizer copy every kernel function gets a _recognizer
+  suffix and the public entry points are named gzl_recognize*(), so
+  the two copies can live in the same translation unit.
+
+*********************************************************************/
+
+#undef push_rtn_frame
+#undef push_rtn_frame_for_transition
+#undef pop_rtn_frame
+#undef descend_to_gla
+#undef do_rtn_terminal_transition
+#undef do_gla_transition
+#undef process_terminal
+#undef do_intfa_transition
+#undef enter_start_rule
+#undef copy_initial_stack
+#undef start_parse
+#undef advance_offset
+#undef gzl_parse
+#undef gzl_parse_threaded
+#undef gzl_parse_generated
+#undef GZL_CALLBACK
+
+#ifdef GZL_RECOGNIZER
+
+#define push_rtn_frame                push_rtn_frame_recognizer
+#define push_rtn_frame_for_transition push_rtn_frame_for_transition_recognizer
+#define pop_rtn_frame                 pop_rtn_frame_recognizer
+#define descend_to_gla                descend_to_gla_recognizer
+#define do_rtn_terminal_transition    do_rtn_terminal_transition_recognizer
+#define do_gla_transition             do_gla_transition_recognizer
+#define process_terminal              process_terminal_recognizer
+#define do_intfa_transition           do_intfa_transition_recognizer
+#define enter_start_rule              enter_start_rule_recognizer
+#define copy_initial_stack            copy_initial_stack_recognizer
+#define start_parse                   start_parse_recognizer
+#define advance_offset                advance_offset_recognizer
+#define gzl_parse                     gzl_recognize
+#define gzl_parse_threaded            gzl_recognize_threaded
+#define gzl_parse_generated           gzl_recognize_generated
+
+/* The recognizer never calls back. */
+#define GZL_CALLBACK(s, cb, args) ((void)0)
+
+#else
+
+/* Calls back, if there is a callback, and returns GZL_STATUS_CANCELLED from
+ * the calling function if the callback cancelled the parse. */
+#define GZL_CALLBACK(s, cb, args) \
+    do { \
+        if((s)->bound_grammar->cb) { \
+            (s)->bound_grammar->cb args; \
+            if((s)->cancelled) \
+                return GZL_STATUS_CANCELLED; \
+        } \
+    } while(0)
+
+#endif
+
+/*
+ * Local Variables:
+ * c-file-style: "bsd"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ * vim:et:sts=4:sw=4
+ */
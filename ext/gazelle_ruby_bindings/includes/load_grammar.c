@@ -477,6 +477,74 @@ void load_rtns(struct bc_read_stream *s, struct gzl_grammar *g)
     }
 }
 
+/*
+ * gla_longest_path(): returns the number of transitions on the longest path
+ * from the given GLA state to a final state, or -1 if a cycle is reachable
+ * from it.  memo[] caches results per state: -1 for "not yet visited", -2 for
+ * "on the current path".
+ */
+static
+int gla_longest_path(struct gzl_gla *gla, int state_offset, int *memo)
+{
+    if(memo[state_offset] == -2)
+        return -1;
+    else if(memo[state_offset] >= 0)
+        return memo[state_offset];
+
+    struct gzl_gla_state *state = &gla->states[state_offset];
+    int longest = 0;
+    int i;
+
+    if(!state->is_final)
+    {
+        memo[state_offset] = -2;
+        for(i = 0; i < state->d.nonfinal.num_transitions; i++)
+        {
+            struct gzl_gla_transition *t = &state->d.nonfinal.transitions[i];
+            int len = gla_longest_path(gla, t->dest_state - gla->states, memo);
+            if(len < 0)
+                return -1;
+            if(len + 1 > longest)
+                longest = len + 1;
+        }
+    }
+
+    memo[state_offset] = longest;
+    return longest;
+}
+
+/*
+ * compute_sizing_hints(): fills in the statistics that parse states use to
+ * size their stack and token buffer up front.
+ */
+static
+void compute_sizing_hints(struct gzl_grammar *g)
+{
+    int i, j;
+
+    g->max_gla_lookahead = 0;
+    g->stack_depth_hint = 0;
+
+    for(i = 0; i < g->num_glas; i++)
+    {
+        struct gzl_gla *gla = &g->glas[i];
+        int *memo = malloc(gla->num_states * sizeof(*memo));
+        for(j = 0; j < gla->num_states; j++)
+            memo[j] = -1;
+
+        int len = gla_longest_path(gla, 0, memo);
+        free(memo);
+
+        if(len < 0)
+        {
+            g->max_gla_lookahead = -1;
+            break;
+        }
+        else if(len > g->max_gla_lookahead)
+            g->max_gla_lookahead = len;
+    }
+}
+
 /*
  * The rest of this file is the publicly-exposed API
  */
@@ -511,6 +579,13 @@ struct gzl_grammar *gzl_load_grammar(struct bc_read_stream *s)
             else
             {
                 /* Success -- we finished loading! */
+                compute_sizing_hints(g);
+                g->initial_stack = NULL;
+                g->initial_stack_len = 0;
+                g->bytecode = NULL;
+                g->code = NULL;
+                g->profile = NULL;
+                g->prefilter = NULL;
                 break;
             }
         }
@@ -550,6 +625,10 @@ void gzl_free_grammar(struct gzl_grammar *g)
     }
     free(g->intfas);
 
+    free(g->initial_stack);
+    free(g->bytecode);
+    gzl_free_profile(g, g->profile);
+    free(g->prefilter);
     free(g);
 }
 
@@ -0,0 +1,62 @@
+/*********************************************************************
+
+  Gazelle: a system for building fast, reusable parsers
+
+  lockstep.c
+
+  Running several parses over the same buffer at once, to find out
+  which of several grammars an input is written in.  Rather than
+  running each parse over the whole buffer in turn, we run them all
+  over one chunk of it before moving on to the next, so that each
+  chunk is read from memory once and is still in cache for every
+  parse after the first.  A parse that fails, or stops for any other
+  reason, is dropped and the rest carry on without it.
+
+*********************************************************************/
+
+#include "gazelle/parse.h"
+
+/* Comfortably inside any L1 data cache, alongside the parse states. */
+#define GZL_LOCKSTEP_CHUNK_SIZE 4096
+
+/*
+ * The rest of this file is the publicly-exposed API, documented in the
+ * header file.
+ */
+
+size_t gzl_parse_lockstep(struct gzl_lockstep_parse *parses, size_t num_parses,
+                          char *buf, size_t len)
+{
+    size_t running = 0;
+    size_t pos, i;
+
+    for(i = 0; i < num_parses; i++)
+        if(parses[i].status == GZL_STATUS_OK)
+            running++;
+
+    for(pos = 0; pos < len && running > 0; pos += GZL_LOCKSTEP_CHUNK_SIZE) {
+        size_t chunk_len = len - pos < GZL_LOCKSTEP_CHUNK_SIZE ?
+            len - pos : GZL_LOCKSTEP_CHUNK_SIZE;
+        for(i = 0; i < num_parses; i++) {
+            struct gzl_lockstep_parse *p = &parses[i];
+            if(p->status != GZL_STATUS_OK)
+                continue;
+            p->status = p->parse(p->state, buf + pos, chunk_len);
+            if(p->status != GZL_STATUS_OK)
+                running--;
+        }
+    }
+
+    return running;
+}
+
+#undef GZL_LOCKSTEP_CHUNK_SIZE
+
+/*
+ * Local Variables:
+ * c-file-style: "bsd"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ * vim:et:sts=4:sw=4
+ */
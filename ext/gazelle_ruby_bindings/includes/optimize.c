@@ -0,0 +1,539 @@
+/*********************************************************************
+
+  Gazelle: a system for building fast, reusable parsers
+
+  optimize.c
+
+  An optional pass over a freshly loaded grammar that shrinks its
+  IntFAs:
+
+  - each IntFA is minimized (Hopcroft's algorithm), and runs of bytes
+    that go to the same state are merged into a single range;
+  - IntFAs that come out identical are hash-consed, so that every RTN
+    and GLA state that lexes the same set of terminals shares one copy.
+
+  What a transition matches is defined by find_intfa_transition() in
+  parse.c (the first range containing the byte, as a char), and the
+  optimized IntFAs give the same answer for every byte in every
+  state.  A state with no transition for a byte is kept distinct from
+  a state that has one into a dead end, since longest-match lexing
+  treats the two differently.
+
+*********************************************************************/
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gazelle/grammar.h"
+
+#define NUM_CHARS (CHAR_MAX - CHAR_MIN + 1)
+
+/*
+ * intfa_target(): the state (index) the IntFA goes to from state on ch, or
+ * intfa->num_states if there is no transition.  This is
+ * find_intfa_transition(), but that lives in parse.c.
+ */
+static
+int intfa_target(struct gzl_intfa *intfa, struct gzl_intfa_state *state, char ch)
+{
+    int i;
+    for(i = 0; i < state->num_transitions; i++) {
+        struct gzl_intfa_transition *t = &state->transitions[i];
+        if(ch >= t->ch_low && ch <= t->ch_high)
+            return t->dest_state - intfa->states;
+    }
+    return intfa->num_states;
+}
+
+static
+void add_intfa_size(struct gzl_intfa *intfa, struct gzl_intfa_sizes *sizes)
+{
+    sizes->intfas++;
+    sizes->states += intfa->num_states;
+    sizes->transitions += intfa->num_transitions;
+    sizes->bytes += sizeof(*intfa) +
+                    intfa->num_states * sizeof(struct gzl_intfa_state) +
+                    intfa->num_transitions * sizeof(struct gzl_intfa_transition);
+}
+
+static
+void count_intfa_sizes(struct gzl_grammar *g, struct gzl_intfa_sizes *sizes)
+{
+    int i;
+    memset(sizes, 0, sizeof(*sizes));
+    for(i = 0; i < g->num_intfas; i++)
+        add_intfa_size(&g->intfas[i], sizes);
+}
+
+/*
+ * Minimization.
+ *
+ * The IntFA is completed with a sink (index num_states) standing for "no
+ * transition", and bytes are grouped into classes that every state treats
+ * alike, so that the alphabet is usually a handful of symbols rather than
+ * 256.  The partition starts out as one block per final-state label, with
+ * the sink on its own, and is refined by Hopcroft's algorithm.
+ */
+
+struct partition {
+    int *elems;       /* states, grouped by block */
+    int *pos;         /* [state] index into elems */
+    int *block;       /* [state] block it belongs to */
+    int *start;       /* [block] its first index into elems */
+    int *end;         /* [block] one past its last */
+    int *marked;      /* [block] how many of its states are marked */
+    int num_blocks;
+};
+
+static
+void mark_state(struct partition *p, int state, int *touched, int *num_touched)
+{
+    int b = p->block[state];
+    int first_unmarked = p->start[b] + p->marked[b];
+    int i = p->pos[state];
+    if(i < first_unmarked)
+        return;  /* already marked */
+
+    /* Swap it to the front of its block, just after the other marked
+     * states. */
+    int other = p->elems[first_unmarked];
+    p->elems[first_unmarked] = state;
+    p->pos[state] = first_unmarked;
+    p->elems[i] = other;
+    p->pos[other] = i;
+
+    if(p->marked[b]++ == 0)
+        touched[(*num_touched)++] = b;
+}
+
+/*
+ * minimal_blocks(): partitions the states of intfa (plus the sink) into
+ * blocks of equivalent states.  Returns the number of blocks and fills in
+ * block_of[0..num_states].
+ */
+static
+int minimal_blocks(struct gzl_intfa *intfa, int *block_of)
+{
+    int n = intfa->num_states + 1;
+    int num_classes = 0;
+    int s, c, i, j;
+
+    /* Byte classes: two chars are in the same class if every state sends
+     * them to the same place.  Comparing each char's column of targets with
+     * that of a representative of each class found so far is quadratic in the
+     * number of classes, which stays small. */
+    int *column = malloc(NUM_CHARS * n * sizeof(int));
+    int class_rep[NUM_CHARS];
+    for(c = 0; c < NUM_CHARS; c++) {
+        for(s = 0; s < n - 1; s++)
+            column[c * n + s] =
+                intfa_target(intfa, &intfa->states[s], (char)(c + CHAR_MIN));
+        column[c * n + n - 1] = n - 1;
+
+        for(i = 0; i < num_classes; i++)
+            if(memcmp(&column[class_rep[i] * n], &column[c * n], n * sizeof(int)) == 0)
+                break;
+        if(i == num_classes)
+            class_rep[num_classes++] = c;
+    }
+
+    /* delta[s * num_classes + a] */
+    int *delta = malloc(n * num_classes * sizeof(int));
+    for(s = 0; s < n; s++)
+        for(i = 0; i < num_classes; i++)
+            delta[s * num_classes + i] = column[class_rep[i] * n + s];
+    free(column);
+
+    /* Inverse transitions: for class a and state t, the states that go to t
+     * on a are inv[inv_start[a * n + t] .. inv_start[a * n + t + 1]). */
+    int *inv_start = calloc(num_classes * n + 1, sizeof(int));
+    int *inv = malloc(n * num_classes * sizeof(int));
+    for(s = 0; s < n; s++)
+        for(i = 0; i < num_classes; i++)
+            inv_start[i * n + delta[s * num_classes + i] + 1]++;
+    for(i = 0; i < num_classes * n; i++)
+        inv_start[i + 1] += inv_start[i];
+    int *fill = malloc(num_classes * n * sizeof(int));
+    memcpy(fill, inv_start, num_classes * n * sizeof(int));
+    for(s = 0; s < n; s++)
+        for(i = 0; i < num_classes; i++) {
+            int key = i * n + delta[s * num_classes + i];
+            inv[fill[key]++] = s;
+        }
+    free(fill);
+
+    /* The initial partition: the sink on its own, then one block per
+     * distinct final label (terminal names are interned, so pointers can be
+     * compared). */
+    struct partition p;
+    p.elems = malloc(n * sizeof(int));
+    p.pos = malloc(n * sizeof(int));
+    p.block = malloc(n * sizeof(int));
+    p.start = malloc(n * sizeof(int));
+    p.end = calloc(n, sizeof(int));
+    p.marked = calloc(n, sizeof(int));
+
+    char **labels = malloc(n * sizeof(char*));
+    p.num_blocks = 1;
+    p.block[n - 1] = 0;
+    for(s = 0; s < n - 1; s++) {
+        for(j = 1; j < p.num_blocks; j++)
+            if(labels[j] == intfa->states[s].final)
+                break;
+        if(j == p.num_blocks)
+            labels[p.num_blocks++] = intfa->states[s].final;
+        p.block[s] = j;
+    }
+    free(labels);
+
+    for(s = 0; s < n; s++)
+        p.end[p.block[s]]++;
+    for(i = 0; i < p.num_blocks; i++) {
+        p.start[i] = i == 0 ? 0 : p.end[i - 1];
+        p.end[i] += p.start[i];
+    }
+    for(s = 0; s < n; s++) {
+        int b = p.block[s];
+        p.pos[s] = p.start[b] + p.marked[b]++;
+        p.elems[p.pos[s]] = s;
+    }
+    for(i = 0; i < p.num_blocks; i++)
+        p.marked[i] = 0;
+
+    /* Hopcroft's algorithm.  Every initial block starts out as a splitter;
+     * when a block in the worklist is split both halves stay in it, otherwise
+     * only the smaller half needs to be added. */
+    int *worklist = malloc(n * sizeof(int));
+    bool *in_worklist = calloc(n, sizeof(bool));
+    int num_work = 0;
+    for(i = 0; i < p.num_blocks; i++) {
+        worklist[num_work++] = i;
+        in_worklist[i] = true;
+    }
+
+    int *splitter = malloc(n * sizeof(int));
+    int *touched = malloc(n * sizeof(int));
+    while(num_work > 0) {
+        int b = worklist[--num_work];
+        int splitter_len = p.end[b] - p.start[b];
+        in_worklist[b] = false;
+        memcpy(splitter, &p.elems[p.start[b]], splitter_len * sizeof(int));
+
+        for(i = 0; i < num_classes; i++) {
+            int num_touched = 0;
+            for(j = 0; j < splitter_len; j++) {
+                int key = i * n + splitter[j];
+                int k;
+                for(k = inv_start[key]; k < inv_start[key + 1]; k++)
+                    mark_state(&p, inv[k], touched, &num_touched);
+            }
+
+            for(j = 0; j < num_touched; j++) {
+                int old = touched[j];
+                int marked = p.marked[old];
+                p.marked[old] = 0;
+                if(marked == p.end[old] - p.start[old])
+                    continue;  /* the whole block goes the same way */
+
+                /* The marked states become a new block. */
+                int nb = p.num_blocks++;
+                int k;
+                p.start[nb] = p.start[old];
+                p.end[nb] = p.start[old] + marked;
+                p.start[old] = p.end[nb];
+                for(k = p.start[nb]; k < p.end[nb]; k++)
+                    p.block[p.elems[k]] = nb;
+
+                if(in_worklist[old] ||
+                   p.end[nb] - p.start[nb] <= p.end[old] - p.start[old]) {
+                    worklist[num_work++] = nb;
+                    in_worklist[nb] = true;
+                } else {
+                    worklist[num_work++] = old;
+                    in_worklist[old] = true;
+                }
+            }
+        }
+    }
+
+    for(s = 0; s < n; s++)
+        block_of[s] = p.block[s];
+    int num_blocks = p.num_blocks;
+
+    free(splitter);
+    free(touched);
+    free(worklist);
+    free(in_worklist);
+    free(p.elems);
+    free(p.pos);
+    free(p.block);
+    free(p.start);
+    free(p.end);
+    free(p.marked);
+    free(inv_start);
+    free(inv);
+    free(delta);
+    return num_blocks;
+}
+
+/*
+ * A transition of the minimized IntFA while it is being built: a run of
+ * chars [low, high] and the block it leads to.  rank is where the run's
+ * first char was matched in the old state's list, so that the new list can
+ * keep the old order (which may have come from a profile).
+ */
+struct run {
+    int low, high;
+    int dest;
+    int rank;
+};
+
+static
+int compare_runs(const void *a, const void *b)
+{
+    const struct run *ra = a, *rb = b;
+    if(ra->rank != rb->rank) return ra->rank < rb->rank ? -1 : 1;
+    return ra->low < rb->low ? -1 : ra->low > rb->low;
+}
+
+static
+int old_rank(struct gzl_intfa_state *state, char ch)
+{
+    int i;
+    for(i = 0; i < state->num_transitions; i++)
+        if(ch >= state->transitions[i].ch_low && ch <= state->transitions[i].ch_high)
+            return i;
+    return state->num_transitions;
+}
+
+static
+void minimize_intfa(struct gzl_intfa *intfa)
+{
+    int n = intfa->num_states;
+    int *block_of = malloc((n + 1) * sizeof(int));
+    int num_blocks = minimal_blocks(intfa, block_of);
+    int s, c, i;
+
+    /* Number the new states breadth-first from the start state, taking
+     * chars in order, which drops unreachable states and numbers equivalent
+     * IntFAs the same way.  The sink's block gets no state. */
+    int *new_state = malloc(num_blocks * sizeof(int));
+    int *rep = malloc(num_blocks * sizeof(int));  /* [new state] old state */
+    int num_states = 1;
+    for(i = 0; i < num_blocks; i++)
+        new_state[i] = -1;
+    new_state[block_of[0]] = 0;
+    rep[0] = 0;
+
+    struct run *runs = NULL;
+    int *first_run = malloc((num_blocks + 1) * sizeof(int));
+    int num_runs = 0, runs_size = 0;
+    for(s = 0; s < num_states; s++) {
+        struct gzl_intfa_state *old = &intfa->states[rep[s]];
+        first_run[s] = num_runs;
+        for(c = CHAR_MIN; c <= CHAR_MAX; c++) {
+            int target = intfa_target(intfa, old, (char)c);
+            if(target == n) continue;
+
+            int b = block_of[target];
+            if(new_state[b] == -1) {
+                new_state[b] = num_states;
+                rep[num_states++] = target;
+            }
+
+            if(num_runs > first_run[s] && runs[num_runs - 1].high == c - 1 &&
+               runs[num_runs - 1].dest == new_state[b]) {
+                runs[num_runs - 1].high = c;
+                continue;
+            }
+            if(num_runs == runs_size) {
+                runs_size = runs_size ? runs_size * 2 : 16;
+                runs = realloc(runs, runs_size * sizeof(*runs));
+            }
+            struct run *r = &runs[num_runs++];
+            r->low = r->high = c;
+            r->dest = new_state[b];
+            r->rank = old_rank(old, (char)c);
+        }
+        if(num_runs - first_run[s] > 1)
+            qsort(&runs[first_run[s]], num_runs - first_run[s], sizeof(*runs),
+                  compare_runs);
+    }
+    first_run[num_states] = num_runs;
+
+    struct gzl_intfa_state *states = malloc((num_states + 1) * sizeof(*states));
+    struct gzl_intfa_transition *transitions =
+        malloc((num_runs + 1) * sizeof(*transitions));
+    for(s = 0; s < num_states; s++) {
+        states[s].final = intfa->states[rep[s]].final;
+        states[s].num_transitions = first_run[s + 1] - first_run[s];
+        states[s].transitions = &transitions[first_run[s]];
+    }
+    for(i = 0; i < num_runs; i++) {
+        transitions[i].ch_low = runs[i].low;
+        transitions[i].ch_high = runs[i].high;
+        transitions[i].dest_state = &states[runs[i].dest];
+    }
+
+    free(intfa->states);
+    free(intfa->transitions);
+    intfa->states = states;
+    intfa->num_states = num_states;
+    intfa->transitions = transitions;
+    intfa->num_transitions = num_runs;
+
+    free(runs);
+    free(first_run);
+    free(rep);
+    free(new_state);
+    free(block_of);
+}
+
+/*
+ * Hash-consing.  Two IntFAs can be shared if a walk from both start states,
+ * taking every char in lockstep, only ever pairs up states with the same
+ * final label and the same missing transitions.  Minimized IntFAs that lex
+ * the same terminals are isomorphic, so this finds all of them.
+ */
+
+static
+uint32_t hash_intfa(struct gzl_intfa *intfa)
+{
+    uint32_t h = intfa->num_states * 31u + intfa->num_transitions;
+    int i;
+    /* Order-independent over transitions, which a profile may have
+     * reordered. */
+    for(i = 0; i < intfa->num_transitions; i++) {
+        struct gzl_intfa_transition *t = &intfa->transitions[i];
+        h += (uint32_t)t->ch_low * 2654435761u ^ (uint32_t)t->ch_high * 40503u;
+    }
+    return h;
+}
+
+static
+bool same_intfa(struct gzl_intfa *a, struct gzl_intfa *b)
+{
+    if(a->num_states != b->num_states || a->num_transitions != b->num_transitions)
+        return false;
+
+    int n = a->num_states;
+    int *pair = malloc(n * sizeof(int));  /* [state of a] state of b */
+    int *queue = malloc(n * sizeof(int));
+    int head = 0, tail = 0, i;
+    bool same = true;
+    for(i = 0; i < n; i++)
+        pair[i] = -1;
+    pair[0] = 0;
+    queue[tail++] = 0;
+
+    while(same && head < tail) {
+        int sa = queue[head++];
+        int sb = pair[sa];
+        int c;
+        if(a->states[sa].final != b->states[sb].final) {
+            same = false;
+            break;
+        }
+        for(c = CHAR_MIN; c <= CHAR_MAX; c++) {
+            int ta = intfa_target(a, &a->states[sa], (char)c);
+            int tb = intfa_target(b, &b->states[sb], (char)c);
+            if((ta == n) != (tb == n)) { same = false; break; }
+            if(ta == n) continue;
+            if(pair[ta] == -1) {
+                pair[ta] = tb;
+                queue[tail++] = ta;
+            } else if(pair[ta] != tb) {
+                same = false;
+                break;
+            }
+        }
+    }
+    free(pair);
+    free(queue);
+    return same;
+}
+
+static
+void share_intfas(struct gzl_grammar *g)
+{
+    int n = g->num_intfas;
+    uint32_t *hashes = malloc((n + 1) * sizeof(*hashes));
+    int *canonical = malloc((n + 1) * sizeof(int));  /* [old] new index */
+    int num_intfas = 0;
+    int i, j;
+
+    for(i = 0; i < n; i++) {
+        hashes[i] = hash_intfa(&g->intfas[i]);
+        canonical[i] = -1;
+        for(j = 0; j < i; j++) {
+            if(hashes[j] == hashes[i] && canonical[j] != -1 &&
+               g->intfas[canonical[j]].states &&  /* j was kept */
+               same_intfa(&g->intfas[canonical[j]], &g->intfas[i])) {
+                canonical[i] = canonical[j];
+                break;
+            }
+        }
+
+        if(canonical[i] != -1) {
+            free(g->intfas[i].states);
+            free(g->intfas[i].transitions);
+        } else {
+            /* Keep it, sliding it down over the ones we dropped.  Its
+             * transitions point at its states, which don't move. */
+            canonical[i] = num_intfas;
+            g->intfas[num_intfas++] = g->intfas[i];
+        }
+    }
+
+    for(i = 0; i < g->num_rtns; i++)
+        for(j = 0; j < g->rtns[i].num_states; j++) {
+            struct gzl_rtn_state *state = &g->rtns[i].states[j];
+            if(state->lookahead_type == GZL_STATE_HAS_INTFA)
+                state->d.state_intfa =
+                    &g->intfas[canonical[state->d.state_intfa - g->intfas]];
+        }
+    for(i = 0; i < g->num_glas; i++)
+        for(j = 0; j < g->glas[i].num_states; j++) {
+            struct gzl_gla_state *state = &g->glas[i].states[j];
+            if(!state->is_final)
+                state->d.nonfinal.intfa =
+                    &g->intfas[canonical[state->d.nonfinal.intfa - g->intfas]];
+        }
+
+    g->num_intfas = num_intfas;
+    free(hashes);
+    free(canonical);
+}
+
+void gzl_optimize_grammar(struct gzl_grammar *g, struct gzl_optimize_report *report)
+{
+    int i;
+    struct gzl_optimize_report r;
+
+    count_intfa_sizes(g, &r.before);
+    for(i = 0; i < g->num_intfas; i++)
+        minimize_intfa(&g->intfas[i]);
+    share_intfas(g);
+    count_intfa_sizes(g, &r.after);
+
+    /* Anything built from the old IntFAs is stale. */
+    free(g->initial_stack);
+    g->initial_stack = NULL;
+    g->initial_stack_len = 0;
+    free(g->bytecode);
+    g->bytecode = NULL;
+
+    if(report)
+        *report = r;
+}
+
+/*
+ * Local Variables:
+ * c-file-style: "bsd"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ * vim:et:sts=4:sw=4
+ */
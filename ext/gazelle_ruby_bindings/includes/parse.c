@@ -22,6 +22,7 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <time.h>
 
 #include "gazelle/parse.h"
 
@@ -31,97 +32,125 @@
  * provide pushing and popping of different kinds of stack frames.
  */
 
+static
+void reserve_parse_stack(struct gzl_parse_state *s, size_t size)
+{
+    if(s->parse_stack_size < size) {
+        s->parse_stack_size = size;
+        s->parse_stack = realloc(s->parse_stack,
+                                 size * sizeof(*s->parse_stack));
+    }
+}
+
+/* Only called when the stack is full, which after the first few parses with
+ * a grammar should be never: we remember how deep we got so that later parse
+ * states reserve that much up front. */
+static
+void grow_parse_stack(struct gzl_parse_state *s)
+{
+    struct gzl_grammar *g = gzl_state_grammar(s);
+    reserve_parse_stack(s, s->parse_stack_size * 2);
+    if(g->stack_depth_hint < s->parse_stack_size)
+        g->stack_depth_hint = s->parse_stack_size;
+}
+
 static
 struct gzl_parse_stack_frame *push_empty_frame(struct gzl_parse_state *s,
                                                enum gzl_frame_type frame_type,
-                                               struct gzl_offset *start_offset)
+                                               size_t start_byte)
 {
-    RESIZE_DYNARRAY(s->parse_stack, s->parse_stack_len+1);
-    struct gzl_parse_stack_frame *frame = DYNARRAY_GET_TOP(s->parse_stack);
+    if(s->parse_stack_len == s->parse_stack_size)
+        grow_parse_stack(s);
+    struct gzl_parse_stack_frame *frame = &s->parse_stack[s->parse_stack_len++];
     frame->frame_type = frame_type;
-    frame->start_offset = *start_offset;
+    frame->start_byte = start_byte;
     return frame;
 }
 
 static
 struct gzl_intfa_frame *push_intfa_frame(struct gzl_parse_state *s,
                                          struct gzl_intfa *intfa,
-                                         struct gzl_offset *start_offset)
+                                         size_t start_byte)
 {
     struct gzl_parse_stack_frame *frame =
-        push_empty_frame(s, GZL_FRAME_TYPE_INTFA, start_offset);
+        push_empty_frame(s, GZL_FRAME_TYPE_INTFA, start_byte);
     struct gzl_intfa_frame *intfa_frame = &frame->f.intfa_frame;
-    intfa_frame->intfa        = intfa;
-    intfa_frame->intfa_state  = &intfa->states[0];
+    intfa_frame->intfa        = intfa - gzl_state_grammar(s)->intfas;
+    intfa_frame->intfa_state  = 0;
     return intfa_frame;
 }
 
 static
 struct gzl_parse_stack_frame *push_gla_frame(struct gzl_parse_state *s,
                                              struct gzl_gla *gla,
-                                             struct gzl_offset *start_offset)
+                                             size_t start_byte)
 {
     struct gzl_parse_stack_frame *frame =
-        push_empty_frame(s, GZL_FRAME_TYPE_GLA, start_offset);
+        push_empty_frame(s, GZL_FRAME_TYPE_GLA, start_byte);
     struct gzl_gla_frame *gla_frame = &frame->f.gla_frame;
-    gla_frame->gla          = gla;
-    gla_frame->gla_state    = &gla->states[0];
+    gla_frame->gla          = gla - gzl_state_grammar(s)->glas;
+    gla_frame->gla_state    = 0;
     return frame;
 }
 
 static
-enum gzl_status push_rtn_frame(struct gzl_parse_state *s,
-                               struct gzl_rtn *rtn,
-                               struct gzl_offset *start_offset)
+struct gzl_parse_stack_frame *pop_frame(struct gzl_parse_state *s)
 {
-    struct gzl_parse_stack_frame *new_frame =
-        push_empty_frame(s, GZL_FRAME_TYPE_RTN, start_offset);
-    struct gzl_rtn_frame *new_rtn_frame = &new_frame->f.rtn_frame;
-    new_rtn_frame->rtn            = rtn;
-    new_rtn_frame->rtn_transition = NULL;
-    new_rtn_frame->rtn_state      = &new_rtn_frame->rtn->states[0];
-    if(s->bound_grammar->start_rule_cb) s->bound_grammar->start_rule_cb(s);
-    return GZL_STATUS_OK;
+    assert(s->parse_stack_len > 0);
+    s->parse_stack_len--;
+    return s->parse_stack_len > 0 ? DYNARRAY_GET_TOP(s->parse_stack) : NULL;
 }
 
+/*
+ * The following manage the token buffer, a ring of terminals that have been
+ * lexed but not yet consumed by an RTN transition.
+ */
+
 static
-enum gzl_status push_rtn_frame_for_transition(struct gzl_parse_state *s,
-                                              struct gzl_rtn_transition *t,
-                                              struct gzl_offset *start_offset)
+size_t token_buffer_size_for(struct gzl_grammar *g)
 {
-    struct gzl_rtn_frame *old_rtn_frame =
-        &DYNARRAY_GET_TOP(s->parse_stack)->f.rtn_frame;
-    old_rtn_frame->rtn_transition = t;
-    return push_rtn_frame(s, t->edge.nonterminal, start_offset);
+    /* The longest path through any GLA bounds how many terminals we buffer
+     * while looking ahead; leave room for the terminal that completes it. */
+    size_t needed = g->max_gla_lookahead < 0 ? 8 : g->max_gla_lookahead + 2;
+    size_t size = 2;
+    while(size < needed)
+        size *= 2;
+    return size;
 }
 
 static
-struct gzl_parse_stack_frame *pop_frame(struct gzl_parse_state *s)
+void reserve_token_buffer(struct gzl_parse_state *s, size_t size)
 {
-    assert(s->parse_stack_len > 0);
-    RESIZE_DYNARRAY(s->parse_stack, s->parse_stack_len-1);
-    return s->parse_stack_len > 0 ? DYNARRAY_GET_TOP(s->parse_stack) : NULL;
+    if(s->token_buffer_size >= size)
+        return;
+
+    /* Unwrap the ring into the new allocation so the oldest terminal is
+     * first. */
+    struct gzl_terminal *buf = malloc(size * sizeof(*buf));
+    size_t i;
+    for(i = 0; i < s->token_buffer_len; i++)
+        buf[i] = *gzl_token(s, i);
+    free(s->token_buffer);
+    s->token_buffer = buf;
+    s->token_buffer_head = 0;
+    s->token_buffer_size = size;
 }
 
 static
-enum gzl_status pop_rtn_frame(struct gzl_parse_state *s)
+struct gzl_terminal *push_token(struct gzl_parse_state *s)
 {
-    assert(DYNARRAY_GET_TOP(s->parse_stack)->frame_type == GZL_FRAME_TYPE_RTN);
-    if(s->bound_grammar->end_rule_cb) s->bound_grammar->end_rule_cb(s);
+    if(s->token_buffer_len == s->token_buffer_size)
+        reserve_token_buffer(s, s->token_buffer_size * 2);
+    return gzl_token(s, s->token_buffer_len++);
+}
 
-    struct gzl_parse_stack_frame *frame = pop_frame(s);
-    if(frame) {
-        assert(frame->frame_type == GZL_FRAME_TYPE_RTN);
-        struct gzl_rtn_frame *rtn_frame = &frame->f.rtn_frame;
-        if(rtn_frame->rtn_transition)
-            rtn_frame->rtn_state = rtn_frame->rtn_transition->dest_state;
-        else {
-          /* Should only happen at the top level. */
-          assert(s->parse_stack_len == 1);
-        }
-        return GZL_STATUS_OK;
-    } else
-        return GZL_STATUS_HARD_EOF;
+static
+void consume_tokens(struct gzl_parse_state *s, size_t n)
+{
+    assert(n <= s->token_buffer_len);
+    s->token_buffer_head =
+        (s->token_buffer_head + n) & (s->token_buffer_size - 1);
+    s->token_buffer_len -= n;
 }
 
 static
@@ -139,97 +168,26 @@ struct gzl_parse_stack_frame *pop_intfa_frame(struct gzl_parse_state *s)
     return pop_frame(s);
 }
 
-/*
- * descend_to_gla(): given the current parse stack, pushes any RTN or GLA
- * stack frames representing transitions that can be taken without consuming
- * any terminals.
- *
- * Preconditions:
- * - the current frame is either an RTN frame or a GLA frame
- *
- * Postconditions:
- * - the current frame is an RTN frame or a GLA frame.  If a new GLA frame was
- *   entered, entered_gla is set to true.
- */
-static
-enum gzl_status descend_to_gla(struct gzl_parse_state *s, bool *entered_gla,
-                               struct gzl_offset *start_offset)
-{
-    *entered_gla = false;
-    while(true) {
-        struct gzl_parse_stack_frame *frame = DYNARRAY_GET_TOP(s->parse_stack);
-        if(frame->frame_type != GZL_FRAME_TYPE_RTN) return GZL_STATUS_OK;
-
-        /* Subtract 1 because there can be one IntFA frame beyond the RTN and
-         * GLA frames this function pushes. */
-        if(s->parse_stack_len >= s->max_stack_depth-1)
-            return GZL_STATUS_RESOURCE_LIMIT_EXCEEDED;
-
-        struct gzl_rtn_frame *rtn_frame = &frame->f.rtn_frame;
-        switch(rtn_frame->rtn_state->lookahead_type) {
-          case GZL_STATE_HAS_INTFA:
-            return GZL_STATUS_OK;
-
-          case GZL_STATE_HAS_GLA:
-            *entered_gla = true;
-            push_gla_frame(s, rtn_frame->rtn_state->d.state_gla, start_offset);
-            return GZL_STATUS_OK;
-
-          case GZL_STATE_HAS_NEITHER:
-            /* An RTN state has neither an IntFA or a GLA in only two cases:
-             * - it is a final state with no outgoing transitions
-             * - it is a nonfinal state with only one transition (a nonterminal)
-             */
-            assert(rtn_frame->rtn_state->num_transitions < 2);
-            enum gzl_status status = GZL_STATUS_OK;
-            if(rtn_frame->rtn_state->num_transitions == 0)
-                status = pop_rtn_frame(s); /* Final state */
-            else if(rtn_frame->rtn_state->num_transitions == 1) {
-                assert(rtn_frame->rtn_state->transitions[0].transition_type ==
-                       GZL_NONTERM_TRANSITION);
-                status = push_rtn_frame_for_transition(
-                    s, &rtn_frame->rtn_state->transitions[0], start_offset);
-            }
-            if(status != GZL_STATUS_OK) return status;
-            break;
-        }
-    }
-}
-
 static
 struct gzl_intfa_frame *push_intfa_frame_for_gla_or_rtn(
     struct gzl_parse_state *s)
 {
     struct gzl_parse_stack_frame *frame = DYNARRAY_GET_TOP(s->parse_stack);
     if(frame->frame_type == GZL_FRAME_TYPE_GLA) {
-        struct gzl_gla_state *gla_state = frame->f.gla_frame.gla_state;
+        struct gzl_gla_state *gla_state =
+            gzl_frame_gla_state(s, &frame->f.gla_frame);
         assert(gla_state->is_final == false);
-        return push_intfa_frame(s, gla_state->d.nonfinal.intfa, &s->offset);
+        return push_intfa_frame(s, gla_state->d.nonfinal.intfa, s->offset.byte);
     } else if(frame->frame_type == GZL_FRAME_TYPE_RTN) {
-        struct gzl_rtn_state *rtn_state = frame->f.rtn_frame.rtn_state;
+        struct gzl_rtn_state *rtn_state =
+            gzl_frame_rtn_state(s, &frame->f.rtn_frame);
         assert(rtn_state->lookahead_type == GZL_STATE_HAS_INTFA);
-        return push_intfa_frame(s, rtn_state->d.state_intfa, &s->offset);
+        return push_intfa_frame(s, rtn_state->d.state_intfa, s->offset.byte);
     }
     assert(false);  /* should never reach here. */
     return NULL;
 }
 
-static
-enum gzl_status do_rtn_terminal_transition(struct gzl_parse_state *s,
-                                           struct gzl_rtn_transition *t,
-                                           struct gzl_terminal *terminal)
-{
-    struct gzl_parse_stack_frame *frame = DYNARRAY_GET_TOP(s->parse_stack);
-    assert(frame->frame_type == GZL_FRAME_TYPE_RTN);
-    struct gzl_rtn_frame *rtn_frame = &frame->f.rtn_frame;
-    rtn_frame->rtn_transition = t;
-    if(s->bound_grammar->terminal_cb)
-      s->bound_grammar->terminal_cb(s, terminal);
-    assert(t->transition_type == GZL_TERMINAL_TRANSITION);
-    rtn_frame->rtn_state = t->dest_state;
-    return GZL_STATUS_OK;
-}
-
 static
 struct gzl_rtn_transition *find_rtn_terminal_transition(
     struct gzl_rtn_state *rtn_state, struct gzl_terminal *terminal)
@@ -271,264 +229,161 @@ struct gzl_intfa_transition *find_intfa_transition(
 }
 
 /*
- * do_gla_transition(): transitions a GLA frame, performing the appropriate
- * RTN transitions if this puts the GLA in a final state.
- *
- * Preconditions:
- * - the current stack frame is a GLA frame
- * - term is a terminal that came from this GLA state's intfa
- *
- * Postconditions:
- * - the current stack frame is a GLA frame (this would indicate that
- *   the GLA hasn't hit a final state yet) or the current stack frame is
- *   an RTN frame (indicating we *have* hit a final state in the GLA)
+ * rtn_terminal_transition(), gla_transition() and intfa_transition(): find
+ * the transition to take from the current frame, using the grammar's
+ * generated code if it was compiled to C, and counting it if the grammar is
+ * being profiled (see profile.c).
  */
 static
-enum gzl_status do_gla_transition(struct gzl_parse_state *s,
-                                        struct gzl_terminal *term,
-                                        size_t *rtn_term_offset)
+struct gzl_rtn_transition *rtn_terminal_transition(struct gzl_parse_state *s,
+                                                   struct gzl_rtn_frame *frame,
+                                                   struct gzl_terminal *terminal)
 {
-    struct gzl_parse_stack_frame *frame = DYNARRAY_GET_TOP(s->parse_stack);
-    assert(frame->frame_type == GZL_FRAME_TYPE_GLA);
-    assert(frame->f.gla_frame.gla_state->is_final == false);
-    struct gzl_gla_state *gla_state = frame->f.gla_frame.gla_state;
-    struct gzl_gla_state *dest_gla_state = NULL;
-
-    /* Find the transition. */
-    struct gzl_gla_transition *t = find_gla_transition(gla_state, term->name);
-    if(!t) {
-        /* Parse error: terminal for which we had no GLA transition. */
-        if(s->bound_grammar->error_terminal_cb)
-            s->bound_grammar->error_terminal_cb(s, term);
-        return GZL_STATUS_ERROR;
-    }
-    /* Perform the transition. */
-    assert(t->dest_state);
-    frame->f.gla_frame.gla_state = t->dest_state;
-    dest_gla_state = t->dest_state;
-
-    /* Perform appropriate actions if we're in a final state. */
-    enum gzl_status status = GZL_STATUS_OK;
-    if(dest_gla_state->is_final) {
-        /* Pop the GLA frame (since now we know what RTN transition to take)
-         * and use its information to make an RTN transition. */
-        int offset = dest_gla_state->d.final.transition_offset;
-        frame = pop_gla_frame(s);
-        if(offset == 0)
-            status = pop_rtn_frame(s);
-        else {
-            struct gzl_rtn_state *rtn_state = frame->f.rtn_frame.rtn_state;
-            struct gzl_rtn_transition *t = &rtn_state->transitions[offset-1];
-            struct gzl_terminal *next_term = &s->token_buffer[*rtn_term_offset];
-            if(t->transition_type == GZL_TERMINAL_TRANSITION) {
-                /* The transition must match what we have in the token buffer */
-                assert(next_term->name == t->edge.terminal_name);
-                (*rtn_term_offset)++;
-                status = do_rtn_terminal_transition(s, t, next_term);
-            } else
-                status = push_rtn_frame_for_transition(
-                    s, t, &next_term->offset);
-        }
-    }
-    return status;
+    struct gzl_grammar *g = gzl_state_grammar(s);
+    struct gzl_rtn_transition *t;
+    if(g->code)
+        t = g->code->rtn_terminal_transition(frame->rtn, frame->rtn_state,
+                                             terminal->name);
+    else
+        t = find_rtn_terminal_transition(gzl_frame_rtn_state(s, frame),
+                                         terminal);
+    if(g->profile && t)
+        g->profile->rtn_hits[frame->rtn][t - g->rtns[frame->rtn].transitions]++;
+    return t;
+}
+
+static
+struct gzl_gla_transition *gla_transition(struct gzl_parse_state *s,
+                                          struct gzl_gla_frame *frame,
+                                          char *term_name)
+{
+    struct gzl_grammar *g = gzl_state_grammar(s);
+    struct gzl_gla_transition *t;
+    if(g->code)
+        t = g->code->gla_transition(frame->gla, frame->gla_state, term_name);
+    else
+        t = find_gla_transition(gzl_frame_gla_state(s, frame), term_name);
+    if(g->profile && t)
+        g->profile->gla_hits[frame->gla][t - g->glas[frame->gla].transitions]++;
+    return t;
+}
+
+static
+struct gzl_intfa_transition *intfa_transition(struct gzl_parse_state *s,
+                                              struct gzl_intfa_frame *frame,
+                                              char ch)
+{
+    struct gzl_grammar *g = gzl_state_grammar(s);
+    struct gzl_intfa_transition *t =
+        find_intfa_transition(gzl_frame_intfa_state(s, frame), ch);
+    if(g->profile && t)
+        g->profile->intfa_hits[frame->intfa][t - g->intfas[frame->intfa].transitions]++;
+    return t;
 }
 
 /*
- * process_terminal(): processes a terminal that was just lexed, possibly
- * triggering a series of RTN and/or GLA transitions.
- *
- * Preconditions:
- * - the current stack frame is an intfa frame representing the intfa that
- *   just produced this terminal
- * - the given terminal can be recognized by the current GLA or RTN state
- *
- * Postconditions:
- * - the current stack frame is an GLA or RTN frame representing the state after
- *   all available GLA and RTN transitions have been taken.
+ * Budgets.  Every main loop calls begin_budget() on entry, to find out how
+ * much of its buffer it may consume, and out_of_budget() after each token;
+ * end_budget() turns running out of bytes into GZL_STATUS_YIELD.  The
+ * deadline is only looked at every GZL_DEADLINE_CHECK_INTERVAL transitions,
+ * so out_of_budget() is normally a single comparison.
  */
+#define GZL_DEADLINE_CHECK_INTERVAL 64
+
+uint64_t gzl_monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
 static
-enum gzl_status process_terminal(struct gzl_parse_state *s, char *term_name,
-                                 struct gzl_offset *start_offset, int len)
+void schedule_budget_check(struct gzl_parse_state *s)
 {
-    pop_intfa_frame(s);
-    struct gzl_parse_stack_frame *frame = DYNARRAY_GET_TOP(s->parse_stack);
-    size_t rtn_term_offset = 0;
-    size_t gla_term_offset = s->token_buffer_len;
-
-    RESIZE_DYNARRAY(s->token_buffer, s->token_buffer_len+1);
-    if(s->token_buffer_len >= s->max_lookahead)
-        return GZL_STATUS_RESOURCE_LIMIT_EXCEEDED;
-
-    struct gzl_terminal *term = DYNARRAY_GET_TOP(s->token_buffer);
-    term->name = term_name;
-    term->offset = *start_offset;
-    term->len = len;
-
-    /* Feed tokens to RTNs and GLAs until we have processed all the tokens we
-     * have. */
-    enum gzl_status status = GZL_STATUS_OK;
-    enum gzl_frame_type frame_type = frame->frame_type;
-    do {
-        /* Take one terminal transition, for either an RTN or a GLA. */
-        if(frame_type == GZL_FRAME_TYPE_RTN) {
-            struct gzl_terminal *rtn_term = &s->token_buffer[rtn_term_offset];
-            struct gzl_rtn_transition *t;
-            rtn_term_offset++;
-
-            if(rtn_term->name == NULL)
-                /* Skip: RTNs don't process EOF as a terminal, only GLAs do. */
-                continue;
-            t = find_rtn_terminal_transition(frame->f.rtn_frame.rtn_state,
-                                             rtn_term);
-            if(!t) {
-                /* Parse error: terminal for which we had no RTN transition. */
-                if(s->bound_grammar->error_terminal_cb)
-                    s->bound_grammar->error_terminal_cb(s, term);
-                return GZL_STATUS_ERROR;
-            }
-            status = do_rtn_terminal_transition(s, t, rtn_term);
-        } else {
-            struct gzl_terminal *gla_term = &s->token_buffer[gla_term_offset++];
-            status = do_gla_transition(s, gla_term, &rtn_term_offset);
-        }
+    s->budget_check_at = s->transition_limit;
+    if(s->budget.deadline_ns &&
+       s->transitions + GZL_DEADLINE_CHECK_INTERVAL < s->budget_check_at)
+        s->budget_check_at = s->transitions + GZL_DEADLINE_CHECK_INTERVAL;
+}
 
-        /* Having taken a transition, push any new frames onto the stack. */
-        if(status == GZL_STATUS_OK) {
-            bool entered_gla;
-            if(rtn_term_offset < s->token_buffer_len)
-                status = descend_to_gla(
-                    s, &entered_gla, &s->token_buffer[rtn_term_offset].offset);
-            else
-                status = descend_to_gla(s, &entered_gla, &s->offset);
-
-            if(entered_gla)
-                gla_term_offset = rtn_term_offset;
-        }
+static
+size_t begin_budget(struct gzl_parse_state *s, size_t buf_len)
+{
+    s->transition_limit = s->budget.transitions ?
+        s->transitions + s->budget.transitions : SIZE_MAX;
+    schedule_budget_check(s);
+    return (s->budget.bytes && s->budget.bytes < buf_len) ?
+        s->budget.bytes : buf_len;
+}
 
-        if(status == GZL_STATUS_OK) {
-            assert(s->parse_stack_len > 0);
-            frame = DYNARRAY_GET_TOP(s->parse_stack);
-            frame_type = frame->frame_type;
-        }
-    }
-    while(status == GZL_STATUS_OK &&
-          ((frame_type == GZL_FRAME_TYPE_RTN &&
-            rtn_term_offset < s->token_buffer_len) ||
-           (frame_type == GZL_FRAME_TYPE_GLA &&
-            gla_term_offset < s->token_buffer_len)));
-
-    /* We can have an EOF left over in the token buffer if the EOF token led us
-     * to a hard EOF, thus terminating the above loop before our "skip" above
-     * could cover this EOF special case. */
-    if(rtn_term_offset < s->token_buffer_len &&
-       s->token_buffer[rtn_term_offset].name == NULL)
-        rtn_term_offset++;
-
-    /* At this point we have consumed some (but possibly not all) of the
-     * terminals we have lexed.  We consider a token fully consumed when it
-     * has caused an RTN transition (just a GLA transition doesn't leave the
-     * token consumed, because it will be used again for an RTN transition
-     * later.
-     *
-     * We now remove the consumed terminals from token_buffer. */
-    size_t remaining_terminals = s->token_buffer_len - rtn_term_offset;
-    if(remaining_terminals > 0)
-        memmove(s->token_buffer, s->token_buffer + rtn_term_offset,
-                remaining_terminals * sizeof(*s->token_buffer));
-    RESIZE_DYNARRAY(s->token_buffer, remaining_terminals);
-
-    /* Update open_terminal_offset. */
-    if(remaining_terminals > 0)
-        s->open_terminal_offset = s->token_buffer[0].offset;
-    else
-        s->open_terminal_offset = s->offset;
+static
+enum gzl_status end_budget(enum gzl_status status, size_t len, size_t buf_len)
+{
+    return (status == GZL_STATUS_OK && len < buf_len) ? GZL_STATUS_YIELD : status;
+}
 
-    return status;
+static
+bool budget_exhausted(struct gzl_parse_state *s)
+{
+    if(s->transitions >= s->transition_limit ||
+       (s->budget.deadline_ns && gzl_monotonic_ns() >= s->budget.deadline_ns))
+        return true;
+    schedule_budget_check(s);
+    return false;
 }
 
+static inline
+bool out_of_budget(struct gzl_parse_state *s)
+{
+    return s->transitions >= s->budget_check_at && budget_exhausted(s);
+}
+
+static void build_initial_stack(struct gzl_grammar *g);
 
 /*
- * do_intfa_transition(): transitions an IntFA frame according to the given
- * char, performing the appropriate GLA/RTN transitions if this puts the IntFA
- * in a final state.
- *
- * Preconditions:
- * - the current stack frame is an IntFA frame
- *
- * Postconditions:
- * - the current stack frame is an IntFA frame unless we have hit a
- *   hard EOF in which case it is an RTN frame.  Note that it could be either
- *   same IntFA frame or a different one.
- *
- * Note: we currently implement longest-match, assuming that the first
- * non-matching character is only one longer than the longest match.
+ * The hot path, compiled once with callbacks (gzl_parse()) and once as a pure
+ * recognizer (gzl_recognize()).
  */
+#include "parse_kernel.c"
+#define GZL_RECOGNIZER 1
+#include "parse_kernel.c"
+
 static
-enum gzl_status do_intfa_transition(struct gzl_parse_state *s,
-                                    char ch)
+void note_initial_stack_pop(struct gzl_parse_state *s)
 {
-    struct gzl_parse_stack_frame *frame = DYNARRAY_GET_TOP(s->parse_stack);
-    assert(frame->frame_type == GZL_FRAME_TYPE_INTFA);
-    struct gzl_intfa_frame *intfa_frame = &frame->f.intfa_frame;
-    struct gzl_intfa_transition *t = find_intfa_transition(
-        intfa_frame->intfa_state, ch);
-    enum gzl_status status;
-
-    /* If this character did not have any transition, but the state we're coming
-     * from is final, then longest-match semantics say that we should return
-     * the last character's final state as the token.  But if the state we're
-     * coming from is *not* final, it's just a parse error. */
-    if(!t) {
-        char *terminal = intfa_frame->intfa_state->final;
-        assert(terminal);  /* TODO: handle this case. */
-        status = process_terminal(s, terminal, &frame->start_offset,
-                                  s->offset.byte - frame->start_offset.byte);
-        if(status != GZL_STATUS_OK) return status;
-        intfa_frame = push_intfa_frame_for_gla_or_rtn(s);
-        t = find_intfa_transition(intfa_frame->intfa_state, ch);
-        if(!t) {
-            /* Parse error: we encountered a character for which we have no
-             * transition. */
-            if(s->bound_grammar->error_char_cb)
-                s->bound_grammar->error_char_cb(s, ch);
-            return GZL_STATUS_ERROR;
-        }
-    }
+    *(bool*)s->user_data = true;
+}
 
-    /* We have finished processing transitions for the previous byte.
-     * Move on to the next byte. */
-    s->offset.byte++;
-
-    /* Deal with newlines.  This is all very single-byte-encoding specific for
-     * the moment. */
-    bool is_newline_char = (ch == 0x0A || ch == 0x0D);  /* LF and CR */
-    if(is_newline_char) {
-        if(!s->last_char_was_newline) {
-            s->offset.line++;
-            s->offset.column = 1;
-        }
-    }
-    else
-        s->offset.column++;
-    s->last_char_was_newline = is_newline_char;
-
-    /* Do the transition. */
-    intfa_frame->intfa_state = t->dest_state;
-
-    /* If the current state is final and there are no outgoing transitions,
-     * we *know* we don't have to wait any longer for the longest match.
-     * Transition the RTN or GLA now, for more on-line behavior. */
-    if(intfa_frame->intfa_state->final &&
-       (intfa_frame->intfa_state->num_transitions == 0)) {
-        status = process_terminal(s, intfa_frame->intfa_state->final,
-                                  &frame->start_offset,
-                                  s->offset.byte - frame->start_offset.byte);
-        if(status != GZL_STATUS_OK)
-            return status;
-        push_intfa_frame_for_gla_or_rtn(s);
-    }
-    return GZL_STATUS_OK;
+/*
+ * build_initial_stack(): runs enter_start_rule() once, without callbacks, and
+ * saves the resulting stack in the grammar.  Entering the start rule is the
+ * same for every parse, so later parses just copy it.  If doing so would pop
+ * an RTN frame (which must be reported to end_rule_cb), we leave the grammar
+ * without a usable initial stack.
+ */
+static
+void build_initial_stack(struct gzl_grammar *g)
+{
+    struct gzl_bound_grammar bg = {
+        .grammar = g,
+        .end_rule_cb = note_initial_stack_pop
+    };
+    bool popped = false;
+    struct gzl_parse_state *s = gzl_alloc_parse_state();
+    gzl_init_parse_state(s, &bg);
+    s->user_data = &popped;
+
+    g->initial_stack_len = 0;
+    if(enter_start_rule(s) == GZL_STATUS_OK && !popped)
+        g->initial_stack_len = s->parse_stack_len;
+
+    /* Always allocate at least one frame, so that a non-NULL initial_stack
+     * means it has been built. */
+    g->initial_stack = malloc((g->initial_stack_len + 1) *
+                              sizeof(*g->initial_stack));
+    memcpy(g->initial_stack, s->parse_stack,
+           g->initial_stack_len * sizeof(*g->initial_stack));
+    gzl_free_parse_state(s);
 }
 
 /*
@@ -536,32 +391,12 @@ enum gzl_status do_intfa_transition(struct gzl_parse_state *s,
  * header file.
  */
 
-enum gzl_status gzl_parse(struct gzl_parse_state *s, char *buf, size_t buf_len)
-{
-    enum gzl_status status = GZL_STATUS_OK;
-    size_t i;
-
-    /* For the first call, we need to push the initial frame and
-     * descend from the starting frame until we hit an IntFA frame. */
-    if(s->offset.byte == 0 && s->parse_stack_len == 0) {
-        push_rtn_frame(s, &s->bound_grammar->grammar->rtns[0], &s->offset);
-        bool entered_gla;
-        status = descend_to_gla(s, &entered_gla, &s->offset);
-        if(status == GZL_STATUS_OK) push_intfa_frame_for_gla_or_rtn(s);
-    }
-    if(s->parse_stack_len == 0) {
-        /* This gzl_parse_state has already hit hard EOF previously. */
-        return GZL_STATUS_HARD_EOF;
-    }
-
-    for(i = 0; i < buf_len && status == GZL_STATUS_OK; i++)
-        status = do_intfa_transition(s, buf[i]);
-    return status;
-}
-
 bool gzl_finish_parse(struct gzl_parse_state *s)
 {
     size_t i;
+    if(s->cancelled) return false;
+    if(s->parse_stack_len == 0) return true;  /* already hit hard EOF */
+
     /* First deal with an open IntFA frame if there is one.  The frame must
      * be in a start state (in which case we back it out), a final state
      * (in which case we recognize and process the terminal), or both (in
@@ -570,15 +405,17 @@ bool gzl_finish_parse(struct gzl_parse_state *s)
     struct gzl_parse_stack_frame *frame = DYNARRAY_GET_TOP(s->parse_stack);
     if(frame->frame_type == GZL_FRAME_TYPE_INTFA) {
         struct gzl_intfa_frame *intfa_frame = &frame->f.intfa_frame;
-        if(intfa_frame->intfa_state->final &&
-           intfa_frame->intfa_state == &intfa_frame->intfa->states[0]) {
+        struct gzl_intfa_state *intfa_state =
+            gzl_frame_intfa_state(s, intfa_frame);
+        if(intfa_state->final && intfa_frame->intfa_state == 0) {
             /* TODO: handle this case. */
             assert(false);
-        } else if(intfa_frame->intfa_state->final) {
-            process_terminal(s, intfa_frame->intfa_state->final,
-                             &frame->start_offset,
-                             s->offset.byte - frame->start_offset.byte);
-        } else if(intfa_frame->intfa_state == &intfa_frame->intfa->states[0]) {
+        } else if(intfa_state->final) {
+            if(process_terminal(s, intfa_state->final, frame->start_byte,
+                                s->offset.byte - frame->start_byte) ==
+               GZL_STATUS_CANCELLED)
+                return false;
+        } else if(intfa_frame->intfa_state == 0) {
             /* Pop the frame like it never happened. */
             pop_intfa_frame(s);
         } else {
@@ -594,7 +431,7 @@ bool gzl_finish_parse(struct gzl_parse_state *s)
     frame = DYNARRAY_GET_TOP(s->parse_stack);
     if(frame->frame_type == GZL_FRAME_TYPE_GLA) {
         struct gzl_gla_frame *gla_frame = &frame->f.gla_frame;
-        if(gla_frame->gla_state == &gla_frame->gla->states[0]) {
+        if(gla_frame->gla_state == 0) {
             /* GLA is in a start state -- fine, we can just pop it as
              * if it never happened. */
             pop_gla_frame(s);
@@ -602,12 +439,14 @@ bool gzl_finish_parse(struct gzl_parse_state *s)
             /* For this to still be valid EOF, this GLA state must have an
              * outgoing EOF transition, and we must take it now. */
             struct gzl_gla_transition *t =
-                find_gla_transition(gla_frame->gla_state, NULL);
+                find_gla_transition(gzl_frame_gla_state(s, gla_frame), NULL);
             if(!t) return false;
 
             /* process_terminal() wants an IntFA frame to pop. */
-            push_empty_frame(s, GZL_FRAME_TYPE_INTFA, &s->offset);
-            process_terminal(s, NULL, &s->offset, 0);
+            push_empty_frame(s, GZL_FRAME_TYPE_INTFA, s->offset.byte);
+            if(process_terminal(s, NULL, s->offset.byte, 0) ==
+               GZL_STATUS_CANCELLED)
+                return false;
 
             /* Pop any GLA states that the previous may have pushed. */
             while(s->parse_stack_len > 0 &&
@@ -625,23 +464,25 @@ bool gzl_finish_parse(struct gzl_parse_state *s)
             frame = &s->parse_stack[i];
             assert(frame->frame_type == GZL_FRAME_TYPE_RTN);
             struct gzl_rtn_frame *rtn_frame = &frame->f.rtn_frame;
-            assert(rtn_frame->rtn_transition);
-            if(!rtn_frame->rtn_transition->dest_state->is_final) return false;
+            struct gzl_rtn_transition *t =
+                gzl_frame_rtn_transition(s, rtn_frame);
+            assert(t);
+            if(!t->dest_state->is_final) return false;
         }
 
         frame = DYNARRAY_GET_TOP(s->parse_stack);
         struct gzl_rtn_frame *rtn_frame = &frame->f.rtn_frame;
-        if(!rtn_frame->rtn_state->is_final) return false;
+        if(!gzl_frame_rtn_state(s, rtn_frame)->is_final) return false;
 
         /* We are truly in a state where EOF is ok.  Pop remaining RTN frames to
          * call callbacks appropriately. */
         while(s->parse_stack_len > 0)
         {
-            /* What should we do if the user cancels while the final RTN frames
-             * are being popped?  It's kind of a weird thing to do.  Options
-             * are to ignore it (we're finishing the parse anyway) or to stop.
-             * For now we ignore. */
-            pop_rtn_frame(s);
+            /* If the user cancels while the final RTN frames are being
+             * popped, we stop calling back, but the input did end in a valid
+             * place. */
+            if(pop_rtn_frame(s) == GZL_STATUS_CANCELLED)
+                break;
         }
     }
 
@@ -652,7 +493,11 @@ struct gzl_parse_state *gzl_alloc_parse_state()
 {
     struct gzl_parse_state *state = malloc(sizeof(*state));
     INIT_DYNARRAY(state->parse_stack, 0, 16);
-    INIT_DYNARRAY(state->token_buffer, 0, 2);
+    state->token_buffer_head = 0;
+    state->token_buffer_len = 0;
+    state->token_buffer_size = 2;
+    state->token_buffer = malloc(state->token_buffer_size *
+                                 sizeof(*state->token_buffer));
     return state;
 }
 
@@ -663,15 +508,17 @@ struct gzl_parse_state *gzl_dup_parse_state(struct gzl_parse_state *orig)
     *copy = *orig;
     size_t i;
 
-    INIT_DYNARRAY(copy->parse_stack, 0, 16);
-    RESIZE_DYNARRAY(copy->parse_stack, orig->parse_stack_len);
+    copy->parse_stack = malloc(orig->parse_stack_size *
+                               sizeof(*copy->parse_stack));
     for(i = 0; i < orig->parse_stack_len; i++)
         copy->parse_stack[i] = orig->parse_stack[i];
 
-    INIT_DYNARRAY(copy->token_buffer, 0, 2);
-    RESIZE_DYNARRAY(copy->token_buffer, orig->token_buffer_len);
+    /* The copy's ring starts at index 0. */
+    copy->token_buffer = malloc(orig->token_buffer_size *
+                                sizeof(*copy->token_buffer));
+    copy->token_buffer_head = 0;
     for(i = 0; i < orig->token_buffer_len; i++)
-        copy->token_buffer[i] = orig->token_buffer[i];
+        copy->token_buffer[i] = *gzl_token(orig, i);
 
     return copy;
 }
@@ -679,31 +526,91 @@ struct gzl_parse_state *gzl_dup_parse_state(struct gzl_parse_state *orig)
 void gzl_free_parse_state(struct gzl_parse_state *s)
 {
     FREE_DYNARRAY(s->parse_stack);
-    FREE_DYNARRAY(s->token_buffer);
+    free(s->token_buffer);
     free(s);
 }
 
+void gzl_reset_parse_state(struct gzl_parse_state *s)
+{
+    gzl_init_parse_state(s, s->bound_grammar);
+}
+
+/* Beyond this many idle states, released states are freed instead of being
+ * kept in the pool. */
+#define GZL_MAX_POOLED_STATES 8
+
+void gzl_init_parse_state_pool(struct gzl_parse_state_pool *pool)
+{
+    INIT_DYNARRAY(pool->states, 0, 4);
+}
+
+void gzl_free_parse_state_pool(struct gzl_parse_state_pool *pool)
+{
+    size_t i;
+    for(i = 0; i < pool->states_len; i++)
+        gzl_free_parse_state(pool->states[i]);
+    FREE_DYNARRAY(pool->states);
+}
+
+struct gzl_parse_state *gzl_acquire_parse_state(
+    struct gzl_parse_state_pool *pool, struct gzl_bound_grammar *bg)
+{
+    struct gzl_parse_state *s;
+    if(pool->states_len > 0)
+        s = pool->states[--pool->states_len];
+    else
+        s = gzl_alloc_parse_state();
+    gzl_init_parse_state(s, bg);
+    return s;
+}
+
+void gzl_release_parse_state(struct gzl_parse_state_pool *pool,
+                             struct gzl_parse_state *s)
+{
+    if(pool->states_len >= GZL_MAX_POOLED_STATES) {
+        gzl_free_parse_state(s);
+        return;
+    }
+    RESIZE_DYNARRAY(pool->states, pool->states_len+1);
+    *DYNARRAY_GET_TOP(pool->states) = s;
+}
+
 void gzl_init_parse_state(struct gzl_parse_state *s,
                           struct gzl_bound_grammar *bg)
 {
     s->offset.byte = 0;
     s->offset.line = 1;
     s->offset.column = 1;
-    s->open_terminal_offset = s->offset;
+    s->open_terminal_offset = s->offset.byte;
     s->last_char_was_newline = false;
     s->bound_grammar = bg;
-    RESIZE_DYNARRAY(s->parse_stack, 0);
-    RESIZE_DYNARRAY(s->token_buffer, 0);
+    s->parse_stack_len = 0;
+    s->token_buffer_head = 0;
+    s->token_buffer_len = 0;
 
-    /* Currently each stack frame takes 28 bytes on a 32-bit machine, so a
-     * stack depth of 500 is a modest 14kb of RAM.  500 frames of recursion is
+    /* Size the stack and token buffer from what we know about the grammar,
+     * so that steady-state parsing never reallocates either. */
+    reserve_parse_stack(s, bg->grammar->stack_depth_hint);
+    reserve_token_buffer(s, token_buffer_size_for(bg->grammar));
+
+    /* Currently each stack frame takes 24 bytes on a 64-bit machine, so a
+     * stack depth of 500 is a modest 12kb of RAM.  500 frames of recursion is
      * far deeper than we would expect any real text to be */
     s->max_stack_depth = 500;
 
-    /* Currently each token of lookahead takes 20 bytes on a 32-bit machine, so
-     * a lookahead depth of 500 is 10kb of RAM.  Input text would have to be
+    /* Currently each token of lookahead takes 24 bytes on a 64-bit machine, so
+     * a lookahead depth of 500 is 12kb of RAM.  Input text would have to be
      * truly pathological to require this much lookahead. */
     s->max_lookahead = 500;
+
+    memset(&s->budget, 0, sizeof(s->budget));
+    s->transitions = 0;
+    s->cancelled = false;
+}
+
+void gzl_cancel_parse(struct gzl_parse_state *s)
+{
+    s->cancelled = true;
 }
 
 enum gzl_status gzl_parse_file(struct gzl_parse_state *state,
@@ -717,6 +624,10 @@ enum gzl_status gzl_parse_file(struct gzl_parse_state *state,
     buffer->user_data = user_data;
     state->user_data = buffer;
 
+    /* We don't hand control back part way through. */
+    struct gzl_budget budget = state->budget;
+    memset(&state->budget, 0, sizeof(state->budget));
+
     /* The minimum amount of the data in the buffer that we want to be new data
      * each time.  This number shrinks as the amount of data we're preserving
      * from open tokens grows.  If the number is below this number we increase
@@ -729,7 +640,7 @@ enum gzl_status gzl_parse_file(struct gzl_parse_state *state,
         /* Make sure we have space for at least min_new_data new data. */
         size_t new_buf_size = buffer->buf_size;
         while(buffer->buf_len + min_new_data > new_buf_size)
-          buffer->buf_size *= 2;
+            new_buf_size *= 2;
         if(new_buf_size > max_buffer_size) {
             status = GZL_STATUS_RESOURCE_LIMIT_EXCEEDED;
             break;
@@ -775,9 +686,9 @@ enum gzl_status gzl_parse_file(struct gzl_parse_state *state,
          *                 Data we should now be saving --> |------------|
          */
 
-        size_t bytes_to_discard = state->open_terminal_offset.byte -
+        size_t bytes_to_discard = state->open_terminal_offset -
                                   buffer->buf_offset;
-        size_t bytes_to_save = buffer->buf_size - bytes_to_discard;
+        size_t bytes_to_save = buffer->buf_len - bytes_to_discard;
         char *buf_to_save_from = buffer->buf + bytes_to_discard;
         assert(bytes_to_discard <= (size_t) buffer->buf_len);  /* hasn't overflowed. */
 
@@ -786,18 +697,14 @@ enum gzl_status gzl_parse_file(struct gzl_parse_state *state,
         buffer->buf_len = bytes_to_save;
     } while(status == GZL_STATUS_OK && !is_eof);
 
+    /* Hitting grammar EOF before file EOF is fine (GZL_STATUS_HARD_EOF); the
+     * rest of the file just isn't looked at. */
     if(status == GZL_STATUS_HARD_EOF || (status == GZL_STATUS_OK && is_eof)) {
-        if(gzl_finish_parse(state)) {
-            if(!feof(file) || buffer->buf_len > 0) {
-                /* There was data left over -- we hit grammar EOF before
-                 * file EOF. */
-                status = GZL_STATUS_OK;
-            } else
-                status = GZL_STATUS_PREMATURE_EOF_ERROR;
-        } else
+        if(!gzl_finish_parse(state))
             status = GZL_STATUS_PREMATURE_EOF_ERROR;
     }
 
+    state->budget = budget;
     FREE_DYNARRAY(buffer->buf);
     free(buffer);
     return status;
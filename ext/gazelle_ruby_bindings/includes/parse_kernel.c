@@ -0,0 +1,515 @@
+/*********************************************************************
+
+  Gazelle: a system for building fast, reusable parsers
+
+  parse_kernel.c
+
+  The interpreter's hot path: the functions that take RTN, GLA and
+  IntFA transitions, call the bound grammar's callbacks and keep track
+  of the current line and column, plus the main loop of gzl_parse().
+
+  parse.c #includes this file twice.  The first copy is compiled
+  as-is.  The second is compiled with GZL_RECOGNIZER set to 1, which
+  renames every function here (gzl_parse() becomes gzl_recognize(),
+  see kernel.h) and compiles out the callbacks and the line/column
+  bookkeeping, leaving a pure recognizer for callers that only want
+  to know whether the input parses.
+
+*********************************************************************/
+
+#include "kernel.h"
+
+static
+enum gzl_status push_rtn_frame(struct gzl_parse_state *s,
+                               struct gzl_rtn *rtn,
+                               size_t start_byte)
+{
+    struct gzl_parse_stack_frame *new_frame =
+        push_empty_frame(s, GZL_FRAME_TYPE_RTN, start_byte);
+    struct gzl_rtn_frame *new_rtn_frame = &new_frame->f.rtn_frame;
+    new_rtn_frame->rtn            = rtn - gzl_state_grammar(s)->rtns;
+    new_rtn_frame->rtn_transition = GZL_NO_TRANSITION;
+    new_rtn_frame->rtn_state      = 0;
+    GZL_CALLBACK(s, start_rule_cb, (s));
+    return GZL_STATUS_OK;
+}
+
+static
+enum gzl_status push_rtn_frame_for_transition(struct gzl_parse_state *s,
+                                              struct gzl_rtn_transition *t,
+                                              size_t start_byte)
+{
+    struct gzl_rtn_frame *old_rtn_frame =
+        &DYNARRAY_GET_TOP(s->parse_stack)->f.rtn_frame;
+    old_rtn_frame->rtn_transition =
+        t - gzl_frame_rtn(s, old_rtn_frame)->transitions;
+    return push_rtn_frame(s, t->edge.nonterminal, start_byte);
+}
+
+static
+enum gzl_status pop_rtn_frame(struct gzl_parse_state *s)
+{
+    assert(DYNARRAY_GET_TOP(s->parse_stack)->frame_type == GZL_FRAME_TYPE_RTN);
+    GZL_CALLBACK(s, end_rule_cb, (s));
+
+    struct gzl_parse_stack_frame *frame = pop_frame(s);
+    if(frame) {
+        assert(frame->frame_type == GZL_FRAME_TYPE_RTN);
+        struct gzl_rtn_frame *rtn_frame = &frame->f.rtn_frame;
+        struct gzl_rtn_transition *t = gzl_frame_rtn_transition(s, rtn_frame);
+        if(t)
+            rtn_frame->rtn_state = t->dest_state - gzl_frame_rtn(s, rtn_frame)->states;
+        else {
+          /* Should only happen at the top level. */
+          assert(s->parse_stack_len == 1);
+        }
+        return GZL_STATUS_OK;
+    } else
+        return GZL_STATUS_HARD_EOF;
+}
+
+/*
+ * descend_to_gla(): given the current parse stack, pushes any RTN or GLA
+ * stack frames representing transitions that can be taken without consuming
+ * any terminals.
+ *
+ * Preconditions:
+ * - the current frame is either an RTN frame or a GLA frame
+ *
+ * Postconditions:
+ * - the current frame is an RTN frame or a GLA frame.  If a new GLA frame was
+ *   entered, entered_gla is set to true.
+ */
+static
+enum gzl_status descend_to_gla(struct gzl_parse_state *s, bool *entered_gla,
+                               size_t start_byte)
+{
+    *entered_gla = false;
+    while(true) {
+        struct gzl_parse_stack_frame *frame = DYNARRAY_GET_TOP(s->parse_stack);
+        if(frame->frame_type != GZL_FRAME_TYPE_RTN) return GZL_STATUS_OK;
+
+        /* Subtract 1 because there can be one IntFA frame beyond the RTN and
+         * GLA frames this function pushes. */
+        if(s->parse_stack_len >= s->max_stack_depth-1)
+            return GZL_STATUS_RESOURCE_LIMIT_EXCEEDED;
+
+        struct gzl_rtn_frame *rtn_frame = &frame->f.rtn_frame;
+        struct gzl_rtn_state *rtn_state = gzl_frame_rtn_state(s, rtn_frame);
+        switch(rtn_state->lookahead_type) {
+          case GZL_STATE_HAS_INTFA:
+            return GZL_STATUS_OK;
+
+          case GZL_STATE_HAS_GLA:
+            *entered_gla = true;
+            push_gla_frame(s, rtn_state->d.state_gla, start_byte);
+            return GZL_STATUS_OK;
+
+          case GZL_STATE_HAS_NEITHER:
+            /* An RTN state has neither an IntFA or a GLA in only two cases:
+             * - it is a final state with no outgoing transitions
+             * - it is a nonfinal state with only one transition (a nonterminal)
+             */
+            assert(rtn_state->num_transitions < 2);
+            enum gzl_status status = GZL_STATUS_OK;
+            if(rtn_state->num_transitions == 0)
+                status = pop_rtn_frame(s); /* Final state */
+            else if(rtn_state->num_transitions == 1) {
+                assert(rtn_state->transitions[0].transition_type ==
+                       GZL_NONTERM_TRANSITION);
+                status = push_rtn_frame_for_transition(
+                    s, &rtn_state->transitions[0], start_byte);
+            }
+            if(status != GZL_STATUS_OK) return status;
+            break;
+        }
+    }
+}
+
+static
+enum gzl_status do_rtn_terminal_transition(struct gzl_parse_state *s,
+                                           struct gzl_rtn_transition *t,
+                                           struct gzl_terminal *terminal)
+{
+    struct gzl_parse_stack_frame *frame = DYNARRAY_GET_TOP(s->parse_stack);
+    assert(frame->frame_type == GZL_FRAME_TYPE_RTN);
+    struct gzl_rtn_frame *rtn_frame = &frame->f.rtn_frame;
+    struct gzl_rtn *rtn = gzl_frame_rtn(s, rtn_frame);
+    rtn_frame->rtn_transition = t - rtn->transitions;
+    GZL_CALLBACK(s, terminal_cb, (s, terminal));
+    assert(t->transition_type == GZL_TERMINAL_TRANSITION);
+    rtn_frame->rtn_state = t->dest_state - rtn->states;
+    return GZL_STATUS_OK;
+}
+
+/*
+ * do_gla_transition(): transitions a GLA frame, performing the appropriate
+ * RTN transitions if this puts the GLA in a final state.
+ *
+ * Preconditions:
+ * - the current stack frame is a GLA frame
+ * - term is a terminal that came from this GLA state's intfa
+ *
+ * Postconditions:
+ * - the current stack frame is a GLA frame (this would indicate that
+ *   the GLA hasn't hit a final state yet) or the current stack frame is
+ *   an RTN frame (indicating we *have* hit a final state in the GLA)
+ */
+static
+enum gzl_status do_gla_transition(struct gzl_parse_state *s,
+                                        struct gzl_terminal *term,
+                                        size_t *rtn_term_offset)
+{
+    struct gzl_parse_stack_frame *frame = DYNARRAY_GET_TOP(s->parse_stack);
+    assert(frame->frame_type == GZL_FRAME_TYPE_GLA);
+    struct gzl_gla *gla = gzl_frame_gla(s, &frame->f.gla_frame);
+    struct gzl_gla_state *dest_gla_state = NULL;
+    assert(gzl_frame_gla_state(s, &frame->f.gla_frame)->is_final == false);
+
+    /* Find the transition. */
+    struct gzl_gla_transition *t =
+        gla_transition(s, &frame->f.gla_frame, term->name);
+    if(!t) {
+        /* Parse error: terminal for which we had no GLA transition. */
+        GZL_CALLBACK(s, error_terminal_cb, (s, term));
+        return GZL_STATUS_ERROR;
+    }
+    /* Perform the transition. */
+    assert(t->dest_state);
+    frame->f.gla_frame.gla_state = t->dest_state - gla->states;
+    dest_gla_state = t->dest_state;
+
+    /* Perform appropriate actions if we're in a final state. */
+    enum gzl_status status = GZL_STATUS_OK;
+    if(dest_gla_state->is_final) {
+        /* Pop the GLA frame (since now we know what RTN transition to take)
+         * and use its information to make an RTN transition. */
+        int offset = dest_gla_state->d.final.transition_offset;
+        frame = pop_gla_frame(s);
+        if(offset == 0)
+            status = pop_rtn_frame(s);
+        else {
+            struct gzl_rtn_state *rtn_state =
+                gzl_frame_rtn_state(s, &frame->f.rtn_frame);
+            struct gzl_rtn_transition *t = &rtn_state->transitions[offset-1];
+            struct gzl_terminal *next_term = gzl_token(s, *rtn_term_offset);
+            if(t->transition_type == GZL_TERMINAL_TRANSITION) {
+                /* The transition must match what we have in the token buffer */
+                assert(next_term->name == t->edge.terminal_name);
+                (*rtn_term_offset)++;
+                status = do_rtn_terminal_transition(s, t, next_term);
+            } else
+                status = push_rtn_frame_for_transition(
+                    s, t, next_term->start_byte);
+        }
+    }
+    return status;
+}
+
+/*
+ * process_terminal(): processes a terminal that was just lexed, possibly
+ * triggering a series of RTN and/or GLA transitions.
+ *
+ * Preconditions:
+ * - the current stack frame is an intfa frame representing the intfa that
+ *   just produced this terminal
+ * - the given terminal can be recognized by the current GLA or RTN state
+ *
+ * Postconditions:
+ * - the current stack frame is an GLA or RTN frame representing the state after
+ *   all available GLA and RTN transitions have been taken.
+ */
+
+static
+enum gzl_status process_terminal(struct gzl_parse_state *s, char *term_name,
+                                 size_t start_byte, size_t len)
+{
+    pop_intfa_frame(s);
+    struct gzl_parse_stack_frame *frame = DYNARRAY_GET_TOP(s->parse_stack);
+    size_t rtn_term_offset = 0;
+    size_t gla_term_offset = s->token_buffer_len;
+
+    if(s->token_buffer_len + 1 >= s->max_lookahead)
+        return GZL_STATUS_RESOURCE_LIMIT_EXCEEDED;
+
+    struct gzl_terminal *term = push_token(s);
+    term->name = term_name;
+    term->start_byte = start_byte;
+    term->len = len;
+
+    /* Feed tokens to RTNs and GLAs until we have processed all the tokens we
+     * have. */
+    enum gzl_status status = GZL_STATUS_OK;
+    enum gzl_frame_type frame_type = (enum gzl_frame_type)frame->frame_type;
+    do {
+        /* Take one terminal transition, for either an RTN or a GLA. */
+        s->transitions++;
+        if(frame_type == GZL_FRAME_TYPE_RTN) {
+            struct gzl_terminal *rtn_term = gzl_token(s, rtn_term_offset);
+            struct gzl_rtn_transition *t;
+            rtn_term_offset++;
+
+            if(rtn_term->name == NULL)
+                /* Skip: RTNs don't process EOF as a terminal, only GLAs do. */
+                continue;
+            t = rtn_terminal_transition(s, &frame->f.rtn_frame, rtn_term);
+            if(!t) {
+                /* Parse error: terminal for which we had no RTN transition. */
+                GZL_CALLBACK(s, error_terminal_cb, (s, term));
+                return GZL_STATUS_ERROR;
+            }
+            status = do_rtn_terminal_transition(s, t, rtn_term);
+        } else {
+            struct gzl_terminal *gla_term = gzl_token(s, gla_term_offset++);
+            status = do_gla_transition(s, gla_term, &rtn_term_offset);
+        }
+
+        /* Having taken a transition, push any new frames onto the stack. */
+        if(status == GZL_STATUS_OK) {
+            bool entered_gla;
+            if(rtn_term_offset < s->token_buffer_len)
+                status = descend_to_gla(
+                    s, &entered_gla, gzl_token(s, rtn_term_offset)->start_byte);
+            else
+                status = descend_to_gla(s, &entered_gla, s->offset.byte);
+
+            if(entered_gla)
+                gla_term_offset = rtn_term_offset;
+        }
+
+        if(status == GZL_STATUS_OK) {
+            assert(s->parse_stack_len > 0);
+            frame = DYNARRAY_GET_TOP(s->parse_stack);
+            frame_type = (enum gzl_frame_type)frame->frame_type;
+        }
+    }
+    while(status == GZL_STATUS_OK &&
+          ((frame_type == GZL_FRAME_TYPE_RTN &&
+            rtn_term_offset < s->token_buffer_len) ||
+           (frame_type == GZL_FRAME_TYPE_GLA &&
+            gla_term_offset < s->token_buffer_len)));
+
+    /* We can have an EOF left over in the token buffer if the EOF token led us
+     * to a hard EOF, thus terminating the above loop before our "skip" above
+     * could cover this EOF special case. */
+    if(rtn_term_offset < s->token_buffer_len &&
+       gzl_token(s, rtn_term_offset)->name == NULL)
+        rtn_term_offset++;
+
+    /* At this point we have consumed some (but possibly not all) of the
+     * terminals we have lexed.  We consider a token fully consumed when it
+     * has caused an RTN transition (just a GLA transition doesn't leave the
+     * token consumed, because it will be used again for an RTN transition
+     * later.
+     *
+     * We now remove the consumed terminals from token_buffer, which only
+     * advances its head. */
+    consume_tokens(s, rtn_term_offset);
+
+    /* Update open_terminal_offset. */
+    if(s->token_buffer_len > 0)
+        s->open_terminal_offset = gzl_token(s, 0)->start_byte;
+    else
+        s->open_terminal_offset = s->offset.byte;
+
+    return status;
+}
+
+/*
+ * do_intfa_transition(): transitions an IntFA frame according to the given
+ * char, performing the appropriate GLA/RTN transitions if this puts the IntFA
+ * in a final state.
+ *
+ * Preconditions:
+ * - the current stack frame is an IntFA frame
+ *
+ * Postconditions:
+ * - the current stack frame is an IntFA frame unless we have hit a
+ *   hard EOF in which case it is an RTN frame.  Note that it could be either
+ *   same IntFA frame or a different one.
+ *
+ * Note: we currently implement longest-match, assuming that the first
+ * non-matching character is only one longer than the longest match.
+ */
+static
+enum gzl_status do_intfa_transition(struct gzl_parse_state *s,
+                                    char ch)
+{
+    struct gzl_parse_stack_frame *frame = DYNARRAY_GET_TOP(s->parse_stack);
+    assert(frame->frame_type == GZL_FRAME_TYPE_INTFA);
+    struct gzl_intfa_frame *intfa_frame = &frame->f.intfa_frame;
+    struct gzl_intfa_state *intfa_state =
+        gzl_frame_intfa_state(s, intfa_frame);
+    struct gzl_intfa_transition *t = intfa_transition(s, intfa_frame, ch);
+    enum gzl_status status;
+
+    /* If this character did not have any transition, but the state we're coming
+     * from is final, then longest-match semantics say that we should return
+     * the last character's final state as the token.  But if the state we're
+     * coming from is *not* final, it's just a parse error. */
+    if(!t) {
+        char *terminal = intfa_state->final;
+        if(!terminal) {
+            GZL_CALLBACK(s, error_char_cb, (s, ch));
+            return GZL_STATUS_ERROR;
+        }
+        status = process_terminal(s, terminal, frame->start_byte,
+                                  s->offset.byte - frame->start_byte);
+        if(status != GZL_STATUS_OK) return status;
+        intfa_frame = push_intfa_frame_for_gla_or_rtn(s);
+
+        /* The stack may have been reallocated (and the old IntFA frame's slot
+         * reused) by process_terminal(), so refresh our frame pointers. */
+        frame = DYNARRAY_GET_TOP(s->parse_stack);
+        intfa_state = gzl_frame_intfa_state(s, intfa_frame);
+        t = intfa_transition(s, intfa_frame, ch);
+        if(!t) {
+            /* Parse error: we encountered a character for which we have no
+             * transition. */
+            GZL_CALLBACK(s, error_char_cb, (s, ch));
+            return GZL_STATUS_ERROR;
+        }
+    }
+
+    /* We have finished processing transitions for the previous byte.
+     * Move on to the next byte. */
+    s->offset.byte++;
+
+#ifndef GZL_RECOGNIZER
+    /* Deal with newlines.  This is all very single-byte-encoding specific for
+     * the moment. */
+    bool is_newline_char = (ch == 0x0A || ch == 0x0D);  /* LF and CR */
+    if(is_newline_char) {
+        if(!s->last_char_was_newline) {
+            s->offset.line++;
+            s->offset.column = 1;
+        }
+    }
+    else
+        s->offset.column++;
+    s->last_char_was_newline = is_newline_char;
+#endif
+
+    /* Do the transition. */
+    intfa_state = t->dest_state;
+    intfa_frame->intfa_state =
+        intfa_state - gzl_frame_intfa(s, intfa_frame)->states;
+
+    /* If the current state is final and there are no outgoing transitions,
+     * we *know* we don't have to wait any longer for the longest match.
+     * Transition the RTN or GLA now, for more on-line behavior. */
+    if(intfa_state->final && (intfa_state->num_transitions == 0)) {
+        status = process_terminal(s, intfa_state->final, frame->start_byte,
+                                  s->offset.byte - frame->start_byte);
+        if(status != GZL_STATUS_OK)
+            return status;
+        push_intfa_frame_for_gla_or_rtn(s);
+    }
+    return GZL_STATUS_OK;
+}
+
+/*
+ * enter_start_rule(): pushes the initial frame and descends from the starting
+ * frame until we hit an IntFA frame.
+ */
+static
+enum gzl_status enter_start_rule(struct gzl_parse_state *s)
+{
+    enum gzl_status status =
+        push_rtn_frame(s, &gzl_state_grammar(s)->rtns[0], s->offset.byte);
+    if(status != GZL_STATUS_OK) return status;
+    bool entered_gla;
+    status = descend_to_gla(s, &entered_gla, s->offset.byte);
+    if(status == GZL_STATUS_OK) push_intfa_frame_for_gla_or_rtn(s);
+    return status;
+}
+
+/*
+ * copy_initial_stack(): enters the start rule by copying the grammar's
+ * initial stack.  start_rule_cb is still called once for each RTN frame, with
+ * the stack as it would have been when the frame was pushed.
+ */
+static
+void copy_initial_stack(struct gzl_parse_state *s)
+{
+    struct gzl_grammar *g = gzl_state_grammar(s);
+    reserve_parse_stack(s, g->initial_stack_len);
+    memcpy(s->parse_stack, g->initial_stack,
+           g->initial_stack_len * sizeof(*s->parse_stack));
+
+#ifndef GZL_RECOGNIZER
+    if(s->bound_grammar->start_rule_cb) {
+        size_t i;
+        for(i = 0; i < g->initial_stack_len; i++) {
+            if(s->parse_stack[i].frame_type != GZL_FRAME_TYPE_RTN) continue;
+            s->parse_stack_len = i + 1;
+            s->bound_grammar->start_rule_cb(s);
+            if(s->cancelled) break;
+        }
+    }
+#endif
+    s->parse_stack_len = g->initial_stack_len;
+}
+
+/*
+ * start_parse(): called at the beginning of each gzl_parse().  On the first
+ * call for a parse state, enters the start rule.  Returns GZL_STATUS_HARD_EOF
+ * if the state has already hit hard EOF, and GZL_STATUS_CANCELLED if the
+ * parse was cancelled.
+ */
+static
+enum gzl_status start_parse(struct gzl_parse_state *s)
+{
+    enum gzl_status status = GZL_STATUS_OK;
+    if(s->cancelled)
+        return GZL_STATUS_CANCELLED;
+
+    /* For the first call, we need to enter the start rule. */
+    if(s->offset.byte == 0 && s->parse_stack_len == 0) {
+        struct gzl_grammar *g = gzl_state_grammar(s);
+        if(!g->initial_stack)
+            build_initial_stack(g);
+
+        if(g->initial_stack_len > 0) {
+            copy_initial_stack(s);
+            if(s->cancelled)
+                return GZL_STATUS_CANCELLED;
+        } else
+            status = enter_start_rule(s);
+    }
+    if(s->parse_stack_len == 0) {
+        /* This gzl_parse_state has already hit hard EOF previously. */
+        return GZL_STATUS_HARD_EOF;
+    }
+    return status;
+}
+
+/*
+ * gzl_parse() (or gzl_recognize()): the plain interpreter's main loop, one
+ * byte at a time.  Documented in the header file.
+ */
+enum gzl_status gzl_parse(struct gzl_parse_state *s, char *buf, size_t buf_len)
+{
+    enum gzl_status status = start_parse(s);
+    size_t len = begin_budget(s, buf_len);
+    size_t i;
+
+    for(i = 0; i < len && status == GZL_STATUS_OK; i++) {
+        status = do_intfa_transition(s, buf[i]);
+        if(status == GZL_STATUS_OK && i + 1 < buf_len && out_of_budget(s))
+            return GZL_STATUS_YIELD;
+    }
+    return end_budget(status, len, buf_len);
+}
+
+#undef GZL_RECOGNIZER
+#include "kernel.h"
+
+/*
+ * Local Variables:
+ * c-file-style: "bsd"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ * vim:et:sts=4:sw=4
+ */
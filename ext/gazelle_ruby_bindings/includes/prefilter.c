@@ -0,0 +1,297 @@
+/*********************************************************************
+
+  Gazelle: a system for building fast, reusable parsers
+
+  prefilter.c
+
+  Fast rejection of input that cannot parse.  Much of what a
+  recognizer is asked about is garbage that fails within a few bytes,
+  and finding that out the usual way still means setting up a parse
+  state and descending the start rule.  Two facts about the grammar
+  let us say no sooner:
+
+  - the first byte of the input is lexed from the start state of the
+    IntFA that the start rule descends to, so a byte with no
+    transition there is an error straight away;
+
+  - a byte that no IntFA has a transition on can never be part of a
+    token, so the parse fails when it reaches one -- unless the start
+    rule has completed by then, which takes at least the length of the
+    shortest complete input.  (The parser stops at that point and
+    does not look at the rest of the buffer.)
+
+  The second check is a scan over the start of the input, done with
+  SSSE3 byte shuffles where the CPU has them.
+
+  This file is #included after parse.c and uses its internals.
+
+*********************************************************************/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gazelle/parse.h"
+
+#define BYTE_IN_SET(set, b) ((set)[(b) >> 3] & (1 << ((b) & 7)))
+#define ADD_BYTE(set, b) ((set)[(b) >> 3] |= (1 << ((b) & 7)))
+
+#define NO_LENGTH SIZE_MAX
+
+static
+size_t add_lengths(size_t a, size_t b)
+{
+    return (a == NO_LENGTH || b == NO_LENGTH || a + b < a) ? NO_LENGTH : a + b;
+}
+
+/*
+ * shortest_terminal(): the fewest bytes any IntFA can lex term from, where
+ * dists[i] holds each IntFA's distances from its start state.
+ */
+static
+size_t shortest_terminal(struct gzl_grammar *g, size_t **dists, char *term)
+{
+    size_t shortest = NO_LENGTH;
+    int i, j;
+    for(i = 0; i < g->num_intfas; i++)
+        for(j = 0; j < g->intfas[i].num_states; j++)
+            if(g->intfas[i].states[j].final == term && dists[i][j] < shortest)
+                shortest = dists[i][j];
+    return shortest;
+}
+
+static
+void intfa_distances(struct gzl_intfa *intfa, size_t *dist)
+{
+    int *queue = malloc((intfa->num_states + 1) * sizeof(int));
+    int head = 0, tail = 0, i;
+    for(i = 0; i < intfa->num_states; i++)
+        dist[i] = NO_LENGTH;
+    dist[0] = 0;
+    queue[tail++] = 0;
+    while(head < tail) {
+        struct gzl_intfa_state *state = &intfa->states[queue[head++]];
+        size_t d = dist[state - intfa->states];
+        for(i = 0; i < state->num_transitions; i++) {
+            int dest = state->transitions[i].dest_state - intfa->states;
+            if(dist[dest] == NO_LENGTH) {
+                dist[dest] = d + 1;
+                queue[tail++] = dest;
+            }
+        }
+    }
+    free(queue);
+}
+
+/*
+ * shortest_input(): the length of the shortest input that completes the
+ * start rule.  Each rule's shortest length is found by relaxing the edges of
+ * its RTN until nothing changes, and that is repeated for all rules until
+ * none of them get any shorter.
+ */
+static
+size_t shortest_input(struct gzl_grammar *g)
+{
+    size_t **intfa_dists = malloc((g->num_intfas + 1) * sizeof(*intfa_dists));
+    size_t *rule_len = malloc((g->num_rtns + 1) * sizeof(*rule_len));
+    int i, j;
+
+    for(i = 0; i < g->num_intfas; i++) {
+        intfa_dists[i] = malloc((g->intfas[i].num_states + 1) * sizeof(size_t));
+        intfa_distances(&g->intfas[i], intfa_dists[i]);
+    }
+
+    /* The cost of each RTN transition that consumes a terminal. */
+    size_t **term_len = malloc((g->num_rtns + 1) * sizeof(*term_len));
+    for(i = 0; i < g->num_rtns; i++) {
+        struct gzl_rtn *rtn = &g->rtns[i];
+        rule_len[i] = NO_LENGTH;
+        term_len[i] = malloc((rtn->num_transitions + 1) * sizeof(size_t));
+        for(j = 0; j < rtn->num_transitions; j++)
+            if(rtn->transitions[j].transition_type == GZL_TERMINAL_TRANSITION)
+                term_len[i][j] = shortest_terminal(
+                    g, intfa_dists, rtn->transitions[j].edge.terminal_name);
+    }
+
+    bool changed = true;
+    while(changed) {
+        changed = false;
+        for(i = 0; i < g->num_rtns; i++) {
+            struct gzl_rtn *rtn = &g->rtns[i];
+            size_t *dist = malloc((rtn->num_states + 1) * sizeof(size_t));
+            bool relaxed = true;
+            for(j = 0; j < rtn->num_states; j++)
+                dist[j] = NO_LENGTH;
+            dist[0] = 0;
+
+            while(relaxed) {
+                relaxed = false;
+                for(j = 0; j < rtn->num_transitions; j++) {
+                    struct gzl_rtn_transition *t = &rtn->transitions[j];
+                    int from = 0;
+                    while(!(t >= rtn->states[from].transitions &&
+                            t < rtn->states[from].transitions +
+                                rtn->states[from].num_transitions))
+                        from++;
+                    size_t cost = t->transition_type == GZL_TERMINAL_TRANSITION ?
+                        term_len[i][j] : rule_len[t->edge.nonterminal - g->rtns];
+                    size_t d = add_lengths(dist[from], cost);
+                    int dest = t->dest_state - rtn->states;
+                    if(d < dist[dest]) {
+                        dist[dest] = d;
+                        relaxed = true;
+                    }
+                }
+            }
+
+            for(j = 0; j < rtn->num_states; j++)
+                if(rtn->states[j].is_final && dist[j] < rule_len[i]) {
+                    rule_len[i] = dist[j];
+                    changed = true;
+                }
+            free(dist);
+        }
+    }
+
+    size_t shortest = g->num_rtns > 0 ? rule_len[0] : 0;
+    for(i = 0; i < g->num_intfas; i++)
+        free(intfa_dists[i]);
+    for(i = 0; i < g->num_rtns; i++)
+        free(term_len[i]);
+    free(intfa_dists);
+    free(term_len);
+    free(rule_len);
+    return shortest;
+}
+
+static
+struct gzl_prefilter *build_prefilter(struct gzl_grammar *g)
+{
+    struct gzl_prefilter *pf = calloc(1, sizeof(*pf));
+    int i, j, b;
+
+    for(i = 0; i < g->num_intfas; i++)
+        for(j = 0; j < g->intfas[i].num_transitions; j++) {
+            struct gzl_intfa_transition *t = &g->intfas[i].transitions[j];
+            for(b = 0; b < 256; b++)
+                if((char)b >= t->ch_low && (char)b <= t->ch_high)
+                    ADD_BYTE(pf->alphabet, b);
+        }
+
+    for(b = 0; b < 256; b++)
+        if(BYTE_IN_SET(pf->alphabet, b)) {
+            int k = b >> 7;
+            pf->alphabet_lo[k][b & 15] |= 1 << ((b >> 4) & 7);
+        }
+    for(b = 0; b < 16; b++)
+        pf->alphabet_hi[b >> 3][b] = 1 << (b & 7);
+
+    pf->min_input_len = shortest_input(g);
+    if(pf->min_input_len == NO_LENGTH)
+        pf->min_input_len = 0;  /* nothing parses; leave it to the parser */
+
+    /* The first byte goes to the IntFA on top of the initial stack.  If there
+     * is no initial stack, or the start state is final (so a token could end
+     * before the first byte), any byte might do. */
+    if(!g->initial_stack)
+        build_initial_stack(g);
+    struct gzl_parse_stack_frame *top = g->initial_stack_len > 0 ?
+        &g->initial_stack[g->initial_stack_len - 1] : NULL;
+    struct gzl_intfa_state *start = NULL;
+    if(top && top->frame_type == GZL_FRAME_TYPE_INTFA && pf->min_input_len > 0)
+        start = &g->intfas[top->f.intfa_frame.intfa].states[
+            top->f.intfa_frame.intfa_state];
+
+    if(start && !start->final) {
+        for(b = 0; b < 256; b++)
+            if(find_intfa_transition(start, (char)b))
+                ADD_BYTE(pf->first_bytes, b);
+    } else {
+        memset(pf->first_bytes, 0xff, sizeof(pf->first_bytes));
+    }
+
+    return pf;
+}
+
+/*
+ * Scanning for a byte outside the alphabet.  Each returns the offset of the
+ * first one in p[0..len), or len.
+ */
+
+static
+size_t scan_alphabet(struct gzl_prefilter *pf, const unsigned char *p, size_t len)
+{
+    size_t i;
+    for(i = 0; i < len; i++)
+        if(!BYTE_IN_SET(pf->alphabet, p[i]))
+            return i;
+    return len;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define GZL_HAVE_SSSE3_SCAN 1
+#include <tmmintrin.h>
+
+/* Sixteen bytes at a time: two shuffles look up each byte's low nibble (which
+ * bits of the high nibble are allowed with it) and two its high nibble (which
+ * bit that is), one pair for each half of the byte range. */
+__attribute__((target("ssse3")))
+static
+size_t scan_alphabet_ssse3(struct gzl_prefilter *pf, const unsigned char *p,
+                           size_t len)
+{
+    const __m128i low_nibble = _mm_set1_epi8(0x0f);
+    const __m128i lo0 = _mm_loadu_si128((const __m128i*)pf->alphabet_lo[0]);
+    const __m128i lo1 = _mm_loadu_si128((const __m128i*)pf->alphabet_lo[1]);
+    const __m128i hi0 = _mm_loadu_si128((const __m128i*)pf->alphabet_hi[0]);
+    const __m128i hi1 = _mm_loadu_si128((const __m128i*)pf->alphabet_hi[1]);
+    size_t i;
+
+    for(i = 0; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+        __m128i lo = _mm_and_si128(v, low_nibble);
+        __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), low_nibble);
+        __m128i in = _mm_or_si128(
+            _mm_and_si128(_mm_shuffle_epi8(lo0, lo), _mm_shuffle_epi8(hi0, hi)),
+            _mm_and_si128(_mm_shuffle_epi8(lo1, lo), _mm_shuffle_epi8(hi1, hi)));
+        int outside = _mm_movemask_epi8(_mm_cmpeq_epi8(in, _mm_setzero_si128()));
+        if(outside)
+            return i + __builtin_ctz(outside);
+    }
+    return i + scan_alphabet(pf, p + i, len - i);
+}
+#endif
+
+bool gzl_prefilter_rejects(struct gzl_grammar *g, const char *buf,
+                           size_t buf_len)
+{
+    const unsigned char *p = (const unsigned char*)buf;
+    if(!g->prefilter)
+        g->prefilter = build_prefilter(g);
+    struct gzl_prefilter *pf = g->prefilter;
+
+    if(buf_len == 0)
+        return false;
+    if(!BYTE_IN_SET(pf->first_bytes, p[0]))
+        return true;
+
+    size_t len = buf_len < pf->min_input_len ? buf_len : pf->min_input_len;
+#ifdef GZL_HAVE_SSSE3_SCAN
+    if(len >= 16 && __builtin_cpu_supports("ssse3"))
+        return scan_alphabet_ssse3(pf, p, len) < len;
+#endif
+    return scan_alphabet(pf, p, len) < len;
+}
+
+#undef BYTE_IN_SET
+#undef ADD_BYTE
+#undef NO_LENGTH
+
+/*
+ * Local Variables:
+ * c-file-style: "bsd"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ * vim:et:sts=4:sw=4
+ */
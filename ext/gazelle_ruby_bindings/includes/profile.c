@@ -0,0 +1,516 @@
+/*********************************************************************
+
+  Gazelle: a system for building fast, reusable parsers
+
+  profile.c
+
+  Profile-guided layout.  The interpreter finds transitions by
+  scanning a state's transition list in order, so a grammar whose
+  hot transitions come first is cheaper to run.
+
+  While g->profile is set, parse.c counts how often each IntFA, GLA
+  and RTN transition is taken.  gzl_write_profile() saves the counts,
+  and gzl_apply_profile() later uses them to lay out a freshly loaded
+  copy of the same grammar: within each state, transitions are sorted
+  hottest first, and the states of every machine are renumbered in
+  breadth-first order from the start state (following hot transitions
+  first), with their transitions packed in that same order.  The
+  grammar recognizes exactly the same language afterwards.
+
+  Counts are indexed by the order transitions have in the bitcode, so
+  a profile must be gathered on a grammar that was loaded without
+  one.
+
+*********************************************************************/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gazelle/grammar.h"
+
+#define GZL_PROFILE_MAGIC "gazelle-profile"
+#define GZL_PROFILE_VERSION 1
+
+/*
+ * Allocating and freeing counters.
+ */
+
+static
+uint64_t **alloc_hits(int num_machines, int *num_transitions)
+{
+    uint64_t **hits = malloc((num_machines + 1) * sizeof(*hits));
+    int i;
+    for(i = 0; i < num_machines; i++)
+        hits[i] = calloc(num_transitions[i] + 1, sizeof(**hits));
+    return hits;
+}
+
+static
+void free_hits(uint64_t **hits, int num_machines)
+{
+    int i;
+    if(!hits) return;
+    for(i = 0; i < num_machines; i++)
+        free(hits[i]);
+    free(hits);
+}
+
+struct gzl_profile *gzl_alloc_profile(struct gzl_grammar *g)
+{
+    struct gzl_profile *p = malloc(sizeof(*p));
+    int max = g->num_intfas;
+    int i;
+    if(g->num_glas > max) max = g->num_glas;
+    if(g->num_rtns > max) max = g->num_rtns;
+
+    int *sizes = malloc((max + 1) * sizeof(*sizes));
+
+    for(i = 0; i < g->num_intfas; i++) sizes[i] = g->intfas[i].num_transitions;
+    p->intfa_hits = alloc_hits(g->num_intfas, sizes);
+    for(i = 0; i < g->num_glas; i++) sizes[i] = g->glas[i].num_transitions;
+    p->gla_hits = alloc_hits(g->num_glas, sizes);
+    for(i = 0; i < g->num_rtns; i++) sizes[i] = g->rtns[i].num_transitions;
+    p->rtn_hits = alloc_hits(g->num_rtns, sizes);
+
+    free(sizes);
+    return p;
+}
+
+void gzl_free_profile(struct gzl_grammar *g, struct gzl_profile *p)
+{
+    if(!p) return;
+    free_hits(p->intfa_hits, g->num_intfas);
+    free_hits(p->gla_hits, g->num_glas);
+    free_hits(p->rtn_hits, g->num_rtns);
+    free(p);
+}
+
+/*
+ * The profile file.  It is plain text:
+ *
+ *   gazelle-profile 1
+ *   intfas <count>
+ *   <num transitions> <hits> <hits> ...     (one line per IntFA)
+ *   glas <count>
+ *   ...
+ *   rtns <count>
+ *   ...
+ *
+ * The machine and transition counts let us refuse a profile that was taken
+ * with a different grammar.
+ */
+
+static
+void write_hits(FILE *out, const char *kind, uint64_t **hits, int num_machines,
+                int (*num_transitions)(struct gzl_grammar *g, int i),
+                struct gzl_grammar *g)
+{
+    int i, j;
+    fprintf(out, "%s %d\n", kind, num_machines);
+    for(i = 0; i < num_machines; i++) {
+        int n = num_transitions(g, i);
+        fprintf(out, "%d", n);
+        for(j = 0; j < n; j++)
+            fprintf(out, " %llu", (unsigned long long)hits[i][j]);
+        fprintf(out, "\n");
+    }
+}
+
+static int intfa_num_transitions(struct gzl_grammar *g, int i) { return g->intfas[i].num_transitions; }
+static int gla_num_transitions(struct gzl_grammar *g, int i)   { return g->glas[i].num_transitions; }
+static int rtn_num_transitions(struct gzl_grammar *g, int i)   { return g->rtns[i].num_transitions; }
+
+void gzl_write_profile(struct gzl_grammar *g, struct gzl_profile *p, FILE *out)
+{
+    fprintf(out, "%s %d\n", GZL_PROFILE_MAGIC, GZL_PROFILE_VERSION);
+    write_hits(out, "intfas", p->intfa_hits, g->num_intfas, intfa_num_transitions, g);
+    write_hits(out, "glas", p->gla_hits, g->num_glas, gla_num_transitions, g);
+    write_hits(out, "rtns", p->rtn_hits, g->num_rtns, rtn_num_transitions, g);
+}
+
+static
+bool read_hits(FILE *in, const char *kind, uint64_t **hits, int num_machines,
+               int (*num_transitions)(struct gzl_grammar *g, int i),
+               struct gzl_grammar *g)
+{
+    char word[16];
+    int i, j, n;
+    if(fscanf(in, "%15s %d", word, &n) != 2 || strcmp(word, kind) != 0 ||
+       n != num_machines)
+        return false;
+    for(i = 0; i < num_machines; i++) {
+        if(fscanf(in, "%d", &n) != 1 || n != num_transitions(g, i))
+            return false;
+        for(j = 0; j < n; j++) {
+            unsigned long long count;
+            if(fscanf(in, "%llu", &count) != 1)
+                return false;
+            hits[i][j] = count;
+        }
+    }
+    return true;
+}
+
+/*
+ * Layout.  The three kinds of machine share the same shape -- states, each
+ * with a contiguous run of transitions that lead to other states of the same
+ * machine -- so the new order is planned on that shape and then applied by
+ * machine-specific code.
+ */
+
+struct machine_shape {
+    int num_states;
+    int *first;       /* [state] index of the state's first transition */
+    int *count;       /* [state] number of transitions */
+    bool *sortable;   /* [state] may its transitions be reordered? */
+    int *dest;        /* [transition] destination state */
+    uint64_t *hits;   /* [transition] */
+};
+
+struct machine_layout {
+    int *state_order;       /* [new state] old state */
+    int *new_state;         /* [old state] new state */
+    int *transition_order;  /* [new transition] old transition */
+    int *new_first;         /* [new state] index of its first transition */
+};
+
+static
+void alloc_shape(struct machine_shape *m, int num_states, int num_transitions)
+{
+    m->num_states = num_states;
+    m->first = malloc((num_states + 1) * sizeof(*m->first));
+    m->count = malloc((num_states + 1) * sizeof(*m->count));
+    m->sortable = malloc((num_states + 1) * sizeof(*m->sortable));
+    m->dest = malloc((num_transitions + 1) * sizeof(*m->dest));
+}
+
+static
+void free_shape(struct machine_shape *m)
+{
+    free(m->first);
+    free(m->count);
+    free(m->sortable);
+    free(m->dest);
+}
+
+static
+void free_layout(struct machine_layout *l)
+{
+    free(l->state_order);
+    free(l->new_state);
+    free(l->transition_order);
+    free(l->new_first);
+}
+
+/*
+ * state_transition_order(): writes the indices of state's transitions to
+ * out, hottest first if the state is sortable (a stable insertion sort --
+ * these lists are short).
+ */
+static
+void state_transition_order(struct machine_shape *m, int state, int *out)
+{
+    int i, j;
+    for(i = 0; i < m->count[state]; i++) {
+        int t = m->first[state] + i;
+        for(j = i; j > 0 && m->sortable[state] &&
+                   m->hits[out[j-1]] < m->hits[t]; j--)
+            out[j] = out[j-1];
+        out[j] = t;
+    }
+}
+
+static
+void plan_layout(struct machine_shape *m, int num_transitions,
+                 struct machine_layout *l)
+{
+    int n = m->num_states;
+    int head = 0, tail = 0, next_transition = 0;
+    int i, j;
+
+    l->state_order = malloc((n + 1) * sizeof(int));
+    l->new_state = malloc((n + 1) * sizeof(int));
+    l->transition_order = malloc((num_transitions + 1) * sizeof(int));
+    l->new_first = malloc((n + 1) * sizeof(int));
+    for(i = 0; i < n; i++)
+        l->new_state[i] = -1;
+
+    /* Breadth-first from the start state, following hot transitions first.
+     * States we can't reach go at the end, in their old order. */
+    i = 0;
+    while(tail < n) {
+        if(head == tail) {
+            while(l->new_state[i] != -1) i++;
+            l->new_state[i] = tail;
+            l->state_order[tail++] = i;
+        }
+        int state = l->state_order[head];
+        int *order = &l->transition_order[next_transition];
+        state_transition_order(m, state, order);
+        l->new_first[head] = next_transition;
+        next_transition += m->count[state];
+        head++;
+
+        for(j = 0; j < m->count[state]; j++) {
+            int dest = m->dest[order[j]];
+            if(l->new_state[dest] == -1) {
+                l->new_state[dest] = tail;
+                l->state_order[tail++] = dest;
+            }
+        }
+    }
+
+    /* The states still in the queue have not had their transitions laid out
+     * yet. */
+    for(; head < n; head++) {
+        int state = l->state_order[head];
+        state_transition_order(m, state, &l->transition_order[next_transition]);
+        l->new_first[head] = next_transition;
+        next_transition += m->count[state];
+    }
+}
+
+static
+void layout_intfa(struct gzl_intfa *intfa, uint64_t *hits)
+{
+    struct machine_shape m;
+    struct machine_layout l;
+    int i, j, k;
+
+    alloc_shape(&m, intfa->num_states, intfa->num_transitions);
+    m.hits = hits;
+    for(i = 0; i < intfa->num_states; i++) {
+        struct gzl_intfa_state *state = &intfa->states[i];
+        m.first[i] = state->transitions - intfa->transitions;
+        m.count[i] = state->num_transitions;
+
+        /* find_intfa_transition() takes the first matching range, so only
+         * states whose ranges don't overlap can be reordered. */
+        m.sortable[i] = true;
+        for(j = 0; j < state->num_transitions; j++)
+            for(k = j + 1; k < state->num_transitions; k++)
+                if(state->transitions[j].ch_low <= state->transitions[k].ch_high &&
+                   state->transitions[k].ch_low <= state->transitions[j].ch_high)
+                    m.sortable[i] = false;
+    }
+    for(i = 0; i < intfa->num_transitions; i++)
+        m.dest[i] = intfa->transitions[i].dest_state - intfa->states;
+
+    plan_layout(&m, intfa->num_transitions, &l);
+
+    struct gzl_intfa_state *old_states =
+        malloc((intfa->num_states + 1) * sizeof(*old_states));
+    struct gzl_intfa_transition *old_transitions =
+        malloc((intfa->num_transitions + 1) * sizeof(*old_transitions));
+    memcpy(old_states, intfa->states, intfa->num_states * sizeof(*old_states));
+    memcpy(old_transitions, intfa->transitions,
+           intfa->num_transitions * sizeof(*old_transitions));
+
+    for(i = 0; i < intfa->num_states; i++) {
+        intfa->states[i] = old_states[l.state_order[i]];
+        intfa->states[i].transitions = &intfa->transitions[l.new_first[i]];
+    }
+    for(i = 0; i < intfa->num_transitions; i++) {
+        intfa->transitions[i] = old_transitions[l.transition_order[i]];
+        intfa->transitions[i].dest_state =
+            &intfa->states[l.new_state[m.dest[l.transition_order[i]]]];
+    }
+
+    free(old_states);
+    free(old_transitions);
+    free_layout(&l);
+    free_shape(&m);
+}
+
+static
+void layout_gla(struct gzl_gla *gla, uint64_t *hits)
+{
+    struct machine_shape m;
+    struct machine_layout l;
+    int i, j, k;
+
+    alloc_shape(&m, gla->num_states, gla->num_transitions);
+    m.hits = hits;
+    for(i = 0; i < gla->num_states; i++) {
+        struct gzl_gla_state *state = &gla->states[i];
+        m.first[i] = 0;
+        m.count[i] = 0;
+        m.sortable[i] = true;
+        if(state->is_final)
+            continue;
+        m.first[i] = state->d.nonfinal.transitions - gla->transitions;
+        m.count[i] = state->d.nonfinal.num_transitions;
+        for(j = 0; j < m.count[i]; j++)
+            for(k = j + 1; k < m.count[i]; k++)
+                if(state->d.nonfinal.transitions[j].term ==
+                   state->d.nonfinal.transitions[k].term)
+                    m.sortable[i] = false;
+    }
+    for(i = 0; i < gla->num_transitions; i++)
+        m.dest[i] = gla->transitions[i].dest_state - gla->states;
+
+    plan_layout(&m, gla->num_transitions, &l);
+
+    struct gzl_gla_state *old_states =
+        malloc((gla->num_states + 1) * sizeof(*old_states));
+    struct gzl_gla_transition *old_transitions =
+        malloc((gla->num_transitions + 1) * sizeof(*old_transitions));
+    memcpy(old_states, gla->states, gla->num_states * sizeof(*old_states));
+    memcpy(old_transitions, gla->transitions,
+           gla->num_transitions * sizeof(*old_transitions));
+
+    for(i = 0; i < gla->num_states; i++) {
+        gla->states[i] = old_states[l.state_order[i]];
+        if(!gla->states[i].is_final)
+            gla->states[i].d.nonfinal.transitions =
+                &gla->transitions[l.new_first[i]];
+    }
+    for(i = 0; i < gla->num_transitions; i++) {
+        gla->transitions[i] = old_transitions[l.transition_order[i]];
+        gla->transitions[i].dest_state =
+            &gla->states[l.new_state[m.dest[l.transition_order[i]]]];
+    }
+
+    free(old_states);
+    free(old_transitions);
+    free_layout(&l);
+    free_shape(&m);
+}
+
+/*
+ * renumber_gla_offsets(): a final GLA state names the RTN transition to take
+ * by its (1-based) position in the RTN state's transition list, so when that
+ * list is reordered the GLA has to follow.  new_position maps old positions
+ * (0-based) to new ones.
+ */
+static
+void renumber_gla_offsets(struct gzl_gla *gla, int *new_position)
+{
+    int i;
+    for(i = 0; i < gla->num_states; i++) {
+        struct gzl_gla_state *state = &gla->states[i];
+        if(state->is_final && state->d.final.transition_offset > 0)
+            state->d.final.transition_offset =
+                new_position[state->d.final.transition_offset - 1] + 1;
+    }
+}
+
+static
+void layout_rtn(struct gzl_grammar *g, struct gzl_rtn *rtn, uint64_t *hits,
+                int *gla_refs)
+{
+    struct machine_shape m;
+    struct machine_layout l;
+    int i, j, k;
+
+    alloc_shape(&m, rtn->num_states, rtn->num_transitions);
+    m.hits = hits;
+    for(i = 0; i < rtn->num_states; i++) {
+        struct gzl_rtn_state *state = &rtn->states[i];
+        m.first[i] = state->transitions - rtn->transitions;
+        m.count[i] = state->num_transitions;
+
+        /* If a GLA picks among this state's transitions, reordering them
+         * means renumbering the GLA, which we can only do if no other state
+         * uses it. */
+        m.sortable[i] = state->lookahead_type != GZL_STATE_HAS_GLA ||
+                        gla_refs[state->d.state_gla - g->glas] == 1;
+        for(j = 0; j < state->num_transitions; j++)
+            for(k = j + 1; k < state->num_transitions; k++)
+                if(state->transitions[j].transition_type == GZL_TERMINAL_TRANSITION &&
+                   state->transitions[k].transition_type == GZL_TERMINAL_TRANSITION &&
+                   state->transitions[j].edge.terminal_name ==
+                   state->transitions[k].edge.terminal_name)
+                    m.sortable[i] = false;
+    }
+    for(i = 0; i < rtn->num_transitions; i++)
+        m.dest[i] = rtn->transitions[i].dest_state - rtn->states;
+
+    plan_layout(&m, rtn->num_transitions, &l);
+
+    struct gzl_rtn_state *old_states =
+        malloc((rtn->num_states + 1) * sizeof(*old_states));
+    struct gzl_rtn_transition *old_transitions =
+        malloc((rtn->num_transitions + 1) * sizeof(*old_transitions));
+    int *new_position = malloc((rtn->num_transitions + 1) * sizeof(int));
+    memcpy(old_states, rtn->states, rtn->num_states * sizeof(*old_states));
+    memcpy(old_transitions, rtn->transitions,
+           rtn->num_transitions * sizeof(*old_transitions));
+
+    for(i = 0; i < rtn->num_states; i++) {
+        struct gzl_rtn_state *state = &rtn->states[i];
+        int old = l.state_order[i];
+        *state = old_states[old];
+        state->transitions = &rtn->transitions[l.new_first[i]];
+
+        if(state->lookahead_type == GZL_STATE_HAS_GLA && m.sortable[old]) {
+            for(j = 0; j < state->num_transitions; j++)
+                new_position[l.transition_order[l.new_first[i] + j] - m.first[old]] = j;
+            renumber_gla_offsets(state->d.state_gla, new_position);
+        }
+    }
+    for(i = 0; i < rtn->num_transitions; i++) {
+        rtn->transitions[i] = old_transitions[l.transition_order[i]];
+        rtn->transitions[i].dest_state =
+            &rtn->states[l.new_state[m.dest[l.transition_order[i]]]];
+    }
+
+    free(new_position);
+    free(old_states);
+    free(old_transitions);
+    free_layout(&l);
+    free_shape(&m);
+}
+
+bool gzl_apply_profile(struct gzl_grammar *g, FILE *in)
+{
+    char magic[32];
+    int version, i, j;
+    bool ok;
+
+    if(fscanf(in, "%31s %d", magic, &version) != 2 ||
+       strcmp(magic, GZL_PROFILE_MAGIC) != 0 || version != GZL_PROFILE_VERSION)
+        return false;
+
+    struct gzl_profile *p = gzl_alloc_profile(g);
+    ok = read_hits(in, "intfas", p->intfa_hits, g->num_intfas, intfa_num_transitions, g) &&
+         read_hits(in, "glas", p->gla_hits, g->num_glas, gla_num_transitions, g) &&
+         read_hits(in, "rtns", p->rtn_hits, g->num_rtns, rtn_num_transitions, g);
+
+    if(ok) {
+        int *gla_refs = calloc(g->num_glas + 1, sizeof(int));
+        for(i = 0; i < g->num_rtns; i++)
+            for(j = 0; j < g->rtns[i].num_states; j++)
+                if(g->rtns[i].states[j].lookahead_type == GZL_STATE_HAS_GLA)
+                    gla_refs[g->rtns[i].states[j].d.state_gla - g->glas]++;
+
+        for(i = 0; i < g->num_intfas; i++)
+            layout_intfa(&g->intfas[i], p->intfa_hits[i]);
+        for(i = 0; i < g->num_glas; i++)
+            layout_gla(&g->glas[i], p->gla_hits[i]);
+        for(i = 0; i < g->num_rtns; i++)
+            layout_rtn(g, &g->rtns[i], p->rtn_hits[i], gla_refs);
+        free(gla_refs);
+
+        /* Anything built from the old layout is stale. */
+        free(g->initial_stack);
+        g->initial_stack = NULL;
+        g->initial_stack_len = 0;
+        free(g->bytecode);
+        g->bytecode = NULL;
+    }
+
+    gzl_free_profile(g, p);
+    return ok;
+}
+
+/*
+ * Local Variables:
+ * c-file-style: "bsd"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ * vim:et:sts=4:sw=4
+ */
@@ -0,0 +1,348 @@
+/*********************************************************************
+
+  Gazelle: a system for building fast, reusable parsers
+
+  serialize.c
+
+  Saving a parse state so that the parse can be picked up again
+  later, by another process.  A state refers to the grammar only by
+  index (stack frames) and by interned string (buffered terminals),
+  so it is written out as those indices, with the terminal names
+  written as indices into g->strings.  The format is text, like a
+  profile's:
+
+    gazelle-parse-state 1
+    grammar <fingerprint>
+    offset <byte> <line> <column>
+    open_terminal <byte> <last char was newline>
+    stack <n>
+    rtn <start> <rtn> <state> <transition, or -1>
+    gla <start> <gla> <state>
+    intfa <start> <intfa> <state>
+    ...
+    tokens <n>
+    <string> <start> <len>
+    ...
+
+  The fingerprint is a hash of the grammar's machines as laid out in
+  memory, so a state only loads into the grammar it was saved from:
+  the same bitcode, laid out by the same profile and optimized or not
+  in the same way.
+
+  This file is #included after parse.c and uses its internals.
+
+*********************************************************************/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gazelle/parse.h"
+
+#define GZL_STATE_MAGIC "gazelle-parse-state"
+#define GZL_STATE_VERSION 1
+
+/*
+ * The grammar's fingerprint: 64-bit FNV-1a over every state and transition,
+ * with pointers replaced by indices and strings by their contents.
+ */
+
+static
+uint64_t hash_bytes(uint64_t h, const void *p, size_t len)
+{
+    const unsigned char *bytes = p;
+    size_t i;
+    for(i = 0; i < len; i++) {
+        h ^= bytes[i];
+        h *= UINT64_C(1099511628211);
+    }
+    return h;
+}
+
+static
+uint64_t hash_int(uint64_t h, long long x)
+{
+    return hash_bytes(h, &x, sizeof(x));
+}
+
+static
+uint64_t hash_string(uint64_t h, const char *str)
+{
+    return str ? hash_bytes(h, str, strlen(str) + 1) : hash_int(h, -1);
+}
+
+static
+uint64_t grammar_fingerprint(struct gzl_grammar *g)
+{
+    uint64_t h = UINT64_C(14695981039346656037);
+    int i, j;
+
+    h = hash_int(h, g->num_intfas);
+    for(i = 0; i < g->num_intfas; i++) {
+        struct gzl_intfa *intfa = &g->intfas[i];
+        h = hash_int(h, intfa->num_states);
+        for(j = 0; j < intfa->num_states; j++) {
+            struct gzl_intfa_state *state = &intfa->states[j];
+            h = hash_string(h, state->final);
+            h = hash_int(h, state->transitions - intfa->transitions);
+            h = hash_int(h, state->num_transitions);
+        }
+        h = hash_int(h, intfa->num_transitions);
+        for(j = 0; j < intfa->num_transitions; j++) {
+            struct gzl_intfa_transition *t = &intfa->transitions[j];
+            h = hash_int(h, t->ch_low);
+            h = hash_int(h, t->ch_high);
+            h = hash_int(h, t->dest_state - intfa->states);
+        }
+    }
+
+    h = hash_int(h, g->num_glas);
+    for(i = 0; i < g->num_glas; i++) {
+        struct gzl_gla *gla = &g->glas[i];
+        h = hash_int(h, gla->num_states);
+        for(j = 0; j < gla->num_states; j++) {
+            struct gzl_gla_state *state = &gla->states[j];
+            h = hash_int(h, state->is_final);
+            if(state->is_final) {
+                h = hash_int(h, state->d.final.transition_offset);
+            } else {
+                h = hash_int(h, state->d.nonfinal.intfa - g->intfas);
+                h = hash_int(h, state->d.nonfinal.transitions - gla->transitions);
+                h = hash_int(h, state->d.nonfinal.num_transitions);
+            }
+        }
+        h = hash_int(h, gla->num_transitions);
+        for(j = 0; j < gla->num_transitions; j++) {
+            h = hash_string(h, gla->transitions[j].term);
+            h = hash_int(h, gla->transitions[j].dest_state - gla->states);
+        }
+    }
+
+    h = hash_int(h, g->num_rtns);
+    for(i = 0; i < g->num_rtns; i++) {
+        struct gzl_rtn *rtn = &g->rtns[i];
+        h = hash_string(h, rtn->name);
+        h = hash_int(h, rtn->num_states);
+        for(j = 0; j < rtn->num_states; j++) {
+            struct gzl_rtn_state *state = &rtn->states[j];
+            h = hash_int(h, state->is_final);
+            h = hash_int(h, state->lookahead_type);
+            if(state->lookahead_type == GZL_STATE_HAS_INTFA)
+                h = hash_int(h, state->d.state_intfa - g->intfas);
+            else if(state->lookahead_type == GZL_STATE_HAS_GLA)
+                h = hash_int(h, state->d.state_gla - g->glas);
+            h = hash_int(h, state->transitions - rtn->transitions);
+            h = hash_int(h, state->num_transitions);
+        }
+        h = hash_int(h, rtn->num_transitions);
+        for(j = 0; j < rtn->num_transitions; j++) {
+            struct gzl_rtn_transition *t = &rtn->transitions[j];
+            h = hash_int(h, t->transition_type);
+            if(t->transition_type == GZL_TERMINAL_TRANSITION)
+                h = hash_string(h, t->edge.terminal_name);
+            else
+                h = hash_int(h, t->edge.nonterminal - g->rtns);
+            h = hash_int(h, t->dest_state - rtn->states);
+        }
+    }
+
+    return h;
+}
+
+/*
+ * interned_string_index(): the index in g->strings of a terminal name, or -1
+ * for none.
+ */
+static
+long interned_string_index(struct gzl_grammar *g, char *str)
+{
+    long i;
+    if(!str) return -1;
+    for(i = 0; g->strings[i]; i++)
+        if(g->strings[i] == str)
+            return i;
+    return -1;
+}
+
+static
+long num_strings(struct gzl_grammar *g)
+{
+    long n = 0;
+    while(g->strings[n]) n++;
+    return n;
+}
+
+/*
+ * Reading frames back in, checking every index against the grammar.
+ */
+
+static
+bool read_frame(FILE *in, struct gzl_grammar *g,
+                struct gzl_parse_stack_frame *frame)
+{
+    char kind[8];
+    size_t start;
+    long machine, state, transition;
+
+    if(fscanf(in, "%7s %zu %ld %ld", kind, &start, &machine, &state) != 4 ||
+       machine < 0 || state < 0)
+        return false;
+    frame->start_byte = start;
+
+    if(strcmp(kind, "rtn") == 0) {
+        if(fscanf(in, "%ld", &transition) != 1 || machine >= g->num_rtns ||
+           state >= g->rtns[machine].num_states ||
+           transition < -1 || transition >= g->rtns[machine].num_transitions)
+            return false;
+        frame->frame_type = GZL_FRAME_TYPE_RTN;
+        frame->f.rtn_frame.rtn = machine;
+        frame->f.rtn_frame.rtn_state = state;
+        frame->f.rtn_frame.rtn_transition =
+            transition == -1 ? GZL_NO_TRANSITION : (uint32_t)transition;
+    } else if(strcmp(kind, "gla") == 0) {
+        if(machine >= g->num_glas || state >= g->glas[machine].num_states)
+            return false;
+        frame->frame_type = GZL_FRAME_TYPE_GLA;
+        frame->f.gla_frame.gla = machine;
+        frame->f.gla_frame.gla_state = state;
+    } else if(strcmp(kind, "intfa") == 0) {
+        if(machine >= g->num_intfas || state >= g->intfas[machine].num_states)
+            return false;
+        frame->frame_type = GZL_FRAME_TYPE_INTFA;
+        frame->f.intfa_frame.intfa = machine;
+        frame->f.intfa_frame.intfa_state = state;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static
+bool read_parse_state(FILE *in, struct gzl_parse_state *s)
+{
+    struct gzl_grammar *g = gzl_state_grammar(s);
+    char magic[32];
+    int version, newline;
+    unsigned long long fingerprint;
+    size_t n, i;
+
+    if(fscanf(in, "%31s %d", magic, &version) != 2 ||
+       strcmp(magic, GZL_STATE_MAGIC) != 0 || version != GZL_STATE_VERSION)
+        return false;
+    if(fscanf(in, " grammar %llx", &fingerprint) != 1 ||
+       fingerprint != grammar_fingerprint(g))
+        return false;
+    if(fscanf(in, " offset %zu %zu %zu", &s->offset.byte, &s->offset.line,
+              &s->offset.column) != 3 ||
+       fscanf(in, " open_terminal %zu %d", &s->open_terminal_offset,
+              &newline) != 2)
+        return false;
+    s->last_char_was_newline = newline;
+
+    if(fscanf(in, " stack %zu", &n) != 1 || n > s->max_stack_depth)
+        return false;
+    reserve_parse_stack(s, n);
+    for(i = 0; i < n; i++)
+        if(!read_frame(in, g, &s->parse_stack[i]))
+            return false;
+    s->parse_stack_len = n;
+
+    long strings = num_strings(g);
+    if(fscanf(in, " tokens %zu", &n) != 1 || n > s->max_lookahead)
+        return false;
+    while(s->token_buffer_size < n)
+        reserve_token_buffer(s, s->token_buffer_size * 2);
+    for(i = 0; i < n; i++) {
+        struct gzl_terminal *term = push_token(s);
+        long name;
+        if(fscanf(in, "%ld %zu %zu", &name, &term->start_byte, &term->len) != 3 ||
+           name < -1 || name >= strings)
+            return false;
+        term->name = name == -1 ? NULL : g->strings[name];
+    }
+
+    return true;
+}
+
+/*
+ * The rest of this file is the publicly-exposed API, documented in the
+ * header file.
+ */
+
+bool gzl_serialize_parse_state(struct gzl_parse_state *s, FILE *out)
+{
+    struct gzl_grammar *g = gzl_state_grammar(s);
+    size_t i;
+
+    fprintf(out, "%s %d\n", GZL_STATE_MAGIC, GZL_STATE_VERSION);
+    fprintf(out, "grammar %016llx\n",
+            (unsigned long long)grammar_fingerprint(g));
+    fprintf(out, "offset %zu %zu %zu\n", s->offset.byte, s->offset.line,
+            s->offset.column);
+    fprintf(out, "open_terminal %zu %d\n", s->open_terminal_offset,
+            s->last_char_was_newline);
+
+    fprintf(out, "stack %zu\n", s->parse_stack_len);
+    for(i = 0; i < s->parse_stack_len; i++) {
+        struct gzl_parse_stack_frame *frame = &s->parse_stack[i];
+        switch(frame->frame_type) {
+          case GZL_FRAME_TYPE_RTN:
+            fprintf(out, "rtn %zu %u %u %ld\n", frame->start_byte,
+                    frame->f.rtn_frame.rtn, frame->f.rtn_frame.rtn_state,
+                    frame->f.rtn_frame.rtn_transition == GZL_NO_TRANSITION ?
+                        -1L : (long)frame->f.rtn_frame.rtn_transition);
+            break;
+          case GZL_FRAME_TYPE_GLA:
+            fprintf(out, "gla %zu %u %u\n", frame->start_byte,
+                    frame->f.gla_frame.gla, frame->f.gla_frame.gla_state);
+            break;
+          case GZL_FRAME_TYPE_INTFA:
+            fprintf(out, "intfa %zu %u %u\n", frame->start_byte,
+                    frame->f.intfa_frame.intfa,
+                    frame->f.intfa_frame.intfa_state);
+            break;
+        }
+    }
+
+    fprintf(out, "tokens %zu\n", s->token_buffer_len);
+    for(i = 0; i < s->token_buffer_len; i++) {
+        struct gzl_terminal *term = gzl_token(s, i);
+        fprintf(out, "%ld %zu %zu\n", interned_string_index(g, term->name),
+                term->start_byte, term->len);
+    }
+
+    return !ferror(out);
+}
+
+bool gzl_deserialize_parse_state(struct gzl_parse_state *s, FILE *in)
+{
+    /* Read into a scratch state, so that s is untouched if anything is
+     * wrong. */
+    struct gzl_parse_state *read = gzl_alloc_parse_state();
+    gzl_init_parse_state(read, s->bound_grammar);
+    read->max_stack_depth = s->max_stack_depth;
+    read->max_lookahead = s->max_lookahead;
+
+    bool ok = read_parse_state(in, read);
+    if(ok) {
+        struct gzl_parse_state old = *s;
+        *s = *read;
+        s->user_data = old.user_data;
+        *read = old;
+    }
+    gzl_free_parse_state(read);
+    return ok;
+}
+
+#undef GZL_STATE_MAGIC
+#undef GZL_STATE_VERSION
+
+/*
+ * Local Variables:
+ * c-file-style: "bsd"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ * vim:et:sts=4:sw=4
+ */
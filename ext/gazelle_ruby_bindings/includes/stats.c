@@ -0,0 +1,103 @@
+/*********************************************************************
+
+  Gazelle: a system for building fast, reusable parsers
+
+  stats.c
+
+  Counting what a parse sees: how many times each rule ends and each
+  terminal is matched, and how many bytes of input they cover between
+  them.  The counts are kept by a pair of callbacks, so a caller who
+  only wants totals never sees the parse event by event.
+
+  Rules are counted by RTN index.  Terminals have no index of their
+  own, but their names all point into the grammar's string table, so
+  they are counted in a small open-addressed table keyed on the
+  address of the name.
+
+*********************************************************************/
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "gazelle/parse.h"
+
+static
+size_t terminal_slot(struct gzl_parse_stats *stats, char *name)
+{
+    size_t slot = ((uintptr_t)name >> 4) & stats->terminals_mask;
+    while(stats->terminals[slot].name && stats->terminals[slot].name != name)
+        slot = (slot + 1) & stats->terminals_mask;
+    return slot;
+}
+
+static
+void add_to_stat(struct gzl_stat *stat, size_t start, size_t end)
+{
+    stat->count++;
+    stat->bytes += end - start;
+}
+
+/*
+ * The rest of this file is the publicly-exposed API, documented in the
+ * header file.
+ */
+
+void gzl_init_parse_stats(struct gzl_parse_stats *stats, struct gzl_grammar *g)
+{
+    size_t num_strings = 0;
+    size_t size = 2;
+
+    while(g->strings[num_strings])
+        num_strings++;
+    while(size < 2 * num_strings)
+        size *= 2;
+
+    stats->grammar        = g;
+    stats->rtns           = calloc(g->num_rtns + 1, sizeof(*stats->rtns));
+    stats->terminals      = calloc(size, sizeof(*stats->terminals));
+    stats->terminals_mask = size - 1;
+    stats->terminal_end   = 0;
+}
+
+void gzl_free_parse_stats(struct gzl_parse_stats *stats)
+{
+    free(stats->rtns);
+    free(stats->terminals);
+}
+
+struct gzl_stat *gzl_terminal_stat(struct gzl_parse_stats *stats, char *name)
+{
+    struct gzl_terminal_stat *t = &stats->terminals[terminal_slot(stats, name)];
+    return t->name ? &t->stat : NULL;
+}
+
+void gzl_stats_end_rule_cb(struct gzl_parse_state *s)
+{
+    struct gzl_parse_stats *stats = s->user_data;
+    struct gzl_parse_stack_frame *frame = DYNARRAY_GET_TOP(s->parse_stack);
+    size_t start = frame->start_byte;
+    size_t end = stats->terminal_end > start ? stats->terminal_end : start;
+
+    add_to_stat(&stats->rtns[frame->f.rtn_frame.rtn], start, end);
+}
+
+void gzl_stats_terminal_cb(struct gzl_parse_state *s,
+                           struct gzl_terminal *terminal)
+{
+    struct gzl_parse_stats *stats = s->user_data;
+    struct gzl_terminal_stat *t =
+        &stats->terminals[terminal_slot(stats, terminal->name)];
+
+    t->name = terminal->name;
+    stats->terminal_end = terminal->start_byte + terminal->len;
+    add_to_stat(&t->stat, terminal->start_byte, stats->terminal_end);
+}
+
+/*
+ * Local Variables:
+ * c-file-style: "bsd"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ * vim:et:sts=4:sw=4
+ */
@@ -0,0 +1,196 @@
+/*********************************************************************
+
+  Gazelle: a system for building fast, reusable parsers
+
+  threaded.c
+
+  An alternative main loop for the interpreter in parse.c.  The IntFAs
+  of a loaded grammar are compiled into a compact bytecode -- a byte
+  class map and a table of next states per IntFA, plus a one-byte
+  opcode per state -- and the input is run through it with
+  computed-goto dispatch.  The position in the input, the current
+  IntFA state and the line/column counters stay in locals for as long
+  as we are inside a token; only token boundaries go back through
+  parse.c (do_intfa_transition() and process_terminal()), so the
+  results are identical to gzl_parse().
+
+  This file is #included after parse.c and uses its internals.
+
+*********************************************************************/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gazelle/parse.h"
+
+/*
+ * Opcodes, one per IntFA state.  Every IntFA also gets one extra "boundary"
+ * state, which is where bytes with no transition lead.
+ */
+enum gzl_opcode {
+    /* Keep lexing the current token. */
+    GZL_OP_SHIFT,
+
+    /* A final state with no outgoing transitions: the token is complete. */
+    GZL_OP_EMIT,
+
+    /* No transition on this byte: end the token (longest match) or report
+     * an error, by way of do_intfa_transition(). */
+    GZL_OP_BOUNDARY
+};
+
+#define GZL_BYTECODE_MAX_STATES 0xFFFF
+
+struct gzl_bytecode_intfa {
+    /* Bytes that every state treats the same way share a class. */
+    uint8_t classes[256];
+    uint16_t num_classes;
+
+    /* ops[num_states] is the boundary state's opcode. */
+    uint16_t boundary_state;
+    uint8_t *ops;
+
+    /* next[state * num_classes + class] is the destination state. */
+    uint16_t *next;
+};
+
+/*
+ * The whole bytecode for a grammar lives in one allocation hanging off
+ * gzl_grammar, so gzl_free_grammar() can free() it without knowing its
+ * layout.  num_intfas is 0 if the grammar could not be compiled (an IntFA
+ * had too many states), in which case we fall back to gzl_parse().
+ */
+struct gzl_bytecode {
+    int num_intfas;
+    struct gzl_bytecode_intfa intfas[];
+};
+
+/*
+ * classify_bytes(): fills in the next-state table for every (state, byte)
+ * pair using the interpreter's own find_intfa_transition(), so that the two
+ * engines agree exactly, then groups bytes with identical columns into
+ * classes.  Returns the number of classes.
+ */
+static
+int classify_bytes(struct gzl_intfa *intfa, uint16_t *full_next,
+                   uint8_t *classes, int *class_reps)
+{
+    int num_classes = 0;
+    int state, b, c;
+
+    for(state = 0; state < intfa->num_states; state++) {
+        for(b = 0; b < 256; b++) {
+            struct gzl_intfa_transition *t =
+                find_intfa_transition(&intfa->states[state], (char)b);
+            full_next[state * 256 + b] =
+                t ? t->dest_state - intfa->states : intfa->num_states;
+        }
+    }
+
+    for(b = 0; b < 256; b++) {
+        for(c = 0; c < num_classes; c++) {
+            int rep = class_reps[c];
+            for(state = 0; state < intfa->num_states; state++)
+                if(full_next[state * 256 + b] != full_next[state * 256 + rep])
+                    break;
+            if(state == intfa->num_states)
+                break;
+        }
+        if(c == num_classes)
+            class_reps[num_classes++] = b;
+        classes[b] = c;
+    }
+
+    return num_classes;
+}
+
+static
+enum gzl_opcode opcode_for_state(struct gzl_intfa_state *state)
+{
+    if(state->final && state->num_transitions == 0)
+        return GZL_OP_EMIT;
+    else
+        return GZL_OP_SHIFT;
+}
+
+/*
+ * compile_bytecode(): builds g->bytecode.  This makes two passes over the
+ * IntFAs: one to size the allocation and one to fill it in.
+ */
+static
+void compile_bytecode(struct gzl_grammar *g)
+{
+    size_t size = sizeof(struct gzl_bytecode) +
+                  g->num_intfas * sizeof(struct gzl_bytecode_intfa);
+    uint8_t classes[256];
+    int class_reps[256];
+    int max_states = 0;
+    int i, state, c;
+
+    for(i = 0; i < g->num_intfas; i++) {
+        if(g->intfas[i].num_states > max_states)
+            max_states = g->intfas[i].num_states;
+    }
+
+    if(max_states >= GZL_BYTECODE_MAX_STATES) {
+        g->bytecode = calloc(1, sizeof(struct gzl_bytecode));
+        return;
+    }
+
+    uint16_t *full_next = malloc(max_states * 256 * sizeof(*full_next));
+
+    for(i = 0; i < g->num_intfas; i++) {
+        struct gzl_intfa *intfa = &g->intfas[i];
+        int num_classes = classify_bytes(intfa, full_next, classes, class_reps);
+        size += (intfa->num_states + 1) * sizeof(uint8_t);
+        size += intfa->num_states * num_classes * sizeof(uint16_t) +
+                sizeof(uint16_t);  /* for alignment */
+    }
+
+    struct gzl_bytecode *bc = malloc(size);
+    uint16_t *next = (uint16_t*)&bc->intfas[g->num_intfas];
+    bc->num_intfas = g->num_intfas;
+
+    for(i = 0; i < g->num_intfas; i++) {
+        struct gzl_intfa *intfa = &g->intfas[i];
+        struct gzl_bytecode_intfa *bi = &bc->intfas[i];
+        int num_classes = classify_bytes(intfa, full_next, bi->classes,
+                                         class_reps);
+
+        bi->num_classes = num_classes;
+        bi->boundary_state = intfa->num_states;
+        bi->next = next;
+        for(state = 0; state < intfa->num_states; state++)
+            for(c = 0; c < num_classes; c++)
+                *next++ = full_next[state * 256 + class_reps[c]];
+
+        /* The opcodes go after the table; round back up to a uint16_t
+         * boundary for the next IntFA's table. */
+        bi->ops = (uint8_t*)next;
+        for(state = 0; state < intfa->num_states; state++)
+            bi->ops[state] = opcode_for_state(&intfa->states[state]);
+        bi->ops[intfa->num_states] = GZL_OP_BOUNDARY;
+        next = (uint16_t*)(bi->ops + ((intfa->num_states + 2) & ~1));
+    }
+
+    free(full_next);
+    g->bytecode = bc;
+}
+
+/*
+ * The main loop, once with callbacks (gzl_parse_threaded()) and once as a
+ * recognizer (gzl_recognize_threaded()).
+ */
+#include "threaded_kernel.c"
+#define GZL_RECOGNIZER 1
+#include "threaded_kernel.c"
+
+/*
+ * Local Variables:
+ * c-file-style: "bsd"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ * vim:et:sts=4:sw=4
+ */
@@ -0,0 +1,166 @@
+/*********************************************************************
+
+  Gazelle: a system for building fast, reusable parsers
+
+  threaded_kernel.c
+
+  The main loop of the threaded engine.  threaded.c #includes this
+  file twice: as-is for gzl_parse_threaded(), and with GZL_RECOGNIZER
+  set for gzl_recognize_threaded(); see kernel.h.
+
+*********************************************************************/
+
+#include "kernel.h"
+
+enum gzl_status gzl_parse_threaded(struct gzl_parse_state *s, char *buf,
+                                   size_t buf_len)
+{
+    struct gzl_grammar *g = gzl_state_grammar(s);
+    enum gzl_status status = start_parse(s);
+    if(status != GZL_STATUS_OK)
+        return status;
+
+    if(!g->bytecode)
+        compile_bytecode(g);
+    if(g->bytecode->num_intfas == 0)
+        return gzl_parse(s, buf, buf_len);
+
+#ifdef __GNUC__
+    static void *dispatch[] = {
+        &&op_shift,
+        &&op_emit,
+        &&op_boundary
+    };
+#   define DISPATCH(op) goto *dispatch[op]
+#else
+#   define DISPATCH(op) \
+        do { \
+            if((op) == GZL_OP_SHIFT) goto op_shift; \
+            else if((op) == GZL_OP_EMIT) goto op_emit; \
+            else goto op_boundary; \
+        } while(0)
+#endif
+
+    size_t len = begin_budget(s, buf_len);
+    unsigned char *p = (unsigned char*)buf;
+    unsigned char *end = p + len;
+    unsigned char ch;
+
+    /* The hot variables.  They are written back to the parse state and its
+     * top frame (SYNC_OUT) whenever we call into parse.c, and re-read from it
+     * afterwards (SYNC_IN), since that may push and pop frames. */
+    struct gzl_parse_stack_frame *frame;
+    struct gzl_bytecode_intfa *bi;
+    uint32_t state, next;
+    size_t byte, line, column;
+    bool last_char_was_newline;
+
+#define SYNC_IN() \
+    do { \
+        frame = DYNARRAY_GET_TOP(s->parse_stack); \
+        bi = &g->bytecode->intfas[frame->f.intfa_frame.intfa]; \
+        state = frame->f.intfa_frame.intfa_state; \
+        byte = s->offset.byte; \
+        line = s->offset.line; \
+        column = s->offset.column; \
+        last_char_was_newline = s->last_char_was_newline; \
+    } while(0)
+
+#define SYNC_OUT() \
+    do { \
+        frame->f.intfa_frame.intfa_state = state; \
+        s->offset.byte = byte; \
+        s->offset.line = line; \
+        s->offset.column = column; \
+        s->last_char_was_newline = last_char_was_newline; \
+    } while(0)
+
+#ifdef GZL_RECOGNIZER
+/* Consumes ch.  Recognizers don't track lines and columns. */
+#define ADVANCE() \
+    do { \
+        p++; \
+        byte++; \
+    } while(0)
+#else
+/* Consumes ch, with the same newline accounting as do_intfa_transition(). */
+#define ADVANCE() \
+    do { \
+        p++; \
+        byte++; \
+        if(ch == 0x0A || ch == 0x0D) { \
+            if(!last_char_was_newline) { \
+                line++; \
+                column = 1; \
+            } \
+            last_char_was_newline = true; \
+        } else { \
+            column++; \
+            last_char_was_newline = false; \
+        } \
+    } while(0)
+#endif
+
+    SYNC_IN();
+
+next_byte:
+    if(p == end)
+        goto done;
+    ch = *p;
+    next = bi->next[state * bi->num_classes + bi->classes[ch]];
+    DISPATCH(bi->ops[next]);
+
+op_shift:
+    state = next;
+    ADVANCE();
+    goto next_byte;
+
+op_emit:
+    /* We just entered a final state with no outgoing transitions. */
+    state = next;
+    ADVANCE();
+    SYNC_OUT();
+    status = process_terminal(
+        s, gzl_frame_intfa_state(s, &frame->f.intfa_frame)->final,
+        frame->start_byte, s->offset.byte - frame->start_byte);
+    if(status != GZL_STATUS_OK)
+        return status;
+    push_intfa_frame_for_gla_or_rtn(s);
+    SYNC_IN();
+    if(p < end && out_of_budget(s))
+        return GZL_STATUS_YIELD;
+    goto next_byte;
+
+op_boundary:
+    /* Let the interpreter handle the byte that ends a token. */
+    SYNC_OUT();
+    status = do_intfa_transition(s, (char)ch);
+    if(status != GZL_STATUS_OK)
+        return status;
+    p++;
+    SYNC_IN();
+    if(p < end && out_of_budget(s))
+        return GZL_STATUS_YIELD;
+    goto next_byte;
+
+done:
+    SYNC_OUT();
+    return end_budget(GZL_STATUS_OK, len, buf_len);
+
+#undef DISPATCH
+#undef SYNC_IN
+#undef SYNC_OUT
+#undef ADVANCE
+}
+
+#undef GZL_RECOGNIZER
+#include "kernel.h"
+
+/*
+ * Local Variables:
+ * c-file-style: "bsd"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ * vim:et:sts=4:sw=4
+ */
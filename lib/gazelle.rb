@@ -8,5 +8,10 @@ module Gazelle
   extend Using
   using :DebuggingSupport
   using :Parser
+  using :IncrementalParse
+  using :PendingParse
+  using :Tree
+  using :EventStream
+  using :CodeGenerator
   using :Gemspec
 end
@@ -0,0 +1,76 @@
+require "fileutils"
+require "rbconfig"
+
+module Gazelle
+  # Compiles a grammar ahead of time into the C source of a Ruby extension,
+  # with the lexers and the RTN and GLA transitions turned into code.
+  # Requiring the built extension defines Gazelle::Compiled::<Name>, a
+  # Gazelle::Parser that needs no .gzc file at runtime:
+  #
+  #   generator = Gazelle::CodeGenerator.new("spec/hello.gzc")
+  #   generator.generate("ext/hello_gazelle")
+  #   generator.build("ext/hello_gazelle")
+  #
+  #   require "ext/hello_gazelle/hello_gazelle"
+  #   Gazelle::Compiled::Hello.new.parse?("(5)")
+  #
+  # Options are passed on to Parser.new, so a :profile lays out the compiled
+  # tables (and the order the generated code tries transitions in) as well.
+  class CodeGenerator
+    BINDINGS_DIR = File.expand_path(File.dirname(__FILE__) + "/../../ext/gazelle_ruby_bindings")
+
+    def initialize(filename, name = nil, options = {})
+      @parser = Parser.new(filename, options)
+      @name   = name || File.basename(filename, ".gzc")
+
+      unless @name =~ /\A[a-z][a-z0-9_]*\z/i
+        raise(ArgumentError, "#{@name.inspect} can't be used to name an extension")
+      end
+    end
+
+    attr_reader :name
+
+    def extension_name
+      "#{name}_gazelle"
+    end
+
+    def class_name
+      name.split("_").map { |word| word.capitalize }.join
+    end
+
+    # Writes <extension_name>.c and an extconf.rb into dir.
+    def generate(dir)
+      FileUtils.mkdir_p(dir)
+      @parser.write_c_extension(File.join(dir, "#{extension_name}.c"), name, class_name)
+      File.open(File.join(dir, "extconf.rb"), "w") { |file| file << extconf }
+      dir
+    end
+
+    # Runs extconf.rb and make in a directory written by generate.
+    def build(dir)
+      Dir.chdir(dir) do
+        system("#{ruby} extconf.rb > /dev/null && make > /dev/null") ||
+          raise("building #{extension_name} in #{dir} failed")
+      end
+      dir
+    end
+
+  private
+
+    def extconf
+      <<-RUBY
+require 'mkmf'
+
+$CFLAGS += " -W -Wall"
+$INCFLAGS = "-I#{BINDINGS_DIR}/includes -I#{BINDINGS_DIR} \#{$INCFLAGS}"
+have_func("rb_ary_resize")
+
+create_makefile(#{extension_name.inspect})
+      RUBY
+    end
+
+    def ruby
+      File.join(RbConfig::CONFIG["bindir"], RbConfig::CONFIG["ruby_install_name"])
+    end
+  end
+end
@@ -0,0 +1,30 @@
+module Gazelle
+  # The events of a parse, handed out one at a time and parsed only as they
+  # are asked for.  See Parser#each_event.
+  class EventStream
+    include Enumerable
+
+    attr_reader :input, :parser
+
+    # The next event, as [kind, name, start, end]: kind is Parser::RULE_START,
+    # RULE_END or TERMINAL, and start and end are byte offsets.  Raises
+    # StopIteration once there are no more.
+    def next
+      @parser.send(:next_event, self)
+    end
+
+    # Yields each event not yet taken.
+    def each(&block)
+      @parser.send(:each_stream_event, self, &block)
+    end
+
+    def finished?
+      !@valid.nil?
+    end
+
+    # Whether the input parsed; nil until the parse has finished.
+    def valid?
+      @valid
+    end
+  end
+end
@@ -0,0 +1,29 @@
+module Gazelle
+  # A parse that is kept up to date as its input is edited, reparsing only as
+  # much of the input as each edit affects.  See Parser#incremental.
+  class IncrementalParse
+    attr_reader :input, :parser
+
+    def valid?
+      @valid
+    end
+
+    # Replaces length bytes of the input at byte offset offset with text, as
+    # String#[]= does for characters, and returns whether the input still
+    # parses.  Offsets and lengths are in bytes whatever the input's
+    # encoding, since the grammar is run over bytes.
+    def edit(offset, length, text)
+      offset += @input.bytesize if offset < 0
+      removed = [length, @input.bytesize - offset].min
+
+      encoding = @input.encoding
+      begin
+        @input.force_encoding(Encoding::BINARY)
+        @input[offset, length] = text.dup.force_encoding(Encoding::BINARY)
+      ensure
+        @input.force_encoding(encoding)
+      end
+      @valid = reparse(offset, removed, text.bytesize)
+    end
+  end
+end
@@ -2,23 +2,145 @@ module Gazelle
   class Parser
     include DebuggingSupport
     
-    def initialize(filename)
-      file = add_extension(expand_path(filename))
-      raise(Errno::ENOENT) unless File.exists?(file)
-      
-      @filename = file
+    # Takes the path to a .gzc file, or an already loaded Gazelle::Grammar
+    # (as compiled parsers do; see CodeGenerator).
+    #
+    # Options:
+    #   :profile  - a profile written by #write_profile for this grammar; the
+    #               grammar is laid out so that the transitions it saw most
+    #               often are found first.
+    #   :optimize - minimize the grammar's lexers and share identical ones
+    #               when it is loaded; see #optimization_report.
+    def initialize(filename, options = {})
+      if filename.is_a?(Grammar)
+        @grammar = filename
+      else
+        file = add_extension(expand_path(filename))
+        raise(Errno::ENOENT) unless File.exists?(file)
+
+        @filename = file
+      end
+
+      if profile = options[:profile]
+        profile = expand_path(profile)
+        raise(Errno::ENOENT, profile) unless File.exists?(profile)
+
+        @profile = profile
+      end
+
+      @optimize = options[:optimize]
+
       @rules = {}
+      @value_rules = {}
+      @record_rules = {}
     end
     
+    # Runs block with the text of each rule or terminal called action.  An
+    # action can also be a path, as in "column_name/UNQUOTED_ID": the last
+    # name is what the block is run for, and only when each name before it
+    # is a rule it's inside (at any depth).  Paths are matched as the input
+    # is parsed, so the block is not called for anything else.
     def on(action, &block)
       @rules[action.to_sym] = block
+      @dispatch = nil
     end
     
     def rules(&block)
       instance_eval(&block)
     end
 
-    attr_writer :debug
+    # A handler for parse_value: a rule's is given the values of its
+    # children (its terminals and subrules, in order) and the byte offsets
+    # it starts and ends at, and returns the rule's value.  A terminal's is
+    # given no values.  Without a handler, a rule's value is the array of
+    # its children's values, and a terminal's is nil.
+    def on_value(action, &block)
+      @value_rules[action.to_sym] = block
+      @value_dispatch = nil
+    end
+
+    # A handler for parse_records: given the rule's slots as an instance of
+    # record_class(action), each member the text last taken through its slot
+    # (or nil).  For "hello -> .digits=/[0-9]+/", record.digits.
+    def on_record(action, &block)
+      @record_rules[action.to_sym] = block
+      @record_dispatch = nil
+    end
+
+    # Parses input, as parse? would, into an IncrementalParse that keeps a
+    # copy of the parse state every :interval bytes (1024 by default), so
+    # that after IncrementalParse#edit only the input between the edit and
+    # the point where the parse is back in step with the old one is parsed
+    # again.  Rules are not run.
+    def incremental(input, options = {})
+      incremental_parse(input.dup, options[:interval] || 1024)
+    end
+
+    # Parses input and, without running any rules, counts how many times
+    # each rule ended and each terminal was matched, and how many bytes they
+    # covered.  Returns a hash of names to {:count => n, :bytes => n}, or nil
+    # if the input doesn't parse.
+    #
+    # Options:
+    #   :rules - the rules and terminals to count; every one that was seen,
+    #            if not given.
+    def stats_for(input, options = {})
+      parse_stats(input, options[:rules])
+    end
+
+    # How to unpack each EVENT_SIZE-byte record each_event_batch yields (a
+    # batch unpacks with EVENT_FORMAT * (batch.size / EVENT_SIZE)): the kind
+    # of event (RULE_START, RULE_END or TERMINAL), the index of its name in
+    # event_names, and the byte offsets it starts and ends at.
+    EVENT_FORMAT = "LLQQ"
+
+    # Parses input as parse does, but rather than running rules, yields
+    # every rule start, rule end and terminal as packed records, batch_size
+    # of them to a string (the last may have fewer).  Ruby is called only
+    # once a batch.  Returns whether the input parsed.
+    def each_event_batch(input, batch_size = 4096, &block)
+      each_event_batch_of(input, batch_size, &block)
+    end
+
+    # Yields every rule start, rule end and terminal of input (a String, or
+    # an IO to read it from) as EventStream#next gives them, and returns
+    # whether the input parsed.  Without a block, returns the EventStream,
+    # which parses the input only as far as the events taken from it, so
+    # memory stays bounded however long the input is.
+    def each_event(input, &block)
+      stream = event_stream(input)
+      return stream unless block
+
+      stream.each(&block)
+      stream.valid?
+    end
+
+    # A debugging parser shows every rule as it runs, not just those with a
+    # handler.
+    def debug=(debug)
+      @debug    = debug
+      @dispatch = nil
+    end
+
+    ENGINES = [:threaded, :interpreter]
+
+    # Which main loop the parser runs: the threaded engine (the default),
+    # or the plain byte-at-a-time interpreter.
+    def engine
+      @engine || :threaded
+    end
+
+    def engine=(engine)
+      raise(ArgumentError, "unknown engine #{engine.inspect}") unless ENGINES.include?(engine)
+      @engine = engine
+    end
+
+    # Called from a rule, stops the parse as soon as the rule returns; parse
+    # then returns that rule's result.  A rule can also throw, or raise, out
+    # of a parse.
+    def stop!
+      @stopped = true
+    end
 
     def run_rule(action, str)
       @last_result = with_action(action, str) do |rule|
@@ -0,0 +1,35 @@
+module Gazelle
+  # A parse that ran out of its budget before the end of its input.  See
+  # Parser#parse.
+  class PendingParse
+    attr_reader :input, :parser
+
+    # Parses on from where the budget ran out, with the same budget again.
+    # Returns self if it runs out again, or else the result of the last rule,
+    # as Parser#parse does.
+    def resume
+      @parser.send(:resume_parse, self)
+    end
+
+    # Writes the parse's state to the file at path, for Parser#load_parse to
+    # pick up again later, in this process or another.
+    def save(path)
+      @parser.send(:save_parse, self, path)
+    end
+
+    # Carries on from the state saved at path instead.  Returns false, leaving
+    # the parse as it was, if the file isn't a saved parse of this grammar.
+    def restore(path)
+      @parser.send(:restore_parse, self, path)
+    end
+
+    def finished?
+      !@valid.nil?
+    end
+
+    # Whether the input parsed; nil until the parse has finished.
+    def valid?
+      @valid
+    end
+  end
+end
@@ -0,0 +1,61 @@
+module Gazelle
+  # The parse tree of an input, kept in one block of memory by the parser
+  # that built it, a few dozen bytes a node.  A node only becomes a Ruby
+  # object (a Tree::Node) when it is visited.  See Parser#parse_tree.
+  class Tree
+    attr_reader :input, :parser
+
+    # The start rule's node.
+    def root
+      node(0)
+    end
+
+    def node(index)
+      kind, name, start, finish, first_child, next_sibling = @parser.send(:tree_node, self, index)
+      Node.new(self, kind, names[name], start, finish, first_child, next_sibling)
+    end
+
+    def names
+      @names ||= @parser.event_names
+    end
+
+    class Node
+      attr_reader :tree, :name, :start, :finish
+
+      def initialize(tree, kind, name, start, finish, first_child, next_sibling)
+        @tree, @kind, @name, @start, @finish = tree, kind, name, start, finish
+        @first_child, @next_sibling = first_child, next_sibling
+      end
+
+      def terminal?
+        @kind == Parser::TERMINAL
+      end
+
+      # The input from the node's first terminal to the end of its last.
+      def text
+        @tree.input[@start...@finish]
+      end
+
+      def each_child
+        index = @first_child
+        while index
+          child = @tree.node(index)
+          yield child
+          index = child.next_sibling_index
+        end
+      end
+
+      def children
+        children = []
+        each_child { |child| children << child }
+        children
+      end
+
+    protected
+
+      def next_sibling_index
+        @next_sibling
+      end
+    end
+  end
+end
@@ -0,0 +1,77 @@
+require File.dirname(__FILE__) + "/spec_helper"
+require "tmpdir"
+
+module Gazelle
+  describe CodeGenerator do
+    GENERATED_GRAMMAR_INPUTS = {
+      "hello" => [
+        "(5)",
+        "((1923423))",
+        "(()",
+        "5",
+        "(5))"
+      ],
+      "create_table" => [
+        "CREATE TABLE foo (bar BIT)",
+        "CREATE TABLE foo (bar BIT, baz INT)",
+        "CREATE TABLE foo (bar VARCHAR(255) DEFAULT NULL)",
+        "CREATE TABLE foo"
+      ]
+    }
+
+    before(:all) do
+      @dir = Dir.mktmpdir("gazelle_code_generator")
+
+      GENERATED_GRAMMAR_INPUTS.keys.each do |name|
+        generator = CodeGenerator.new(File.dirname(__FILE__) + "/#{name}.gzc")
+        dir = File.join(@dir, generator.extension_name)
+        generator.generate(dir)
+        generator.build(dir)
+        require File.join(dir, generator.extension_name)
+      end
+    end
+
+    after(:all) do
+      FileUtils.rm_rf(@dir)
+    end
+
+    def trace(parser, input)
+      parser.debug        = true
+      parser.debug_stream = ""
+      parser.on(:digits) { |str| str.to_i }
+
+      [parser.parse?(input), parser.parse(input), parser.debug_stream]
+    end
+
+    it "should name the extension and class after the grammar" do
+      generator = CodeGenerator.new(File.dirname(__FILE__) + "/create_table.gzc")
+      generator.extension_name.should == "create_table_gazelle"
+      generator.class_name.should == "CreateTable"
+    end
+
+    it "should raise an ArgumentError for a name that isn't a C identifier" do
+      lambda {
+        CodeGenerator.new(File.dirname(__FILE__) + "/hello.gzc", "hello-world")
+      }.should raise_error(ArgumentError)
+    end
+
+    it "should define a Gazelle::Parser that doesn't need the .gzc file" do
+      parser = Compiled::Hello.new
+      parser.should be_a_kind_of(Parser)
+      parser.parse?("(5)").should be_true
+      parser.parse?("(()").should be_false
+    end
+
+    GENERATED_GRAMMAR_INPUTS.each do |name, inputs|
+      inputs.each do |input|
+        it "should run the same callbacks as the interpreter for #{name}: #{input.inspect}" do
+          interpreter = Parser.new(File.dirname(__FILE__) + "/#{name}.gzc")
+          interpreter.engine = :interpreter
+          compiled = Compiled.const_get(CodeGenerator.new(File.dirname(__FILE__) + "/#{name}.gzc").class_name).new
+
+          trace(compiled, input).should == trace(interpreter, input)
+        end
+      end
+    end
+  end
+end
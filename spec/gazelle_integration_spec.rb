@@ -1,4 +1,7 @@
 require File.dirname(__FILE__) + "/spec_helper"
+require "tmpdir"
+require "stringio"
+require "pathname"
 
 module Gazelle
   describe Parser do
@@ -13,6 +16,18 @@ module Gazelle
         parser.parse?("(()").should be_false
       end
 
+      it "should be false for input containing a character no token can contain" do
+        parser = Parser.new(File.dirname(__FILE__) + "/hello.gzc")
+        parser.parse?("(a)").should be_false
+        parser.parse?("!(5)").should be_false
+        parser.parse?("").should be_false
+      end
+
+      it "should still accept valid input followed by anything once the input is complete" do
+        parser = Parser.new(File.dirname(__FILE__) + "/hello.gzc")
+        parser.parse?("(5)!").should be_true
+      end
+
       it "should find the file even when given with a short path" do
         parser = Parser.new("spec/hello.gzc")
         parser.parse?("(5)").should be_true
@@ -39,6 +54,779 @@ module Gazelle
       end
     end
     
+    describe "engines" do
+      before do
+        @parser = Parser.new(File.dirname(__FILE__) + "/hello.gzc")
+      end
+
+      it "should use the threaded engine by default" do
+        @parser.engine.should == :threaded
+      end
+
+      it "should raise an ArgumentError for an unknown engine" do
+        lambda {
+          @parser.engine = :foo
+        }.should raise_error(ArgumentError)
+      end
+
+      Parser::ENGINES.each do |engine|
+        it "should give the same results with the #{engine} engine" do
+          @parser.engine = engine
+          @parser.parse?("((1923423))").should be_true
+          @parser.parse?("(()").should be_false
+
+          yielded_text = nil
+          @parser.on(:hello) { |text| yielded_text = text }
+          @parser.parse("((1923423))")
+          yielded_text.should == "((1923423))"
+        end
+
+        it "should not run any rules in parse? with the #{engine} engine" do
+          @parser.engine = engine
+          @parser.on(:hello)  { raise "hello ran" }
+          @parser.on(:digits) { raise "digits ran" }
+          @parser.parse?("((1923423))").should be_true
+        end
+      end
+    end
+
+    describe "profiling" do
+      before do
+        @grammar = File.dirname(__FILE__) + "/create_table.gzc"
+        @inputs  = ["CREATE TABLE foo (bar BIT, baz INT(11))", "CREATE TABLE foo", "CREATE TABLE (bar BIT)"]
+        @profile = File.join(Dir.tmpdir, "gazelle_spec_#{Process.pid}.profile")
+
+        parser = Parser.new(@grammar)
+        parser.profiling = true
+        @inputs.each { |input| parser.parse?(input) }
+        parser.write_profile(@profile)
+      end
+
+      after do
+        File.delete(@profile) if File.exists?(@profile)
+      end
+
+      def trace(parser, input)
+        parser.debug = true
+        parser.debug_stream = ""
+        [parser.parse?(input), parser.parse(input), parser.debug_stream]
+      end
+
+      it "should not be on by default" do
+        Parser.new(@grammar).profiling?.should be_false
+      end
+
+      Parser::ENGINES.each do |engine|
+        it "should give the same results once laid out by a profile with the #{engine} engine" do
+          @inputs.each do |input|
+            plain = Parser.new(@grammar)
+            plain.engine = engine
+            profiled = Parser.new(@grammar, :profile => @profile)
+            profiled.engine = engine
+
+            trace(profiled, input).should == trace(plain, input)
+          end
+        end
+      end
+
+      it "should raise an ArgumentError for a profile of another grammar" do
+        parser = Parser.new(File.dirname(__FILE__) + "/hello.gzc", :profile => @profile)
+
+        lambda {
+          parser.parse?("(5)")
+        }.should raise_error(ArgumentError)
+      end
+
+      it "should not profile a grammar that was laid out by a profile" do
+        parser = Parser.new(@grammar, :profile => @profile)
+
+        lambda {
+          parser.profiling = true
+        }.should raise_error(ArgumentError)
+      end
+    end
+
+    describe "optimizing" do
+      before do
+        @grammar = File.dirname(__FILE__) + "/create_table.gzc"
+      end
+
+      it "should give the same results as the grammar it was optimized from" do
+        ["CREATE TABLE foo (bar BIT, baz INT(11))", "CREATE TABLE foo", "CREATE TABLE (bar BIT)"].each do |input|
+          plain = Parser.new(@grammar)
+          optimized = Parser.new(@grammar, :optimize => true)
+
+          optimized.parse?(input).should == plain.parse?(input)
+          optimized.parse(input).should == plain.parse(input)
+        end
+      end
+
+      it "should report the size of the lexers before and after" do
+        report = Parser.new(@grammar, :optimize => true).optimization_report
+
+        report[:after][:intfas].should <= report[:before][:intfas]
+        report[:after][:states].should <= report[:before][:states]
+        report[:after][:bytes].should <= report[:before][:bytes]
+      end
+
+      it "should not report anything unless asked to optimize" do
+        Parser.new(@grammar).optimization_report.should be_nil
+      end
+    end
+
+    describe "parsing a file" do
+      before do
+        @parser = Parser.new(File.dirname(__FILE__) + "/create_table.gzc")
+        @file   = File.join(Dir.tmpdir, "gazelle_spec_#{Process.pid}.sql")
+      end
+
+      after do
+        File.delete(@file) if File.exists?(@file)
+      end
+
+      it "should agree with parse? on the file's contents" do
+        ["CREATE TABLE foo (bar BIT, baz INT(11))", "CREATE TABLE foo", "CREATE TABLE foo (bar BIT) junk", "",
+         "CREATE#{" " * 100_000}TABLE foo (bar BIT)", "CREATE TABLE #{"a" * 100_000} (bar BIT)"].each do |input|
+          File.open(@file, "w") { |f| f << input }
+          @parser.parse_file?(@file).should == @parser.parse?(input)
+        end
+      end
+
+      it "should raise an 'Errno::ENOENT' error if the file does not exist" do
+        lambda {
+          @parser.parse_file?(@file)
+        }.should raise_error(Errno::ENOENT)
+      end
+
+      it "should take any path, such as a Pathname" do
+        File.open(@file, "w") { |f| f << "CREATE TABLE foo (bar BIT)" }
+        @parser.parse_file?(Pathname.new(@file)).should be_true
+      end
+
+      it "should raise for something that isn't a path" do
+        lambda { @parser.parse_file?(nil) }.should raise_error(TypeError)
+        lambda { @parser.parse_file?(@file + "\0.sql") }.should raise_error(ArgumentError)
+      end
+    end
+
+    # GAZELLE_LARGE_INPUT_GB=5 streams a table with that many gigabytes of
+    # spaces in it through a pipe, and compares it with one of a gigabyte.
+    # This takes several minutes.
+    if gigabytes = ENV["GAZELLE_LARGE_INPUT_GB"]
+      describe "parsing #{gigabytes} GB of input" do
+        before do
+          @parser = Parser.new(File.dirname(__FILE__) + "/create_table.gzc")
+          @fifo   = File.join(Dir.tmpdir, "gazelle_spec_#{Process.pid}.fifo")
+          system("mkfifo", @fifo) or raise "could not make #{@fifo}"
+        end
+
+        after do
+          File.delete(@fifo) if File.exists?(@fifo)
+        end
+
+        def parse_spaces(gigabytes)
+          writer = fork do
+            File.open(@fifo, "w") do |f|
+              f << "CREATE"
+              spaces = " " * (1 << 20)
+              (gigabytes * 1024).times { f << spaces }
+              f << "TABLE foo (bar BIT)"
+            end
+          end
+          started = Time.now
+          [@parser.parse_file?(@fifo), Time.now - started]
+        ensure
+          Process.wait(writer) if writer
+        end
+
+        def resident_kb
+          File.read("/proc/self/status")[/VmRSS:\s*(\d+)/, 1].to_i
+        end
+
+        it "should parse in constant memory and in time linear in its size" do
+          parsed, one_gb_time = parse_spaces(1)
+          parsed.should be_true
+          memory = resident_kb
+
+          parsed, time = parse_spaces(gigabytes.to_i)
+          parsed.should be_true
+          (resident_kb - memory).should < 16 * 1024
+          time.should < one_gb_time * gigabytes.to_i * 1.5
+        end
+      end
+    end
+
+    describe "several grammars at once" do
+      before do
+        @hello        = Parser.new(File.dirname(__FILE__) + "/hello.gzc")
+        @create_table = Parser.new(File.dirname(__FILE__) + "/create_table.gzc")
+      end
+
+      it "should give the parsers that accept the input" do
+        Parser.accepting([@hello, @create_table], "(5)").should == [@hello]
+        Parser.accepting([@hello, @create_table], "CREATE TABLE foo (bar BIT)").should == [@create_table]
+        Parser.accepting([@hello, @create_table], "(5").should == []
+        Parser.accepting([], "(5)").should == []
+      end
+
+      it "should agree with parse? for each parser" do
+        interpreted = Parser.new(File.dirname(__FILE__) + "/hello.gzc")
+        interpreted.engine = :interpreter
+        parsers = [@hello, @create_table, interpreted, Parser.new(File.dirname(__FILE__) + "/invalid_format.gzc")]
+        ["(5)", "((5))", "(" * 3000 + "5" + ")" * 3000, "(" * 3000 + "5" + ")" * 2999, "",
+         "CREATE TABLE foo (bar BIT#{", baz INT(11)" * 1000})", "CREATE TABLE foo (bar BIT"].each do |input|
+          Parser.accepting(parsers, input).should == parsers.select { |parser| parser.parse?(input) }
+        end
+      end
+
+      it "should only take parsers" do
+        lambda { Parser.accepting([@hello, nil], "(5)") }.should raise_error(TypeError)
+        lambda { Parser.accepting([@hello, "(5)"], "(5)") }.should raise_error(TypeError)
+      end
+
+      it "should take many parsers" do
+        Parser.accepting([@hello, @create_table] * 50_000, "(5)").size.should == 50_000
+      end
+    end
+
+    describe "incremental parsing" do
+      before do
+        @parser = Parser.new(File.dirname(__FILE__) + "/create_table.gzc")
+        @columns = (1..200).map { |i| "c#{i.to_s.tr("0-9", "a-j")} INT(11)" }.join(", ")
+        @input = "CREATE TABLE foo (#{@columns})"
+      end
+
+      it "should agree with parse? after each edit" do
+        parse = @parser.incremental(@input, :interval => 16)
+        parse.should be_valid
+
+        [[20, 0, "x"], [30, 3, ""], [30, 0, "("], [30, 1, ""], [0, 6, "create"], [0, 6, "CREATE"]].each do |edit|
+          parse.edit(*edit).should == @parser.parse?(parse.input)
+          parse.valid?.should == @parser.parse?(parse.input)
+        end
+      end
+
+      it "should take offsets and lengths in bytes" do
+        input = "CREATE TABLE \u00e9 (bar BIT, baz INT(11))"
+        parse = @parser.incremental(input, :interval => 4)
+        parse.should_not be_valid
+
+        parse.edit(input.b.index("bar"), 3, "qux").should be_false
+        parse.input.should == "CREATE TABLE \u00e9 (qux BIT, baz INT(11))"
+
+        parse.edit(13, 2, "foo").should be_true
+        parse.input.should == "CREATE TABLE foo (qux BIT, baz INT(11))"
+        parse.input.encoding.should == input.encoding
+      end
+
+      it "should only reparse around a small edit" do
+        parse = @parser.incremental(@input, :interval => 64)
+        parse.bytes_reparsed.should == @input.length + 1
+
+        parse.edit(@input.index("INT(11), cbab "), 7, "BIT")
+        parse.should be_valid
+        parse.bytes_reparsed.should < 256
+      end
+
+      it "should not change the string it was given" do
+        @parser.incremental(@input).edit(0, 6, "create")
+        @input.should =~ /^CREATE/
+      end
+    end
+
+    describe "parsing with a budget" do
+      before do
+        @parser = Parser.new(File.dirname(__FILE__) + "/create_table.gzc")
+        @input  = "CREATE TABLE foo (bar BIT, baz INT(11))"
+        @ids    = []
+        @parser.on(:UNQUOTED_ID) { |text| @ids << text; text }
+      end
+
+      def finish(parse)
+        parse = parse.resume while parse.is_a?(PendingParse)
+        parse
+      end
+
+      it "should return a PendingParse once the budget runs out" do
+        pending_parse = @parser.parse(@input, :budget => {:transitions => 3})
+        pending_parse.should be_an_instance_of(PendingParse)
+        pending_parse.should_not be_finished
+      end
+
+      [{:bytes => 5}, {:transitions => 3}, {:seconds => 1e-9}].each do |budget|
+        it "should run the same rules and give the same result when resumed (#{budget.keys.first})" do
+          result = finish(@parser.parse(@input, :budget => budget))
+          ids, @ids = @ids, []
+
+          result.should == @parser.parse(@input)
+          ids.should == @ids
+        end
+      end
+
+      it "should tell whether the input parsed once it has finished" do
+        pending_parse = @parser.parse("CREATE TABLE (bar BIT)", :budget => {:bytes => 5})
+        finish(pending_parse)
+
+        pending_parse.should be_finished
+        pending_parse.should_not be_valid
+      end
+
+      it "should not resume a parse that has finished" do
+        pending_parse = @parser.parse(@input, :budget => {:bytes => 5})
+        finish(pending_parse)
+
+        lambda {
+          pending_parse.resume
+        }.should raise_error(RuntimeError)
+      end
+
+      describe "saved to a file" do
+        before do
+          @file = File.join(Dir.tmpdir, "gazelle_spec_#{Process.pid}.state")
+        end
+
+        after do
+          File.delete(@file) if File.exists?(@file)
+        end
+
+        def new_parser(grammar = "create_table")
+          parser = Parser.new(File.dirname(__FILE__) + "/#{grammar}.gzc")
+          parser.on(:UNQUOTED_ID) { |text| @ids << text; text }
+          parser
+        end
+
+        it "should carry on in another parser where it was saved" do
+          expected = @parser.parse(@input)
+          expected_ids, @ids = @ids, []
+
+          @parser.parse(@input, :budget => {:bytes => 20}).save(@file)
+          @ids.should == ["foo"]
+
+          result = finish(new_parser.load_parse(@file, @input, :budget => {:bytes => 5}))
+          result.should == expected
+          @ids.should == expected_ids
+        end
+
+        it "should not load a parse of another grammar" do
+          @parser.parse(@input, :budget => {:bytes => 20}).save(@file)
+
+          lambda {
+            new_parser("hello").load_parse(@file, "((12))")
+          }.should raise_error(ArgumentError)
+        end
+
+        [["truncated", lambda { |state| state[0, state.size / 2] }],
+         ["corrupted", lambda { |state| state.sub(/^rtn (\d+) (\d+)/) { "rtn #{$1} 9999" } }],
+         ["not a saved parse", lambda { |state| "CREATE TABLE foo" }]].each do |name, damage|
+          it "should leave a parse as it was when the file is #{name}" do
+            pending_parse = @parser.parse(@input, :budget => {:bytes => 20})
+            pending_parse.save(@file)
+            File.open(@file, "w") { |f| f.write(damage.call(File.read(@file))) } 
+
+            pending_parse.restore(@file).should be_false
+            lambda {
+              new_parser.load_parse(@file, @input)
+            }.should raise_error(ArgumentError)
+
+            finish(pending_parse).should == @parser.parse(@input)
+            pending_parse.should be_valid
+          end
+        end
+
+        it "should not save a parse that has finished" do
+          pending_parse = @parser.parse(@input, :budget => {:bytes => 5})
+          finish(pending_parse)
+
+          lambda {
+            pending_parse.save(@file)
+          }.should raise_error(RuntimeError)
+        end
+      end
+    end
+
+    describe "stopping" do
+      before do
+        @parser = Parser.new(File.dirname(__FILE__) + "/create_table.gzc")
+        @input  = "CREATE TABLE foo (bar BIT, baz INT(11))"
+        @ids    = []
+      end
+
+      Parser::ENGINES.each do |engine|
+        it "should run no more rules after stop! with the #{engine} engine" do
+          @parser.engine = engine
+          @parser.on(:UNQUOTED_ID) { |text| @ids << text; @parser.stop!; text }
+
+          @parser.parse(@input).should == "foo"
+          @ids.should == ["foo"]
+        end
+      end
+
+      it "should parse as usual after a parse was stopped" do
+        @parser.on(:UNQUOTED_ID) { |text| @ids << text; @parser.stop! if @ids.size == 1; text }
+        @parser.parse(@input)
+        @parser.parse(@input)
+
+        @ids.should == ["foo", "foo", "bar", "baz"]
+      end
+
+      it "should be able to throw out of a parse" do
+        @parser.on(:UNQUOTED_ID) { |text| throw :found, text }
+
+        catch(:found) { @parser.parse(@input) }.should == "foo"
+        @parser.parse?(@input).should be_true
+      end
+
+      it "should finish a parse with a budget" do
+        @parser.on(:UNQUOTED_ID) { |text| @parser.stop!; text }
+        pending_parse = @parser.parse(@input, :budget => {:bytes => 5})
+        result = pending_parse
+        result = result.resume while result.is_a?(PendingParse)
+
+        result.should == "foo"
+        pending_parse.should be_finished
+      end
+    end
+
+    describe "batched events" do
+      before do
+        @parser = Parser.new(File.dirname(__FILE__) + "/hello.gzc")
+      end
+
+      def events(input, batch_size)
+        names  = @parser.event_names
+        events = []
+        parsed = @parser.each_event_batch(input, batch_size) do |batch|
+          batch.size.should <= batch_size * Parser::EVENT_SIZE
+          batch.unpack(Parser::EVENT_FORMAT * (batch.size / Parser::EVENT_SIZE)).each_slice(4) do |kind, name, start, finish|
+            events << [kind, names[name], input[start...finish]]
+          end
+        end
+        [parsed, events]
+      end
+
+      it "should give every rule start, rule end and terminal in order" do
+        events("(5)", 100).should == [true, [
+          [Parser::RULE_START, "hello", ""],  [Parser::TERMINAL, "(", "("],
+          [Parser::RULE_START, "hello", ""],  [Parser::TERMINAL, "digits", "5"],
+          [Parser::RULE_END,   "hello", "5"], [Parser::TERMINAL, ")", ")"],
+          [Parser::RULE_END,   "hello", "(5)"]]]
+      end
+
+      it "should give the same events whatever the size of the batches" do
+        [1, 2, 3, 1000].each do |batch_size|
+          events("((12))", batch_size).should == events("((12))", 4096)
+        end
+      end
+
+      it "should not run any rules" do
+        @parser.on(:hello) { raise "hello ran" }
+        events("(5)", 2).first.should be_true
+      end
+
+      it "should give false for input that doesn't parse" do
+        events("((5)", 2).first.should be_false
+      end
+
+      it "should stop when stopped" do
+        batches = 0
+        @parser.each_event_batch("((12))", 1) { batches += 1; @parser.stop! }.should be_false
+        batches.should == 1
+      end
+    end
+
+    describe "stats" do
+      before do
+        @parser = Parser.new(File.dirname(__FILE__) + "/hello.gzc")
+      end
+
+      it "should count each rule and terminal and the bytes they cover" do
+        @parser.stats_for("((12))").should == {
+          :hello  => {:count => 3, :bytes => 12},
+          :"("    => {:count => 2, :bytes => 2},
+          :")"    => {:count => 2, :bytes => 2},
+          :digits => {:count => 1, :bytes => 2}
+        }
+      end
+
+      it "should only count the rules it's given" do
+        @parser.stats_for("(12)", :rules => [:digits, "hello"]).should == {
+          :digits => {:count => 1, :bytes => 2},
+          :hello  => {:count => 2, :bytes => 6}
+        }
+      end
+
+      it "should raise for a rule the grammar doesn't have" do
+        lambda { @parser.stats_for("(12)", :rules => [:nope]) }.should raise_error(ArgumentError)
+      end
+
+      it "should be nil if the input doesn't parse" do
+        @parser.stats_for("((12)").should be_nil
+      end
+
+      it "should not run any rules" do
+        @parser.on(:hello) { raise "hello ran" }
+        @parser.stats_for("(5)")
+      end
+    end
+
+    describe "feeding input a chunk at a time" do
+      before do
+        @parser = Parser.new(File.dirname(__FILE__) + "/hello.gzc")
+      end
+
+      it "should run rules as the chunks arrive" do
+        digits = []
+        @parser.on(:digits) { |text| digits << text }
+
+        @parser.start
+        @parser.feed("((1").should be_true
+        digits.should == []
+        @parser.feed("23)").should be_true
+        digits.should == ["123"]
+        @parser.feed(")").should be_false
+        @parser.finish.should be_true
+      end
+
+      it "should give a rule's offsets rather than its text" do
+        rules = []
+        @parser.on(:hello) { |range| rules << range }
+
+        @parser.start
+        "((12))".each_char { |c| @parser.feed(c) }
+        @parser.finish
+        rules.should == [2...4, 1...5, 0...6]
+      end
+
+      it "should run the rules that only end with the input" do
+        digits = []
+        @parser.on(:digits) { |text| digits << text }
+
+        @parser.start
+        @parser.feed("12")
+        @parser.feed("34")
+        digits.should == []
+        @parser.finish.should be_true
+        digits.should == ["1234"]
+      end
+
+      it "should not accept input that ends too soon" do
+        @parser.start
+        @parser.feed("((12)")
+        @parser.finish.should be_false
+      end
+
+      it "should stop taking input once it's invalid" do
+        @parser.start
+        @parser.feed("(a").should be_false
+        @parser.feed("1)").should be_false
+        @parser.finish.should be_false
+      end
+
+      it "should raise without a parse to feed" do
+        lambda { @parser.feed("1") }.should raise_error(RuntimeError)
+      end
+
+      it "should keep the parse while rules collect garbage" do
+        digits = []
+        @parser.on(:digits) { |text| GC.start; digits << text }
+        @parser.on(:hello) { |range| GC.start; range }
+
+        3.times do
+          @parser.start
+          @parser.feed("((1").should be_true
+          @parser.feed("2)").should be_true
+          @parser.feed(")")
+          @parser.finish.should be_true
+
+          @parser.start
+          @parser.feed("12")
+          @parser.feed("34")
+          @parser.finish.should be_true
+        end
+        digits.uniq.should == ["12", "1234"]
+      end
+
+      it "should not let rules start, feed or finish the parse they're in" do
+        [lambda { @parser.start }, lambda { @parser.feed("2") }, lambda { @parser.finish }].each do |reenter|
+          @parser.on(:digits) { reenter.call }
+          @parser.start
+          lambda { @parser.feed("(1)") }.should raise_error(RuntimeError)
+          @parser.finish.should be_false
+
+          @parser.start
+          @parser.feed("1")
+          lambda { @parser.finish }.should raise_error(RuntimeError)
+        end
+      end
+
+      it "should be done with the parse once finish has raised" do
+        @parser.on(:digits) { raise "boom" }
+        @parser.start
+        @parser.feed("12")
+        lambda { @parser.finish }.should raise_error(RuntimeError, "boom")
+        lambda { @parser.finish }.should raise_error(RuntimeError)
+      end
+    end
+
+    describe "event streams" do
+      before do
+        @parser = Parser.new(File.dirname(__FILE__) + "/hello.gzc")
+      end
+
+      it "should yield each event with its name and offsets" do
+        events = []
+        @parser.each_event("(5)") { |event| events << event }.should be_true
+        events.should == [
+          [Parser::RULE_START, "hello",  0, 0],
+          [Parser::TERMINAL,   "(",      0, 1],
+          [Parser::RULE_START, "hello",  1, 1],
+          [Parser::TERMINAL,   "digits", 1, 2],
+          [Parser::RULE_END,   "hello",  1, 2],
+          [Parser::TERMINAL,   ")",      2, 3],
+          [Parser::RULE_END,   "hello",  0, 3]
+        ]
+      end
+
+      it "should only read as much of the input as the events taken need" do
+        parser = Parser.new(File.dirname(__FILE__) + "/create_table.gzc")
+        input  = StringIO.new("CREATE" + " " * 10_000 + "TABLE foo (bar BIT)")
+
+        stream = parser.each_event(input)
+        stream.next.should == [Parser::RULE_START, "create_table", 0, 0]
+        stream.should_not be_finished
+        input.pos.should < 10_000
+
+        stream.to_a.last.should == [Parser::RULE_END, "create_table", 0, 10_025]
+        stream.should be_finished
+        stream.valid?.should be_true
+      end
+
+      it "should raise StopIteration after the last event" do
+        stream = @parser.each_event("5")
+        3.times { stream.next }
+        lambda { stream.next }.should raise_error(StopIteration)
+        stream.valid?.should be_true
+      end
+
+      it "should read the input from an IO" do
+        parser = Parser.new(File.dirname(__FILE__) + "/create_table.gzc")
+        input  = "CREATE TABLE foo (" + (["bar BIT"] * 100).join(", ") + ")"
+
+        parser.each_event(StringIO.new(input)).to_a.should == parser.each_event(input).to_a
+      end
+    end
+
+    describe "parsing to a value" do
+      before do
+        @parser = Parser.new(File.dirname(__FILE__) + "/hello.gzc")
+      end
+
+      it "should give each rule its children's values and its offsets" do
+        input = "((12))"
+        @parser.on_value(:digits) { |values, start, finish| input[start...finish].to_i }
+        @parser.on_value(:hello) do |values, start, finish|
+          values.size == 1 ? values.first : values[1] + 1
+        end
+
+        @parser.parse_value(input).should == 14
+      end
+
+      it "should give the offsets of the rule's text" do
+        @parser.on_value(:hello) { |values, start, finish| [start, finish] }
+        @parser.parse_value("((12))").should == [0, 6]
+      end
+
+      it "should give the children's values as an array for a rule without a handler" do
+        @parser.on_value(:digits) { 12 }
+        @parser.parse_value("((12))").should == [nil, [nil, [12], nil], nil]
+      end
+
+      it "should be nil if the input doesn't parse" do
+        @parser.on_value(:hello) { 1 }
+        @parser.parse_value("((12)").should be_nil
+      end
+
+      it "should not run the rules given to on" do
+        @parser.on(:hello) { raise "hello ran" }
+        @parser.parse_value("(5)")
+      end
+    end
+
+    describe "parse trees" do
+      before do
+        @parser = Parser.new(File.dirname(__FILE__) + "/hello.gzc")
+      end
+
+      def outline(node)
+        [node.name, node.text] + node.children.map { |child| outline(child) }
+      end
+
+      it "should have a node for every rule and terminal" do
+        outline(@parser.parse_tree("((12))").root).should ==
+          ["hello", "((12))",
+            ["(", "("],
+            ["hello", "(12)", ["(", "("], ["hello", "12", ["digits", "12"]], [")", ")"]],
+            [")", ")"]]
+      end
+
+      it "should give each node's offsets" do
+        root = @parser.parse_tree("(5)").root
+        [root.start, root.finish].should == [0, 3]
+        root.children.map { |child| [child.start, child.finish] }.should == [[0, 1], [1, 2], [2, 3]]
+      end
+
+      it "should tell terminals from rules" do
+        root = @parser.parse_tree("(5)").root
+        root.should_not be_terminal
+        root.children.map { |child| child.terminal? }.should == [true, false, true]
+      end
+
+      it "should be nil if the input doesn't parse" do
+        @parser.parse_tree("((12)").should be_nil
+      end
+    end
+
+    describe "records" do
+      before do
+        @parser = Parser.new(File.dirname(__FILE__) + "/hello.gzc")
+      end
+
+      it "should have a member for each slot that has a name" do
+        @parser.record_class(:hello).members.map { |member| member.to_s }.should == ["hello", "digits"]
+      end
+
+      it "should make a rule's record class only once" do
+        @parser.record_class(:hello).should equal(@parser.record_class(:hello))
+      end
+
+      it "should give each rule its slots' texts" do
+        records = []
+        @parser.on_record(:hello) { |record| records << record.to_a }
+
+        @parser.parse_records("((12))").should be_true
+        records.should == [[nil, "12"], ["12", nil], ["(12)", nil]]
+      end
+
+      it "should number slots that share a name" do
+        parser = Parser.new(File.dirname(__FILE__) + "/create_table.gzc")
+        parser.record_class(:QUOTED_ID).members.map { |member| member.to_s }.should ==
+          ["BACKTICK", "UNQUOTED_ID", "BACKTICK_2"]
+      end
+
+      it "should fill slots from subrules" do
+        parser = Parser.new(File.dirname(__FILE__) + "/create_table.gzc")
+        columns = []
+        parser.on_record(:column_name_and_type) { |record| columns << [record.column_name, record.column_type] }
+
+        parser.parse_records("CREATE TABLE foo (bar BIT, baz INT(11))")
+        columns.should == [["bar", "BIT"], ["baz", "INT(11)"]]
+      end
+
+      it "should be false if the input doesn't parse" do
+        @parser.parse_records("((12)").should be_false
+      end
+    end
+
     describe "running an action" do
       before do
         @parser = Parser.new(File.dirname(__FILE__) + "/hello.gzc")
@@ -89,6 +877,32 @@ module Gazelle
         @parser.parse("((1923423))")
         yielded_text.should == "((1923423))"
       end
+
+      it "should yield the text of nested rules without the text that follows them" do
+        yielded_text = []
+
+        @parser.on :hello do |text|
+          yielded_text << text
+        end
+
+        @parser.parse("((12))")
+        yielded_text.should == ["12", "(12)", "((12))"]
+      end
+
+      it "should yield text that stays the same when the input is changed" do
+        input = "(5)"
+        @parser.on :hello do |text|
+          input.replace("(6)")
+          text
+        end
+
+        @parser.parse(input).should == "(5)"
+      end
+
+      it "should take input with NUL bytes in it" do
+        @parser.parse?("(5)\0").should be_true
+        @parser.parse?("(5\0)").should be_false
+      end
       
       it "should be able to parse a rule with a block" do
         yielded_text = nil
@@ -127,6 +941,32 @@ module Gazelle
 
         @parser.parse("(5)").should == 5
       end
+
+      it "should return nil if the last rule has no action" do
+        @parser.on "digits" do
+          5
+        end
+
+        @parser.parse("(5)").should be_nil
+      end
+
+      it "should only call run_rule for rules with an action" do
+        @parser.on(:digits) { }
+        @parser.should_receive(:run_rule).once.with(:digits, "5")
+
+        @parser.parse("(5)")
+      end
+
+      it "should run an action added by another action in the same parse" do
+        yielded_text = []
+
+        @parser.on :digits do
+          @parser.on(:hello) { |text| yielded_text << text }
+        end
+
+        @parser.parse("((5))")
+        yielded_text.should == ["5", "(5)", "((5))"]
+      end
     end
     
     describe "parsing subnodes" do
@@ -147,29 +987,60 @@ module Gazelle
         end
 
         it "should yield the column_names_and_types subnode" do
-          pending 'TODO: ISSUE #5 on github' do
-            yielded_text = nil
-            
-            @parser.on :column_names_and_types do |str|
-              yielded_text = str
-            end
-   
-            @parser.parse("CREATE TABLE foo (bar BIT)")
-            yielded_text.should == "bar BIT"
+          yielded_text = nil
+
+          @parser.on :column_names_and_types do |str|
+            yielded_text = str
           end
+
+          @parser.parse("CREATE TABLE foo (bar BIT)")
+          yielded_text.should == "bar BIT"
         end
 
         it "should yield the correct ID (without spaces or extra crap)" do
-          pending "FIXME" do
-            yielded_text = []
-   
-            @parser.on :ID do |text|
-              yielded_text << text
-            end
-   
-            @parser.parse("CREATE TABLE foo (bar BIT)")
-            yielded_text.should == ["foo", "bar"]
+          yielded_text = []
+
+          @parser.on :ID do |text|
+            yielded_text << text
+          end
+
+          @parser.parse("CREATE TABLE foo (bar BIT)")
+          yielded_text.should == ["foo", "bar"]
+        end
+
+        it "should only yield a terminal inside the rules in its path" do
+          yielded_text = []
+
+          @parser.on "column_name/UNQUOTED_ID" do |text|
+            yielded_text << text
           end
+
+          @parser.parse("CREATE TABLE foo (bar BIT, baz BIT)")
+          yielded_text.should == ["bar", "baz"]
+        end
+
+        it "should match a path's rules in order, at any depth" do
+          yielded_text = []
+
+          @parser.on "column_names_and_types/column_name/QUOTED_ID/UNQUOTED_ID" do |text|
+            yielded_text << text
+          end
+          @parser.on "column_name/create_table/UNQUOTED_ID" do |text|
+            yielded_text << text
+          end
+
+          @parser.parse("CREATE TABLE `foo` (bar BIT, `baz` BIT)")
+          yielded_text.should == ["baz"]
+        end
+
+        it "should run both an action for a name and one for a path ending in it" do
+          yielded_text = []
+
+          @parser.on(:ID) { |text| yielded_text << [:any, text] }
+          @parser.on("column_name/ID") { |text| yielded_text << [:column, text] }
+
+          @parser.parse("CREATE TABLE foo (bar BIT)")
+          yielded_text.should == [[:any, "foo"], [:any, "bar"], [:column, "bar"]]
         end
       end
     end